@@ -0,0 +1,140 @@
+#ifndef _CPU_PROFILER_H	//Not all compilers allow "#pragma once"
+#define _CPU_PROFILER_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+
+/*Define CPU_PROFILER_ENABLED as 0 to compile every CPU_PROFILE_ZONE away entirely.*/
+#ifndef CPU_PROFILER_ENABLED
+#define CPU_PROFILER_ENABLED	1
+#endif
+
+#define CPU_PROFILER_RING_SIZE	65536		//How many zones each thread keeps before overwriting its oldest.
+
+
+/*Records scoped zones of host time, for export as a Chrome trace_event file (open it in chrome://tracing or Perfetto).  Each thread writes
+the zones it closes into a ring buffer of its own, so recording takes no locks; only a thread's first zone takes one, to register its
+buffer.  Zones are recorded only while the profiler is enabled at run time, and CPU_PROFILE_ZONE compiles to nothing at all when
+CPU_PROFILER_ENABLED is 0.*/
+class CpuProfiler {
+
+public:
+
+	/*One closed zone.  The name must outlive the profiler, as string literals and pass names do.*/
+	struct Zone {
+		const char* name;
+		long long start_ns;
+		long long duration_ns;
+	};
+
+	static void SetEnabled(bool enabled) { GetEnabled().store(enabled, std::memory_order_relaxed); }
+	static bool IsEnabled() { return GetEnabled().load(std::memory_order_relaxed); }
+
+	/*Returns the time since the profiler's epoch, in nanoseconds.*/
+	static long long Now() {
+		static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	/*Records a closed zone on the calling thread.*/
+	static void Record(const char* name, long long startNs, long long durationNs) {
+		ThreadBuffer& buffer = GetThreadBuffer();
+		Zone& zone = buffer.ring[buffer.next];
+		zone.name = name;
+		zone.start_ns = startNs;
+		zone.duration_ns = durationNs;
+		buffer.next = (buffer.next + 1) % CPU_PROFILER_RING_SIZE;
+		if (buffer.next == 0) buffer.wrapped = true;
+	}
+
+	/*Writes every recorded zone, from every thread, to the given file as Chrome trace_event JSON.  Zones closed while this runs may or may
+	not make it in, so call it when the other threads are idle.  Returns false if the file could not be written.*/
+	static bool WriteChromeTrace(const char* filename) {
+		std::ofstream file(filename);
+		if (!file) return false;
+		file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+		for (const std::unique_ptr<ThreadBuffer>& buffer : GetRegistry()) {
+			int count = buffer->wrapped ? CPU_PROFILER_RING_SIZE : buffer->next;
+			int start = buffer->wrapped ? buffer->next : 0;
+			for (int i = 0; i < count; i++) {
+				const Zone& zone = buffer->ring[(start + i) % CPU_PROFILER_RING_SIZE];
+				file << (first ? "\n" : ",\n") << "{\"name\":\"";
+				for (const char* c = (zone.name == nullptr) ? "<unnamed>" : zone.name; *c != 0; c++) {
+					if (*c == '"' || *c == '\\') file << '\\';
+					file << *c;
+				}
+				file << "\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_index
+					<< ",\"ts\":" << (zone.start_ns / 1000) << "." << ((zone.start_ns % 1000) / 100)
+					<< ",\"dur\":" << (zone.duration_ns / 1000) << "." << ((zone.duration_ns % 1000) / 100) << "}";
+				first = false;
+			}
+		}
+		file << "\n]}\n";
+		return (bool)file;
+	}
+
+	/*Forgets every recorded zone.  Like WriteChromeTrace(), call it when the other threads are idle.*/
+	static void Reset() {
+		std::lock_guard<std::mutex> lock(GetRegistryMutex());
+		for (const std::unique_ptr<ThreadBuffer>& buffer : GetRegistry()) { buffer->next = 0; buffer->wrapped = false; }
+	}
+
+
+private:
+
+	/*A thread's ring of zones.  Buffers belong to the registry rather than their threads, so a thread's zones outlive it.*/
+	struct ThreadBuffer {
+		std::vector<Zone> ring;
+		int next = 0;
+		bool wrapped = false;
+		int thread_index = 0;
+	};
+
+	static std::atomic<bool>& GetEnabled() { static std::atomic<bool> enabled(false); return enabled; }
+	static std::mutex& GetRegistryMutex() { static std::mutex mutex; return mutex; }
+	static std::vector<std::unique_ptr<ThreadBuffer>>& GetRegistry() { static std::vector<std::unique_ptr<ThreadBuffer>> registry; return registry; }
+
+	static ThreadBuffer& GetThreadBuffer() {
+		thread_local ThreadBuffer* buffer = nullptr;
+		if (buffer == nullptr) {
+			std::unique_ptr<ThreadBuffer> created(new ThreadBuffer());
+			created->ring.resize(CPU_PROFILER_RING_SIZE);
+			std::lock_guard<std::mutex> lock(GetRegistryMutex());
+			created->thread_index = (int)GetRegistry().size();
+			buffer = created.get();
+			GetRegistry().push_back(std::move(created));
+		}
+		return *buffer;
+	}
+
+};
+
+
+/*Records the enclosing scope as a zone, if the profiler is enabled when the scope opens.*/
+class CpuProfileZone {
+	const char* _name;
+	long long _start;
+public:
+	CpuProfileZone(const char* name) : _name(name), _start(CpuProfiler::IsEnabled() ? CpuProfiler::Now() : -1) {}
+	~CpuProfileZone() { if (_start >= 0) CpuProfiler::Record(_name, _start, CpuProfiler::Now() - _start); }
+	CpuProfileZone(const CpuProfileZone&) = delete;
+	CpuProfileZone& operator=(const CpuProfileZone&) = delete;
+};
+
+
+#define CPU_PROFILE_CONCATENATE_INNER(a, b)	a##b
+#define CPU_PROFILE_CONCATENATE(a, b)		CPU_PROFILE_CONCATENATE_INNER(a, b)
+#if CPU_PROFILER_ENABLED
+#define CPU_PROFILE_ZONE(name)		CpuProfileZone CPU_PROFILE_CONCATENATE(_cpu_profile_zone_, __LINE__)(name)
+#else
+#define CPU_PROFILE_ZONE(name)		((void)0)
+#endif
+
+
+#endif
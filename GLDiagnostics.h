@@ -0,0 +1,188 @@
+#ifndef _GL_DIAGNOSTICS_H	//Not all compilers allow "#pragma once"
+#define _GL_DIAGNOSTICS_H
+
+#include <GL/glew.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <utility>
+
+#define GL_DIAGNOSTICS_LOG_SIZE		256		//How many distinct messages the log keeps.  Repeats only bump their count.
+
+
+/*Collects OpenGL errors and warnings through the KHR_debug callback, instead of a synchronous glGetError() after every call.  Once Enable()
+has installed the callback, the driver reports each problem as it happens, and it is logged against the pass and object named by the last
+call to SetContext(), and tallied by the pair.  Without KHR_debug (or before Enable()), CHECK_GL_ERROR falls back to glGetError() as it
+always did.  In release builds (with NDEBUG defined), CHECK_GL_ERROR and GL_DIAGNOSTICS_CONTEXT compile to nothing.*/
+class GLDiagnostics {
+
+public:
+
+	/*One distinct message, with where it was first seen and how many times it has come up.*/
+	struct Entry {
+		GLenum source;
+		GLenum type;
+		GLuint id;
+		GLenum severity;
+		std::string message;
+		std::string pass;
+		std::string object;
+		std::string location;
+		int count;
+	};
+
+	/*Installs the debug callback, if the context supports KHR_debug.  Synchronous output makes the driver report a problem inside the
+	call that caused it, which costs some speed but makes the context exact.  Returns whether the callback was installed.*/
+	static bool Enable(bool synchronous = true) {
+		if (!GLEW_KHR_debug && !GLEW_VERSION_4_3) return false;
+		glEnable(GL_DEBUG_OUTPUT);
+		if (synchronous) glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+		else glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+		glDebugMessageCallback(Callback, nullptr);
+		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_TRUE);
+		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, nullptr, GL_FALSE);
+		GetState().enabled = true;
+		return true;
+	}
+
+	static bool IsEnabled() { return GetState().enabled; }
+
+	/*Names the pass and object whose calls are being made, for the log.  Either may be nullptr.  The strings must outlive the calls.*/
+	static void SetContext(const char* pass, const char* object) {
+		State& state = GetState();
+		state.pass = pass;
+		state.object = object;
+	}
+
+	/*Marks a point in the code.  With the callback installed, this costs no GPU sync:  it only names the location for the log, and returns
+	the first error reported since the last check, if any (calling glGetError() only then, for its code).  A driver may report an error 
+	through the callback without raising an error code; for those this prints the type and id the callback captured, and returns 
+	GL_NO_ERROR.  Without the callback, this calls glGetError() and prints any error, as it always did.*/
+	static GLenum Check(const char* location, const char* detail1 = nullptr, const char* detail2 = nullptr) {
+		State& state = GetState();
+		if (state.enabled) {
+			state.location = location;
+			if (!state.error_pending) return GL_NO_ERROR;
+
+			//A debug message carries no error code, so fetch it now there is known to be one.
+			state.error_pending = false;
+			GLenum error = glGetError();
+			if (error == GL_NO_ERROR)
+				std::cerr << location << "  OpenGL " << GetTypeName(state.pending_type) << " " << state.pending_id << " reported with no error code:  " 
+					<< state.pending_message << std::endl;
+			return error;
+		}
+		GLenum error = glGetError();
+		if (error != 0) {
+			std::cerr << location;
+			if (detail1 != nullptr || detail2 != nullptr) std::cerr << "  " << (detail1 == nullptr ? "<null>" : detail1);
+			if (detail2 != nullptr) std::cerr << "  " << detail2;
+			std::cerr << "  OpenGL error:" << error << "  " << glewGetErrorString(error) << std::endl;
+		}
+		return error;
+	}
+
+	/*Returns the distinct messages logged so far, oldest first.*/
+	static const std::vector<Entry>& GetLog() { return GetState().log; }
+
+	/*Returns the number of errors (not warnings) reported so far, repeats included.*/
+	static int GetErrorCount() { return GetState().error_count; }
+
+	/*Returns how many messages, repeats included, were reported against the given pass and object.*/
+	static int GetTally(const std::string& pass, const std::string& object) {
+		const std::map<std::pair<std::string, std::string>, int>& tallies = GetState().tallies;
+		auto it = tallies.find(std::make_pair(pass, object));
+		return (it == tallies.end()) ? 0 : it->second;
+	}
+
+	/*Prints the tallies by pass and object, then the log.*/
+	static void WriteReport(std::ostream& out) {
+		State& state = GetState();
+		out << state.error_count << " OpenGL errors reported." << std::endl;
+		for (const auto& tally : state.tallies)
+			out << "  pass '" << tally.first.first << "', object '" << tally.first.second << "':  " << tally.second << std::endl;
+		for (const Entry& entry : state.log)
+			out << "  [" << entry.count << "x] " << GetTypeName(entry.type) << " " << entry.id << " in pass '" << entry.pass << "', object '" << entry.object
+				<< "', after " << entry.location << ":  " << entry.message << std::endl;
+	}
+
+	static void ClearLog() {
+		State& state = GetState();
+		state.log.clear();
+		state.tallies.clear();
+		state.error_count = 0;
+		state.error_pending = false;
+	}
+
+
+private:
+
+	struct State {
+		bool enabled = false;
+		const char* pass = nullptr;
+		const char* object = nullptr;
+		const char* location = nullptr;
+		bool error_pending = false;
+		GLenum pending_type = 0;			//The first error reported since the last check.
+		GLuint pending_id = 0;
+		std::string pending_message;
+		int error_count = 0;
+		std::vector<Entry> log;
+		std::map<std::pair<std::string, std::string>, int> tallies;
+	};
+
+	static State& GetState() { static State state; return state; }
+
+	static const char* GetTypeName(GLenum type) {
+		switch (type) {
+		case GL_DEBUG_TYPE_ERROR: return "error";
+		case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behavior";
+		case GL_DEBUG_TYPE_PORTABILITY: return "portability";
+		case GL_DEBUG_TYPE_PERFORMANCE: return "performance";
+		default: return "other";
+		}
+	}
+
+	/*The KHR_debug callback.  Logs the message against the current context, and prints it the first time it is seen.*/
+	static void GLAPIENTRY Callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void*) {
+		State& state = GetState();
+		std::string pass = (state.pass == nullptr) ? "" : state.pass;
+		std::string object = (state.object == nullptr) ? "" : state.object;
+		state.tallies[std::make_pair(pass, object)]++;
+		if (type == GL_DEBUG_TYPE_ERROR) {
+			state.error_count++;
+			if (!state.error_pending) {
+				state.pending_type = type;
+				state.pending_id = id;
+				state.pending_message.assign(message, (length < 0) ? std::strlen(message) : (size_t)length);
+			}
+			state.error_pending = true;
+		}
+
+		for (Entry& entry : state.log) {
+			if (entry.id == id && entry.source == source && entry.type == type && entry.pass == pass && entry.object == object) { entry.count++; return; }
+		}
+		if ((int)state.log.size() >= GL_DIAGNOSTICS_LOG_SIZE) state.log.erase(state.log.begin());
+		Entry entry = { source, type, id, severity, std::string(message, (length < 0) ? std::strlen(message) : (size_t)length), pass, object,
+			(state.location == nullptr) ? "<start>" : state.location, 1 };
+		state.log.push_back(entry);
+		std::cerr << "OpenGL " << GetTypeName(type) << " " << id << " in pass '" << pass << "', object '" << object << "', after " << entry.location
+			<< ":  " << entry.message << std::endl;
+	}
+
+};
+
+
+#ifdef NDEBUG
+#define CHECK_GL_ERROR(...)					((GLenum)GL_NO_ERROR)
+#define GL_DIAGNOSTICS_CONTEXT(pass, object)	((void)0)
+#else
+#define CHECK_GL_ERROR(...)					GLDiagnostics::Check(__VA_ARGS__)
+#define GL_DIAGNOSTICS_CONTEXT(pass, object)	GLDiagnostics::SetContext(pass, object)
+#endif
+
+
+#endif
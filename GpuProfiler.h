@@ -0,0 +1,239 @@
+#ifndef _GPU_PROFILER_H	//Not all compilers allow "#pragma once"
+#define _GPU_PROFILER_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+
+#define GPU_PROFILER_FRAMES		4		//How many frames of queries are kept in flight before their results are read.
+#define GPU_PROFILER_HISTORY	240		//How many samples of each section the rolling statistics cover.
+
+
+/*Times named sections of GPU work with timestamp queries.  Each section is bracketed by a pair of glQueryCounter() timestamps rather than a
+GL_TIME_ELAPSED query, since elapsed-time queries cannot nest, and passes run inside other passes.  The queries of each frame go in their
+own slot of a ring GPU_PROFILER_FRAMES deep, and a slot's results are only read when the ring comes back round to it, by which time the
+GPU has long since finished with them, so reading never stalls.  (If it somehow hasn't, that frame's samples are dropped rather than
+waited for.)  Every section keeps its last GPU_PROFILER_HISTORY samples, from which the rolling min, average, p99 and max are taken.
+A GL context of version 3.3 or later must be current whenever the profiler is used.*/
+class GpuProfiler {
+
+public:
+
+	/*The rolling statistics of one section, in milliseconds.*/
+	struct Stats {
+		int samples = 0;
+		double last = 0.0;
+		double min = 0.0;
+		double average = 0.0;
+		double p99 = 0.0;
+		double max = 0.0;
+	};
+
+	~GpuProfiler() {
+		for (FrameSlot& slot : _slots) if (slot.queries.size() > 0) glDeleteQueries((GLsizei)slot.queries.size(), &slot.queries[0]);
+	}
+
+	/*Starts a new frame:  moves on to the next slot in the ring, first collecting the results that slot held from GPU_PROFILER_FRAMES
+	frames ago.  Call once per displayed frame.  A section still open is abandoned:  its end was never timed, so it takes no sample.*/
+	void BeginFrame() {
+		_open.clear();
+		_current = (_current + 1) % GPU_PROFILER_FRAMES;
+		Collect(_slots[_current]);
+		_frames++;
+	}
+
+	/*Opens a section, which lasts until the matching End().  Sections may nest.*/
+	void Begin(const std::string& name) {
+		FrameSlot& slot = _slots[_current];
+		Span span;
+		span.section = GetSection(name);
+		span.begin_query = NextQuery(slot);
+		span.end_query = NextQuery(slot);
+		glQueryCounter(span.begin_query, GL_TIMESTAMP);
+		_open.push_back((int)slot.spans.size());
+		slot.spans.push_back(span);
+	}
+
+	/*Closes the innermost open section.*/
+	void End() {
+		if (_open.size() == 0) return;
+		FrameSlot& slot = _slots[_current];
+		Span& span = slot.spans[_open.back()];
+		glQueryCounter(span.end_query, GL_TIMESTAMP);
+		span.ended = true;
+		_open.pop_back();
+	}
+
+	/*Gets the rolling statistics of the named section.  Returns false if it has no samples yet.*/
+	bool GetStats(const std::string& name, Stats& stats) const {
+		auto it = _section_indices.find(name);
+		if (it == _section_indices.end()) return false;
+		stats = ComputeStats(_sections[it->second]);
+		return stats.samples > 0;
+	}
+
+	/*Returns the number of section samples dropped because their results were not ready in time.*/
+	long long GetDroppedSamples() const { return _dropped; }
+
+	/*Writes the statistics of every section to the given file as CSV, one row a section.  Returns false if it could not be written.*/
+	bool WriteCSV(const char* filename) const {
+		std::ofstream file(filename);
+		if (!file) return false;
+		file << "section,samples,last_ms,min_ms,avg_ms,p99_ms,max_ms\n";
+		for (const Section& section : _sections) {
+			Stats s = ComputeStats(section);
+			file << "\"" << section.name << "\"," << s.samples << "," << s.last << "," << s.min << "," << s.average << "," << s.p99 << "," << s.max << "\n";
+		}
+		return (bool)file;
+	}
+
+	/*Writes the statistics of every section to the given file as JSON.  Returns false if it could not be written.*/
+	bool WriteJSON(const char* filename) const {
+		std::ofstream file(filename);
+		if (!file) return false;
+		file << "{\n\t\"frames\": " << _frames << ",\n\t\"dropped_samples\": " << _dropped << ",\n\t\"sections\": [";
+		for (size_t i = 0; i < _sections.size(); i++) {
+			Stats s = ComputeStats(_sections[i]);
+			file << ((i > 0) ? ",\n" : "\n") << "\t\t{ \"name\": \"" << EscapeJSON(_sections[i].name) << "\", \"samples\": " << s.samples << ", \"last_ms\": " << s.last
+				<< ", \"min_ms\": " << s.min << ", \"avg_ms\": " << s.average << ", \"p99_ms\": " << s.p99 << ", \"max_ms\": " << s.max << " }";
+		}
+		file << "\n\t]\n}\n";
+		return (bool)file;
+	}
+
+	/*Forgets every sample taken so far.  Queries still in flight are dropped too.*/
+	void Reset() {
+		for (Section& section : _sections) { section.history.clear(); section.next = 0; }
+		for (FrameSlot& slot : _slots) { slot.spans.clear(); slot.used = 0; }
+		_open.clear();
+		_frames = 0;
+		_dropped = 0;
+	}
+
+
+private:
+
+	/*A named section, with a ring of its most recent samples.*/
+	struct Section {
+		std::string name;
+		std::vector<double> history;
+		int next = 0;
+		double last = 0.0;
+	};
+
+	/*One timed occurrence of a section within a frame.*/
+	struct Span {
+		int section;
+		GLuint begin_query;
+		GLuint end_query;
+		bool ended = false;		//Whether End() issued the end query.  A span abandoned open has nothing to read.
+	};
+
+	/*The spans of one frame, and the query objects they use.  The queries are kept and reused from frame to frame.*/
+	struct FrameSlot {
+		std::vector<Span> spans;
+		std::vector<GLuint> queries;
+		int used = 0;
+	};
+
+	std::vector<Section> _sections;
+	std::unordered_map<std::string, int> _section_indices;
+	FrameSlot _slots[GPU_PROFILER_FRAMES];
+	int _current = 0;
+	std::vector<int> _open;
+	long long _frames = 0;
+	long long _dropped = 0;
+
+	int GetSection(const std::string& name) {
+		auto it = _section_indices.find(name);
+		if (it != _section_indices.end()) return it->second;
+		Section section;
+		section.name = name;
+		_sections.push_back(section);
+		_section_indices[name] = (int)_sections.size() - 1;
+		return (int)_sections.size() - 1;
+	}
+
+	GLuint NextQuery(FrameSlot& slot) {
+		if (slot.used == (int)slot.queries.size()) {
+			GLuint query;
+			glGenQueries(1, &query);
+			slot.queries.push_back(query);
+		}
+		return slot.queries[slot.used++];
+	}
+
+	/*Reads back the results of the given slot's spans, adding them to their sections' histories, and empties the slot.*/
+	void Collect(FrameSlot& slot) {
+		for (const Span& span : slot.spans) {
+			if (!span.ended) continue;
+			GLint available = 0;
+			glGetQueryObjectiv(span.end_query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) { _dropped++; continue; }
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(span.begin_query, GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(span.end_query, GL_QUERY_RESULT, &end);
+			AddSample(_sections[span.section], (double)(end - begin) / 1000000.0);
+		}
+		slot.spans.clear();
+		slot.used = 0;
+	}
+
+	static void AddSample(Section& section, double milliseconds) {
+		if ((int)section.history.size() < GPU_PROFILER_HISTORY) section.history.push_back(milliseconds);
+		else section.history[section.next] = milliseconds;
+		section.next = (section.next + 1) % GPU_PROFILER_HISTORY;
+		section.last = milliseconds;
+	}
+
+	static Stats ComputeStats(const Section& section) {
+		Stats stats;
+		stats.samples = (int)section.history.size();
+		if (stats.samples == 0) return stats;
+		std::vector<double> sorted = section.history;
+		std::sort(sorted.begin(), sorted.end());
+		double total = 0.0;
+		for (double sample : sorted) total += sample;
+		stats.last = section.last;
+		stats.min = sorted.front();
+		stats.max = sorted.back();
+		stats.average = total / (double)stats.samples;
+		int p99Index = (int)((stats.samples * 99 + 99) / 100) - 1;
+		stats.p99 = sorted[std::min(std::max(p99Index, 0), stats.samples - 1)];
+		return stats;
+	}
+
+	static std::string EscapeJSON(const std::string& text) {
+		std::string result;
+		for (char c : text) {
+			if (c == '"' || c == '\\') result += '\\';
+			result += c;
+		}
+		return result;
+	}
+
+};
+
+
+/*The profiler the passes and the simulator report to, or nullptr if GPU profiling is off.*/
+GpuProfiler* gpu_profiler = nullptr;
+
+
+/*Times the enclosing scope as a section of the current GPU profiler, if there is one.*/
+class GpuProfileZone {
+	GpuProfiler* _profiler;
+public:
+	GpuProfileZone(const std::string& name) : _profiler(gpu_profiler) { if (_profiler != nullptr) _profiler->Begin(name); }
+	GpuProfileZone(const char* name) : _profiler(gpu_profiler) { if (_profiler != nullptr) _profiler->Begin((name == nullptr) ? "<unnamed>" : name); }
+	/*Times the scope as the numbered instance of the named section, such as one level of several.  The name is only built if profiling.*/
+	GpuProfileZone(const char* name, int index) : _profiler(gpu_profiler) { if (_profiler != nullptr) _profiler->Begin(std::string(name) + " " + std::to_string(index)); }
+	~GpuProfileZone() { if (_profiler != nullptr) _profiler->End(); }
+	GpuProfileZone(const GpuProfileZone&) = delete;
+	GpuProfileZone& operator=(const GpuProfileZone&) = delete;
+};
+
+
+#endif
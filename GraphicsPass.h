@@ -21,6 +21,8 @@
 #include <unordered_map>
 #include "GraphicsObject.h"
 #include "GraphicsWindow.h"
+#include "GpuProfiler.h"
+#include "CpuProfiler.h"
 #include <algorithm>
 
 
@@ -153,7 +155,10 @@ public:
 
 		//std::cout << "blah" << std::endl;
 
+		GL_DIAGNOSTICS_CONTEXT(name, nullptr);
 		CHECK_GL_ERROR("GraphicsPass::Execute start", name);
+		CPU_PROFILE_ZONE(name);
+		GpuProfileZone profileZone(name);
 
 		if (clear_start) ClearBuffer();
 		if (use_Ztesting) glEnable(GL_DEPTH_TEST);
@@ -170,40 +175,37 @@ public:
 			if (Start != nullptr && !Start(window, this, prog)) continue;
 
 			for (auto obj : prog_it.second) {
-				CHECK_GL_ERROR("GraphicsPass::Execute object loop start", name, obj->name);
 				if (obj == nullptr) continue;
 				if (exclusions.count(obj) > 0 ) continue;
 				if (additionalExclusions != nullptr && additionalExclusions->count(obj) > 0) continue;
 
+				//No error checks per object:  the diagnostics layer reports any problem against this pass and object as it happens.
+				GL_DIAGNOSTICS_CONTEXT(name, obj->name);
 				glBindVertexArray(obj->vao_name);
 
 				//Call the pass's object setter
 				if (SetObject != nullptr && !SetObject(window, this, obj, prog)) { glBindVertexArray(NULL);	continue; }
-				CHECK_GL_ERROR("GraphicsPass::Execute called SetObject");
 
 				//Set the object's appearance.
 				if (!obj->SetAppearance(prog)) { glBindVertexArray(NULL); continue; }
-				CHECK_GL_ERROR("GraphicsPass::Execute called SetAppearance");
 
 				//Draw the object.
 				obj->Draw();
-				CHECK_GL_ERROR("GraphicsPass::Execute called Draw");
 
 				glBindVertexArray(NULL);
-				CHECK_GL_ERROR("GraphicsPass::Execute object loop end", name, obj->name);
 			}
-
-			CHECK_GL_ERROR("unknown");
+			GL_DIAGNOSTICS_CONTEXT(name, nullptr);
 
 
 			//Call the pass ender.
 			if (End != nullptr) End(window, this, prog);
-			CHECK_GL_ERROR("GraphicsPass::End");
+			CHECK_GL_ERROR("GraphicsPass::End", name);
 
 			glUseProgram(NULL);
 		}
 
 		CHECK_GL_ERROR("GraphicsWindow::DisplayPass end", name);
+		GL_DIAGNOSTICS_CONTEXT(nullptr, nullptr);
 		if (clear_end) ClearBuffer();
 	}
 };
@@ -91,6 +91,8 @@ protected:
 	void OnDisplay() {
 
 		//std::cout << "OnDisplay" << std::endl;
+		CPU_PROFILE_ZONE("GraphicsWindow::OnDisplay");
+		if (gpu_profiler != nullptr) gpu_profiler->BeginFrame();
 		glClearColor(0.0f, 0.0f, 0.5f,1);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		glEnable(GL_DEPTH_TEST); 
@@ -194,8 +196,10 @@ public:
 		//Initialize the window.
 		int a = 0;
 		char *v[1] = { (char*)"junk" };
-		//glutInitContextFlags(GLUT_DEBUG);
 		glutInit(&a, v);
+#ifndef NDEBUG
+		glutInitContextFlags(GLUT_DEBUG);		//A debug context, so the diagnostics layer hears about every problem.
+#endif
 		glutInitWindowSize(width, height);		// "explicitly defined" size of window.
 		glutInitWindowPosition(-1, -1);			//-1 leaves it up to the windows manager.	
 		glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | GLUT_DOUBLE);
@@ -222,6 +226,9 @@ public:
 			fprintf(stderr, "Error: %s\n", glewGetErrorString(error));
 			throw std::exception("Error in glewInit(): '%s'\n");
 		}
+#ifndef NDEBUG
+		if (GLDiagnostics::Enable()) std::cout << "OpenGL diagnostics layer enabled." << std::endl;
+#endif
 
 		//Start the animation timer.
 		last_frame = std::chrono::steady_clock::now();
@@ -0,0 +1,469 @@
+///Headless batch simulation
+///
+///Runs the CPU water simulator for a fixed number of steps from a scenario file, with no window or OpenGL context, and writes the height
+///and normal frames and the step timings to disk.  It is meant for render-less servers, and as a reproducible throughput benchmark:  the
+///rain is drawn from a seeded generator, so a scenario run twice produces the same frames.
+///
+///Build from this directory, with the cyCodeBase headers on the include path:
+///		g++ -std=c++17 -O2 -mavx2 -pthread -I.. -I<cyCodeBase> headless.cpp ../lodepng.cpp -o headless
+///or with MSVC:
+///		cl /std:c++17 /O2 /arch:AVX2 /EHsc /I.. /I<cyCodeBase> headless.cpp ..\lodepng.cpp
+///
+///Every header this includes, and everything they include in turn, must build without OpenGL:  the CPU simulator and the types it shares
+///with the GPU path (WaveFragment.h, SimulationStats.h, PerturbationLog.h, ObstacleMap.h, CpuProfiler.h, MappedMemory.h and so on) are
+///kept free of it so that this program can use them.  The build stops below if one of them pulls OpenGL in.
+///
+///Usage:  headless <scenario file> [output directory]
+///
+///The scenario file holds one "key = value" setting per line; blank lines and lines starting with '#' are ignored.  See example.scenario.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <filesystem>
+#include "WaterSimulatorCPU.h"
+#if !defined(_WIN32)
+#include "WaterSimulatorPartitioned.h"
+#endif
+#include "ObstacleMap.h"
+#include "PerturbationLog.h"
+#include "lodepng.h"
+
+#if defined(GL_VERSION_1_1) || defined(__gl_h_) || defined(__GL_H__) || defined(__glew_h__)
+#error "A header of the headless build includes OpenGL.  The CPU simulator and the headers it shares must not depend on it."
+#endif
+
+#ifndef PI
+#define PI 3.14159265358979323846
+#endif
+
+
+/*A scripted perturbation, applied just before the given step runs.  A level of -1 drops a raindrop across every level, the same way the
+rain does.*/
+struct ScriptedPerturbation {
+	int step;
+	float x, y;
+	int level;
+	float wave_number;
+	float amplitude;
+	float phase_offset;
+};
+
+/*A scroll of the window, made before the given step.*/
+struct ScriptedScroll {
+	int step;
+	int dx, dy;
+};
+
+/*Everything read from a scenario file.*/
+struct Scenario {
+	int width = 256;
+	int height = 256;
+	int levels = 4;
+	float scale = 1.0f;
+	float depth = 10.0f;
+	float gravity = 9.8f;
+	float surface_tension = 1.0f;
+	float density = 1.0f;
+	float amplitude_time_ebb = 0.5f;
+	float amplitude_distance_ebb = 0.3f;
+	float soliton_speed = 0.75f;
+
+	int steps = 1000;
+	int step_milliseconds = 30;
+	int threads = 0;
+	/*Above 1, the grid is split into this many strips, each stepped by a process of its own with the given number of threads.*/
+	int processes = 1;
+	FragmentEncoding encoding = FullFragments;
+	FragmentStorage storage = DenseStorage;
+	bool sparse_tiles = false;
+
+	/*With mapped storage, where the files go (the system's temporary directory if empty), and how the sweeps over them are cut up.*/
+	std::string mapped_directory;
+	int stream_band_rows = 64;
+	int stream_depth = 4;
+	int stream_lookahead = 2;
+
+	/*The chance of a raindrop each step, out of 20, as the 'r' key sets it in the viewer.*/
+	int rain = 0;
+	unsigned int seed = 1;
+
+	bool border = false;
+	bool square = false;
+	bool bar = false;
+	std::vector<std::string> obstacle_pngs;
+	std::vector<std::vector<float>> obstacle_rectangles;
+	std::vector<std::vector<float>> obstacle_circles;
+	std::vector<ScriptedPerturbation> perturbations;
+	std::vector<ScriptedScroll> scrolls;
+
+	/*A perturbation log to write every perturbation to, and one to replay in place of the rain and the script.*/
+	std::string record;
+	std::string replay;
+
+	/*A file to write a Chrome trace of the run's CPU zones to.*/
+	std::string cpu_trace;
+
+	/*Points, in cells, whose height and normal are sampled after the last step and written to probes.csv.*/
+	std::vector<cy::Point2f> probes;
+
+	std::string output = "headless_out";
+	/*How often a frame is written, in steps.  At 0, only the last frame is.*/
+	int frame_every = 0;
+	bool write_png = true;
+	bool write_raw = false;
+};
+
+
+static bool ParseBool(const std::string& value) { return value == "1" || value == "true" || value == "yes" || value == "on"; }
+
+static std::vector<float> ParseFloats(const std::string& value) {
+	std::vector<float> result;
+	std::istringstream stream(value);
+	float f;
+	while (stream >> f) result.push_back(f);
+	return result;
+}
+
+/*Reads the given scenario file.  Returns false, having said why, if the file could not be read or holds a setting that makes no sense.*/
+static bool LoadScenario(const char* filename, Scenario& scenario) {
+	std::ifstream file(filename);
+	if (!file) { std::cerr << "Could not open scenario file " << filename << std::endl; return false; }
+
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line)) {
+		lineNumber++;
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos || line[start] == '#') continue;
+		size_t equals = line.find('=');
+		if (equals == std::string::npos) { std::cerr << filename << ":" << lineNumber << ": expected 'key = value'" << std::endl; return false; }
+		std::string key = line.substr(start, equals - start);
+		std::string value = line.substr(equals + 1);
+		key.erase(key.find_last_not_of(" \t") + 1);
+		size_t valueStart = value.find_first_not_of(" \t");
+		value = (valueStart == std::string::npos) ? "" : value.substr(valueStart);
+		value.erase(value.find_last_not_of(" \t\r") + 1);
+
+		if (key == "width") scenario.width = std::atoi(value.c_str());
+		else if (key == "height") scenario.height = std::atoi(value.c_str());
+		else if (key == "levels") scenario.levels = std::atoi(value.c_str());
+		else if (key == "scale") scenario.scale = (float)std::atof(value.c_str());
+		else if (key == "depth") scenario.depth = (float)std::atof(value.c_str());
+		else if (key == "gravity") scenario.gravity = (float)std::atof(value.c_str());
+		else if (key == "surface_tension") scenario.surface_tension = (float)std::atof(value.c_str());
+		else if (key == "density") scenario.density = (float)std::atof(value.c_str());
+		else if (key == "amplitude_time_ebb") scenario.amplitude_time_ebb = (float)std::atof(value.c_str());
+		else if (key == "amplitude_distance_ebb") scenario.amplitude_distance_ebb = (float)std::atof(value.c_str());
+		else if (key == "soliton_speed") scenario.soliton_speed = (float)std::atof(value.c_str());
+		else if (key == "steps") scenario.steps = std::atoi(value.c_str());
+		else if (key == "step_milliseconds") scenario.step_milliseconds = std::atoi(value.c_str());
+		else if (key == "threads") scenario.threads = std::atoi(value.c_str());
+		else if (key == "processes") scenario.processes = std::atoi(value.c_str());
+		else if (key == "encoding") {
+			if (value == "packed") scenario.encoding = PackedFragments;
+			else if (value == "full") scenario.encoding = FullFragments;
+			else { std::cerr << filename << ":" << lineNumber << ": encoding must be 'full' or 'packed'" << std::endl; return false; }
+		}
+		else if (key == "storage") {
+			if (value == "paged") scenario.storage = PagedStorage;
+			else if (value == "mapped") scenario.storage = MappedStorage;
+			else if (value == "dense") scenario.storage = DenseStorage;
+			else { std::cerr << filename << ":" << lineNumber << ": storage must be 'dense', 'paged' or 'mapped'" << std::endl; return false; }
+		}
+		else if (key == "mapped_directory") scenario.mapped_directory = value;
+		else if (key == "stream_band_rows") scenario.stream_band_rows = std::atoi(value.c_str());
+		else if (key == "stream_depth") scenario.stream_depth = std::atoi(value.c_str());
+		else if (key == "stream_lookahead") scenario.stream_lookahead = std::atoi(value.c_str());
+		else if (key == "sparse_tiles") scenario.sparse_tiles = ParseBool(value);
+		else if (key == "rain") scenario.rain = std::atoi(value.c_str());
+		else if (key == "seed") scenario.seed = (unsigned int)std::strtoul(value.c_str(), nullptr, 10);
+		else if (key == "border") scenario.border = ParseBool(value);
+		else if (key == "square") scenario.square = ParseBool(value);
+		else if (key == "bar") scenario.bar = ParseBool(value);
+		else if (key == "obstacle_png") scenario.obstacle_pngs.push_back(value);
+		else if (key == "obstacle_rectangle" || key == "obstacle_circle") {
+			//obstacle_rectangle = x0 y0 x1 y1, and obstacle_circle = x y radius.  Either may end with a 0 to cut water back out instead.
+			std::vector<float> v = ParseFloats(value);
+			size_t needed = (key == "obstacle_rectangle") ? 4 : 3;
+			if (v.size() != needed && v.size() != needed + 1) {
+				std::cerr << filename << ":" << lineNumber << ": " << key << " needs " << needed << " numbers" << std::endl;
+				return false;
+			}
+			if (v.size() == needed) v.push_back(1.0f);
+			if (key == "obstacle_rectangle") scenario.obstacle_rectangles.push_back(v);
+			else scenario.obstacle_circles.push_back(v);
+		}
+		else if (key == "perturb" || key == "drop") {
+			//perturb = step x y level waveNumber amplitude [phase], and drop = step x y for a raindrop across every level.
+			std::vector<float> v = ParseFloats(value);
+			ScriptedPerturbation p;
+			if (key == "drop" && v.size() == 3) p = { (int)v[0], v[1], v[2], -1, 0.0f, 1.0f, 0.0f };
+			else if (key == "perturb" && (v.size() == 6 || v.size() == 7)) p = { (int)v[0], v[1], v[2], (int)v[3], v[4], v[5], (v.size() == 7) ? v[6] : 0.0f };
+			else {
+				std::cerr << filename << ":" << lineNumber << ": " << key << " has the wrong number of values" << std::endl;
+				return false;
+			}
+			scenario.perturbations.push_back(p);
+		}
+		else if (key == "scroll") {
+			//scroll = step dx dy, to scroll the window by whole cells before the given step.
+			std::vector<float> v = ParseFloats(value);
+			if (v.size() != 3) { std::cerr << filename << ":" << lineNumber << ": scroll needs 3 numbers" << std::endl; return false; }
+			scenario.scrolls.push_back({ (int)v[0], (int)v[1], (int)v[2] });
+		}
+		else if (key == "record") scenario.record = value;
+		else if (key == "replay") scenario.replay = value;
+		else if (key == "cpu_trace") scenario.cpu_trace = value;
+		else if (key == "probe") {
+			std::vector<float> v = ParseFloats(value);
+			if (v.size() != 2) { std::cerr << filename << ":" << lineNumber << ": probe needs 2 numbers" << std::endl; return false; }
+			scenario.probes.push_back(cy::Point2f(v[0], v[1]));
+		}
+		else if (key == "output") scenario.output = value;
+		else if (key == "frame_every") scenario.frame_every = std::atoi(value.c_str());
+		else if (key == "write_png") scenario.write_png = ParseBool(value);
+		else if (key == "write_raw") scenario.write_raw = ParseBool(value);
+		else { std::cerr << filename << ":" << lineNumber << ": unknown setting '" << key << "'" << std::endl; return false; }
+	}
+
+	if (scenario.width <= 0 || scenario.height <= 0 || scenario.levels <= 0) { std::cerr << "The grid size and levels must be positive." << std::endl; return false; }
+	if (scenario.steps < 0 || scenario.step_milliseconds <= 0) { std::cerr << "The steps and step length must be positive." << std::endl; return false; }
+#if defined(_WIN32)
+	if (scenario.processes > 1) { std::cerr << "processes is only supported on POSIX systems." << std::endl; return false; }
+#endif
+	if (scenario.processes > 1 && !scenario.scrolls.empty()) { std::cerr << "The window cannot scroll with processes above 1." << std::endl; return false; }
+	std::stable_sort(scenario.perturbations.begin(), scenario.perturbations.end(), [](const ScriptedPerturbation& a, const ScriptedPerturbation& b) { return a.step < b.step; });
+	std::stable_sort(scenario.scrolls.begin(), scenario.scrolls.end(), [](const ScriptedScroll& a, const ScriptedScroll& b) { return a.step < b.step; });
+	return true;
+}
+
+
+/*Drops a raindrop at the given cell across every level, with wave numbers rising with the level, as the viewer's rain does.*/
+template <typename Simulator>
+static void Drop(Simulator& simulator, float x, float y, float amplitude, float phaseOffset) {
+	for (int i = 0; i < simulator.levels; i++)
+		simulator.Perturb(cy::Point2f(x, y), i, cy::Point2f(x, y), 1.0f / 5 * (i + 1), amplitude, simulator.currentTime, phaseOffset);
+}
+
+/*Scrolls the given simulator's window.  A simulator whose window cannot scroll is never asked to, since LoadScenario() turns those 
+scenarios down.*/
+static void Scroll(WaterSimulatorCPU& simulator, int dx, int dy) { simulator.Scroll(dx, dy); }
+template <typename Simulator>
+static void Scroll(Simulator&, int, int) {}
+
+/*Writes the normal map of the given simulator as the frame with the given number.  The PNGs hold the summed heights as grey (mapped from
+[-levels, levels]) and the normals as RGB; the raw file holds the normal map itself, as width*height RGBA floats.*/
+template <typename Simulator>
+static bool WriteFrame(const Simulator& simulator, const Scenario& scenario, int frame) {
+	char name[32];
+	std::snprintf(name, sizeof(name), "%06d", frame);
+	std::filesystem::path base = std::filesystem::path(scenario.output) / name;
+	const auto& normals = simulator.GetNormalMap();
+	size_t cells = (size_t)simulator.width * simulator.height;
+
+	if (scenario.write_png) {
+		std::vector<unsigned char> heights(cells * 4), colors(cells * 4);
+		float range = (float)simulator.levels;
+		for (size_t i = 0; i < cells; i++) {
+			const cy::Point4f& n = normals[i];
+			float h = std::min(std::max((n.w / range) * 0.5f + 0.5f, 0.0f), 1.0f);
+			unsigned char grey = (unsigned char)(h * 255.0f + 0.5f);
+			heights[i * 4] = heights[(i * 4) + 1] = heights[(i * 4) + 2] = grey;
+			heights[(i * 4) + 3] = 255;
+
+			float len = std::sqrt((n.x * n.x) + (n.y * n.y) + (n.z * n.z));
+			if (len <= 0.0f) len = 1.0f;
+			colors[i * 4] = (unsigned char)(((n.x / len) * 0.5f + 0.5f) * 255.0f + 0.5f);
+			colors[(i * 4) + 1] = (unsigned char)(((n.y / len) * 0.5f + 0.5f) * 255.0f + 0.5f);
+			colors[(i * 4) + 2] = (unsigned char)(((n.z / len) * 0.5f + 0.5f) * 255.0f + 0.5f);
+			colors[(i * 4) + 3] = 255;
+		}
+		if (lodepng::encode(base.string() + "_height.png", heights, simulator.width, simulator.height) != 0) return false;
+		if (lodepng::encode(base.string() + "_normal.png", colors, simulator.width, simulator.height) != 0) return false;
+	}
+
+	if (scenario.write_raw) {
+		std::ofstream raw(base.string() + "_normal.f32", std::ios::binary);
+		if (!raw) return false;
+		raw.write((const char*)simulator.GetNormalMapData(), cells * sizeof(cy::Point4f));
+	}
+	return true;
+}
+
+
+/*Sets up the given simulator's parameters and obstacles from the scenario, runs it, and writes out the frames, timings and summary.
+Returns the process's exit code.  Works with either WaterSimulatorCPU or WaterSimulatorPartitioned.*/
+template <typename Simulator>
+static int Run(Simulator& simulator, const Scenario& scenario) {
+	simulator.depth = scenario.depth;
+	simulator.gravity = scenario.gravity;
+	simulator.surfaceTension = scenario.surface_tension;
+	simulator.density = scenario.density;
+	simulator.amplitude_time_ebb = scenario.amplitude_time_ebb;
+	simulator.amplitude_distance_ebb = scenario.amplitude_distance_ebb;
+	simulator.soliton_speed = scenario.soliton_speed;
+	simulator.sparse_tiles = scenario.sparse_tiles;
+	simulator.stream_band_rows = scenario.stream_band_rows;
+	simulator.stream_depth = scenario.stream_depth;
+	simulator.stream_lookahead = scenario.stream_lookahead;
+
+	//Open water needs no obstacle map, which would otherwise take as much memory as the normal map.
+	if (scenario.border || scenario.square || scenario.bar || !scenario.obstacle_pngs.empty() || !scenario.obstacle_rectangles.empty() || !scenario.obstacle_circles.empty()) {
+		ObstacleMap obstacles(scenario.width, scenario.height);
+		obstacles.Set(WaterSimulatorCPU::BuildObstacles(scenario.width, scenario.height, scenario.border, scenario.square, scenario.bar));
+		for (const std::string& png : scenario.obstacle_pngs) {
+			if (!obstacles.LoadPNG(png.c_str())) { std::cerr << "Could not load obstacle image " << png << std::endl; return 1; }
+		}
+		for (const std::vector<float>& r : scenario.obstacle_rectangles) obstacles.StampRectangle((int)r[0], (int)r[1], (int)r[2], (int)r[3], r[4] != 0.0f);
+		for (const std::vector<float>& c : scenario.obstacle_circles) obstacles.StampCircle(c[0], c[1], c[2], c[3] != 0.0f);
+		simulator.SetReflections(obstacles.GetTexels());
+	}
+
+	std::cout << "Simulating " << scenario.width << "x" << scenario.height << "x" << scenario.levels << " for " << scenario.steps << " steps on "
+		<< simulator.GetThreadCount() << " threads." << std::endl;
+
+	CpuProfiler::SetEnabled(!scenario.cpu_trace.empty());
+	PerturbationLog recording, replaying;
+	if (!scenario.record.empty()) simulator.recorder = &recording;
+	if (!scenario.replay.empty() && !replaying.Load(scenario.replay.c_str())) { std::cerr << "Could not load perturbation log " << scenario.replay << std::endl; return 1; }
+	PerturbationReplayer replayer(replaying);
+
+	//Run the steps, timing only the simulation itself.
+	std::mt19937 rain(scenario.seed);
+	std::vector<double> stepTimes;
+	stepTimes.reserve(scenario.steps);
+	size_t nextPerturbation = 0, nextScroll = 0;
+	int frame = 0, peakPages = 0;
+	for (int step = 0; step < scenario.steps;) {
+		for (; nextScroll < scenario.scrolls.size() && scenario.scrolls[nextScroll].step <= step; nextScroll++)
+			Scroll(simulator, scenario.scrolls[nextScroll].dx, scenario.scrolls[nextScroll].dy);
+		if (!scenario.replay.empty()) replayer.Feed(simulator);
+		else {
+			for (; nextPerturbation < scenario.perturbations.size() && scenario.perturbations[nextPerturbation].step <= step; nextPerturbation++) {
+				const ScriptedPerturbation& p = scenario.perturbations[nextPerturbation];
+				if (p.level < 0) Drop(simulator, p.x, p.y, p.amplitude, p.phase_offset);
+				else simulator.Perturb(cy::Point2f(p.x, p.y), p.level, cy::Point2f(p.x, p.y), p.wave_number, p.amplitude, simulator.currentTime, p.phase_offset);
+			}
+			if (scenario.rain > 0 && (int)(rain() % 20) < scenario.rain) {
+				float x = (float)(rain() % scenario.width), y = (float)(rain() % scenario.height);
+				float phaseOffset = std::uniform_real_distribution<float>(0.0f, (float)PI)(rain);
+				Drop(simulator, x, y, 1.0f, phaseOffset);
+			}
+		}
+
+		//With mapped storage, or several processes, the steps up to the next scripted event run in one call, so that they can share sweeps
+		//over the files, or the workers need only check in once.  Each of them is then timed at their average.
+		int run = 1;
+		if ((scenario.storage == MappedStorage || scenario.processes > 1) && scenario.replay.empty() && scenario.rain == 0) {
+			int next = scenario.steps;
+			if (nextPerturbation < scenario.perturbations.size()) next = std::min(next, scenario.perturbations[nextPerturbation].step);
+			if (nextScroll < scenario.scrolls.size()) next = std::min(next, scenario.scrolls[nextScroll].step);
+			if (scenario.frame_every > 0) next = std::min(next, ((step / scenario.frame_every) + 1) * scenario.frame_every);
+			run = std::max(next - step, 1);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		simulator.ExecuteSteps(run, scenario.step_milliseconds);
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		for (int i = 0; i < run; i++) stepTimes.push_back(milliseconds / run);
+		peakPages = std::max(peakPages, simulator.GetPageCount());
+		step += run;
+
+		bool frameDue = scenario.frame_every > 0 && step % scenario.frame_every == 0;
+		if (frameDue || step == scenario.steps) {
+			if (!WriteFrame(simulator, scenario, frame++)) { std::cerr << "Could not write frame " << (frame - 1) << std::endl; return 1; }
+		}
+	}
+
+	if (!scenario.record.empty() && !recording.Save(scenario.record.c_str())) { std::cerr << "Could not save perturbation log " << scenario.record << std::endl; return 1; }
+
+	if (!scenario.cpu_trace.empty() && !CpuProfiler::WriteChromeTrace(scenario.cpu_trace.c_str())) { std::cerr << "Could not write CPU trace " << scenario.cpu_trace << std::endl; return 1; }
+
+	if (!scenario.probes.empty()) {
+		std::vector<WaterSample> samples;
+		simulator.QueryBatch(scenario.probes, samples);
+		std::ofstream probes((std::filesystem::path(scenario.output) / "probes.csv").string());
+		probes << "x,y,height,normal_x,normal_y,normal_z\n";
+		for (size_t i = 0; i < samples.size(); i++)
+			probes << scenario.probes[i].x << "," << scenario.probes[i].y << "," << samples[i].height << "," << samples[i].normal.x << "," << samples[i].normal.y << "," << samples[i].normal.z << "\n";
+	}
+
+	//Write the timings, one row per step, and the summary.
+	std::ofstream csv((std::filesystem::path(scenario.output) / "steps.csv").string());
+	csv << "step,milliseconds\n";
+	for (size_t i = 0; i < stepTimes.size(); i++) csv << i << "," << stepTimes[i] << "\n";
+
+	double total = 0.0;
+	for (double t : stepTimes) total += t;
+	std::vector<double> sorted = stepTimes;
+	std::sort(sorted.begin(), sorted.end());
+	double mean = sorted.empty() ? 0.0 : total / (double)sorted.size();
+	double minimum = sorted.empty() ? 0.0 : sorted.front(), maximum = sorted.empty() ? 0.0 : sorted.back();
+	double p99 = sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)std::ceil(sorted.size() * 0.99) - 1)];
+	double cellSteps = (double)scenario.width * scenario.height * scenario.levels * scenario.steps;
+
+	SimulationStats stats = simulator.ComputeStats();
+
+	std::ostringstream summary;
+	summary << "grid = " << scenario.width << "x" << scenario.height << "x" << scenario.levels << "\n"
+		<< "encoding = " << ((scenario.encoding == PackedFragments) ? "packed" : "full") << "\n"
+		<< "storage = " << ((scenario.storage == PagedStorage) ? "paged" : ((scenario.storage == MappedStorage) ? "mapped" : "dense")) << "\n"
+		<< "sparse_tiles = " << (scenario.sparse_tiles ? "true" : "false") << "\n"
+		<< "threads = " << simulator.GetThreadCount() << "\n"
+		<< "processes = " << std::max(scenario.processes, 1) << "\n"
+		<< "steps = " << scenario.steps << "\n"
+		<< "total_ms = " << total << "\n"
+		<< "mean_ms = " << mean << "\n"
+		<< "min_ms = " << minimum << "\n"
+		<< "p99_ms = " << p99 << "\n"
+		<< "max_ms = " << maximum << "\n"
+		<< "steps_per_second = " << ((total > 0.0) ? 1000.0 * scenario.steps / total : 0.0) << "\n"
+		<< "cell_steps_per_second = " << ((total > 0.0) ? 1000.0 * cellSteps / total : 0.0) << "\n"
+		<< "frames = " << frame << "\n"
+		<< "window = " << simulator.GetWindowX() << " " << simulator.GetWindowY() << "\n"
+		<< "peak_pages = " << peakPages << "\n"
+		<< "final_pages = " << simulator.GetPageCount() << " of " << simulator.GetPageCapacity() << "\n"
+		<< "mapped_bytes = " << simulator.GetMappedBytes() << "\n"
+		<< "final_energy = " << stats.GetTotalEnergy() << "\n"
+		<< "final_max_amplitude = " << stats.GetMaxAmplitude() << "\n"
+		<< "final_active_cells = " << stats.GetActiveCells() << "\n";
+	std::ofstream((std::filesystem::path(scenario.output) / "summary.txt").string()) << summary.str();
+	std::cout << summary.str();
+
+	return 0;
+}
+
+
+int main(int argc, char** argv) {
+
+	if (argc < 2 || argc > 3) {
+		std::cerr << "Usage:  headless <scenario file> [output directory]" << std::endl;
+		return 1;
+	}
+	Scenario scenario;
+	if (!LoadScenario(argv[1], scenario)) return 1;
+	if (argc == 3) scenario.output = argv[2];
+	std::error_code error;
+	std::filesystem::create_directories(scenario.output, error);
+	if (error) { std::cerr << "Could not create the output directory " << scenario.output << std::endl; return 1; }
+
+	//Set up the simulator, and run it.
+#if !defined(_WIN32)
+	if (scenario.processes > 1) {
+		WaterSimulatorPartitioned simulator(scenario.width, scenario.height, scenario.levels, scenario.processes, scenario.scale, scenario.threads, scenario.encoding, 
+			scenario.storage, scenario.mapped_directory);
+		return Run(simulator, scenario);
+	}
+#endif
+	WaterSimulatorCPU simulator(scenario.width, scenario.height, scenario.levels, scenario.scale, scenario.threads, scenario.encoding, scenario.storage, scenario.mapped_directory);
+	return Run(simulator, scenario);
+}
@@ -0,0 +1,93 @@
+///Headless checks
+///
+///Runs a few checks of the CPU water simulator and the headers it shares with the GPU path, with no window or OpenGL context.  Each
+///check prints a line, and the program returns non-zero if any of them fails.
+///
+///Build from this directory, with the cyCodeBase headers on the include path:
+///		g++ -std=c++17 -O2 -mavx2 -pthread -D_GLIBCXX_ASSERTIONS -I.. -I<cyCodeBase> tests.cpp -o tests
+///or with MSVC:
+///		cl /std:c++17 /O2 /arch:AVX2 /EHsc /I.. /I<cyCodeBase> tests.cpp
+///
+///Usage:  tests
+
+#include <cstdio>
+#include <cstdint>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include "WaterSimulatorCPU.h"
+#if !defined(_WIN32)
+#include "WaterSimulatorPartitioned.h"
+#endif
+
+
+static int failures = 0;
+
+/*Prints the outcome of one check, and counts it if it failed.*/
+static void Check(bool passed, const char* description) {
+	std::printf("%s  %s\n", passed ? "pass" : "FAIL", description);
+	if (!passed) failures++;
+}
+
+
+/*A perturbation must land on a cell of the grid:  the location is a cell index, whatever the scale.*/
+static void CheckPerturbationBounds() {
+	WaterSimulatorCPU simulator(32, 32, 1);
+	Check(!simulator.Perturb(cy::Point2f(100, 200), 0, cy::Point2f(100, 200), 0.2f, 1.0f, 0), "a perturbation outside the grid is rejected");
+	Check(!simulator.Perturb(cy::Point2f(32, 0), 0, cy::Point2f(32, 0), 0.2f, 1.0f, 0), "a perturbation just past the last column is rejected");
+	Check(!simulator.Perturb(cy::Point2f(0, -0.5f), 0, cy::Point2f(0, -0.5f), 0.2f, 1.0f, 0), "a perturbation above the first row is rejected");
+	Check(simulator.PerturbPoint(cy::Point2f(31.5f, 31.5f), 0, 0.2f, 1.0f, 0), "a perturbation of the last cell is accepted");
+	Check(simulator.Execute(33), "the step after them runs");
+
+#if !defined(_WIN32)
+	WaterSimulatorPartitioned partitioned(32, 32, 1, 2);
+	Check(!partitioned.Perturb(cy::Point2f(100, 200), 0, cy::Point2f(100, 200), 0.2f, 1.0f, 0), "a partitioned perturbation outside the grid is rejected");
+	Check(partitioned.PerturbPoint(cy::Point2f(31.5f, 31.5f), 0, 0.2f, 1.0f, 0), "a partitioned perturbation of the last cell is accepted");
+	Check(partitioned.Execute(33), "the partitioned step after them runs");
+#endif
+}
+
+/*Returns how many floats apart the two given positive floats are.*/
+static int64_t GetUlps(float a, float b) {
+	int32_t ia, ib;
+	std::memcpy(&ia, &a, sizeof(ia));
+	std::memcpy(&ib, &b, sizeof(ib));
+	return (ia > ib) ? (int64_t)ia - ib : (int64_t)ib - ia;
+}
+
+/*The ebb table must agree with std::pow() to two units in the last place wherever it is used, from a few ebbing bases across the whole 
+range the table covers, and must fall back on std::pow() outside it.*/
+static void CheckEbbTable() {
+	std::mt19937 generator(12345);
+	int64_t worst = 0;
+	const float bases[] = { 0.01f, 0.25f, 0.5f, 0.9f, 0.99f, 0.9999f };
+	for (float base : bases) {
+		EbbTable table;
+		table.Build(base);
+		float tableEnd = (float)(126.0 / -std::log2((double)base));		//Past 126 halvings, the result is no longer a normal float.
+		std::uniform_real_distribution<float> arguments(0.0f, tableEnd);
+		for (int i = 0; i < 100000; i++) {
+			float x = (i == 0) ? 0.0f : arguments(generator);
+			float expected = std::pow(base, x);
+			if (expected < FLT_MIN) continue;
+			worst = std::max(worst, GetUlps(table.Evaluate(base, x), expected));
+		}
+	}
+	std::printf("      the ebb table is within %d units in the last place of std::pow()\n", (int)worst);
+	Check(worst <= 2, "the ebb table agrees with std::pow() across its range");
+
+	EbbTable table;
+	table.Build(0.5f);
+	Check(table.Evaluate(0.9f, 3.0f) == std::pow(0.9f, 3.0f), "the ebb table falls back on std::pow() for another base");
+	Check(table.Evaluate(0.5f, -2.0f) == std::pow(0.5f, -2.0f), "the ebb table falls back on std::pow() for a negative argument");
+	Check(table.Evaluate(0.5f, INFINITY) == 0.0f, "the ebb table ebbs an infinite argument to zero");
+}
+
+
+int main() {
+	CheckPerturbationBounds();
+	CheckEbbTable();
+	return (failures == 0) ? 0 : 1;
+}
@@ -9,6 +9,8 @@
 #include <iostream>
 #include "cyGL.h"
 #include "cyMatrix.h"
+#include "CpuProfiler.h"
+#include "GLDiagnostics.h"
 
 
 
@@ -30,30 +32,6 @@ cy::Matrix4f GetRotation(cy::Point3f center, cy::Point3f axis, float radians) {
 	return result;
 }
 
-GLenum CHECK_GL_ERROR(char* location) {
-	GLenum error = glGetError();
-	if (error != 0) {
-		std::cout << location << "  OpenGL error:" << error << "  " << glewGetErrorString(error) << std::endl;
-	}
-	return error;
-}
-
-GLenum CHECK_GL_ERROR(char* location, char* detail1) {
-	GLenum error = glGetError();
-	if (error != 0) {
-		std::cout << location << "  " << (detail1==nullptr ? "<null>" : detail1) << "  OpenGL error:" << error << "  " << glewGetErrorString(error) << std::endl;
-	}
-	return error;
-}
-
-GLenum CHECK_GL_ERROR(char* location, char* detail1, char* detail2) {
-	GLenum error = glGetError();
-	if (error != 0) {		
-		std::cout << location << "  " << (detail1 == nullptr ? "<null>" : detail1) << "  " << (detail2 == nullptr ? "<null>" : detail2) << "  OpenGL error:" << error << "  " << glewGetErrorString(error) << std::endl;
-	}
-	return error;
-}
-
 GLenum CHECK_FRAMEBUFFER_STATUS(char* location) {
 	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 	if (status != GL_FRAMEBUFFER_COMPLETE) {
@@ -132,6 +110,7 @@ cy::GLSLProgram* GetShaderProgram(char* vertexShader_filename, char* fragmentSha
 
 /*Loads the texture specified byb the given filename into a cy texture object.*/
 cy::GLTexture2D* GetTexture(char* filename) {
+	CPU_PROFILE_ZONE("GetTexture");
 	std::vector<GLubyte> pixels;
 	unsigned int height;
 	unsigned int width;
@@ -152,6 +131,7 @@ cy::GLTexture2D* GetTexture(char* filename) {
 
 /*Loads the texture specified byb the given filename into a cy texture object.*/
 cy::GLTextureRect* GetTextureRect(char* filename, unsigned int & width, unsigned int& height) {
+	CPU_PROFILE_ZONE("GetTextureRect");
 	std::vector<GLubyte> pixels;
 	
 	unsigned int error = lodepng::decode(pixels, width, height, filename);
@@ -0,0 +1,303 @@
+#ifndef _MAPPED_MEMORY_H	//Not all compilers allow "#pragma once"
+#define _MAPPED_MEMORY_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+
+/*Hands out memory backed by files rather than by RAM, so that buffers far larger than the machine's memory can be used as if they were
+ordinary arrays, with the operating system paging them in and out.  Each allocation is a file of its own in the arena's directory, deleted
+as soon as it is made (or, on Windows, when it is closed), so nothing is left behind.  A new file reads as zeros and takes no disk space
+until it is written.
+
+The arena also runs a thread of its own which reads ranges in ahead of use (Prefetch()) and writes them back and drops them from memory
+after use (Release()), so that a sweep over the buffers seldom waits on the disk, and holds only the part of them it is working on.  Both
+are hints:  the data is always correct whether or not they have run.*/
+class MappedArena {
+
+public:
+
+	/*Creates an arena which puts its files in the given directory.  An empty directory uses the system's temporary directory.*/
+	MappedArena(const std::string& directory = "") : _directory(directory) {
+		if (_directory.empty()) {
+#if defined(_WIN32)
+			char path[MAX_PATH + 1];
+			DWORD length = GetTempPathA(MAX_PATH + 1, path);
+			_directory = (length > 0) ? std::string(path, length) : std::string(".");
+#else
+			const char* tmp = std::getenv("TMPDIR");
+			_directory = (tmp != nullptr && tmp[0] != '\0') ? tmp : "/tmp";
+#endif
+		}
+	}
+	~MappedArena() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_work_ready.notify_all();
+		if (_thread.joinable()) _thread.join();
+		for (auto& mapping : _mappings) Unmap(mapping.first, mapping.second);
+	}
+
+	MappedArena(const MappedArena&) = delete;
+	MappedArena& operator=(const MappedArena&) = delete;
+
+	const std::string& GetDirectory() const { return _directory; }
+
+	/*Returns the number of bytes mapped, across every allocation.*/
+	size_t GetMappedBytes() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _mapped_bytes;
+	}
+
+	/*Maps a new file of the given size, full of zeros.  Throws std::bad_alloc if the file cannot be made or mapped.*/
+	void* Allocate(size_t bytes) {
+		if (bytes == 0) bytes = 1;
+		Mapping mapping;
+		mapping.bytes = bytes;
+#if defined(_WIN32)
+		char path[MAX_PATH + 1];
+		if (GetTempFileNameA(_directory.c_str(), "wtr", 0, path) == 0) throw std::bad_alloc();
+		mapping.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (mapping.file == INVALID_HANDLE_VALUE) { DeleteFileA(path); throw std::bad_alloc(); }
+		mapping.view = CreateFileMappingA(mapping.file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)bytes >> 32), (DWORD)(bytes & 0xFFFFFFFF), NULL);
+		void* address = (mapping.view == NULL) ? NULL : MapViewOfFile(mapping.view, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+		if (address == NULL) {
+			if (mapping.view != NULL) CloseHandle(mapping.view);
+			CloseHandle(mapping.file);
+			throw std::bad_alloc();
+		}
+#else
+		std::string path = _directory + "/water_mapped_XXXXXX";
+		mapping.file = mkstemp(&path[0]);
+		if (mapping.file < 0) throw std::bad_alloc();
+		unlink(path.c_str());
+		void* address = MAP_FAILED;
+		if (ftruncate(mapping.file, (off_t)bytes) == 0) address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, mapping.file, 0);
+		if (address == MAP_FAILED) {
+			close(mapping.file);
+			throw std::bad_alloc();
+		}
+#endif
+		std::lock_guard<std::mutex> lock(_mutex);
+		_mappings[(char*)address] = mapping;
+		_mapped_bytes += bytes;
+		return address;
+	}
+
+	/*Unmaps the given allocation, and deletes its file.  Any reads or writes queued for it are finished first.*/
+	void Free(void* address) {
+		Drain();
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto iter = _mappings.find((char*)address);
+		if (iter == _mappings.end()) return;
+		_mapped_bytes -= iter->second.bytes;
+		Unmap(iter->first, iter->second);
+		_mappings.erase(iter);
+	}
+
+	/*Queues the given range to be read into memory, ahead of its use.*/
+	void Prefetch(const void* address, size_t bytes) { Queue(true, address, bytes); }
+
+	/*Queues the given range to be written back to its file, and dropped from memory.  It may still be used afterwards, but will have to be
+	read back in.*/
+	void Release(const void* address, size_t bytes) { Queue(false, address, bytes); }
+
+	/*Blocks until every queued read and write has been done.*/
+	void Drain() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_work_done.wait(lock, [&] { return _requests.empty() && !_working; });
+	}
+
+
+private:
+
+	struct Mapping {
+#if defined(_WIN32)
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE view = NULL;
+#else
+		int file = -1;
+#endif
+		size_t bytes = 0;
+	};
+
+	struct Request {
+		bool prefetch;
+		const char* address;
+		size_t bytes;
+	};
+
+	std::string _directory;
+
+	/*The allocations, by address, and the queue of reads and writes for the thread.  Both are guarded by the mutex.*/
+	std::map<char*, Mapping> _mappings;
+	size_t _mapped_bytes = 0;
+	std::deque<Request> _requests;
+	bool _working = false;
+	bool _stopping = false;
+	std::mutex _mutex;
+	std::condition_variable _work_ready;
+	std::condition_variable _work_done;
+	std::thread _thread;
+
+	static size_t GetPageSize() {
+		static const size_t pageSize = [] {
+#if defined(_WIN32)
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return (size_t)info.dwPageSize;
+#else
+			return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		}();
+		return pageSize;
+	}
+
+	static void Unmap(char* address, const Mapping& mapping) {
+#if defined(_WIN32)
+		UnmapViewOfFile(address);
+		CloseHandle(mapping.view);
+		CloseHandle(mapping.file);
+#else
+		munmap(address, mapping.bytes);
+		close(mapping.file);
+#endif
+	}
+
+	void Queue(bool prefetch, const void* address, size_t bytes) {
+		if (bytes == 0) return;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_thread.joinable()) _thread = std::thread(&MappedArena::ThreadLoop, this);
+			_requests.push_back({ prefetch, (const char*)address, bytes });
+		}
+		_work_ready.notify_one();
+	}
+
+	void ThreadLoop() {
+		while (true) {
+			Request request;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_work_ready.wait(lock, [&] { return _stopping || !_requests.empty(); });
+				if (_stopping) return;
+				request = _requests.front();
+				_requests.pop_front();
+				_working = true;
+			}
+			if (request.prefetch) DoPrefetch(request.address, request.bytes);
+			else DoRelease(request.address, request.bytes);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_working = false;
+			}
+			_work_done.notify_all();
+		}
+	}
+
+	/*Reads the range in, by touching a byte of every page, so that the pages are mapped as well as cached when the sweep reaches them.*/
+	static void DoPrefetch(const char* address, size_t bytes) {
+		size_t pageSize = GetPageSize();
+		const char* first = address - ((size_t)address % pageSize);
+#if !defined(_WIN32)
+		madvise((void*)first, (size_t)(address + bytes - first), MADV_WILLNEED);
+#endif
+		volatile char sink = 0;
+		for (const char* page = first; page < address + bytes; page += pageSize) sink = sink + *(const volatile char*)page;
+	}
+
+	/*Writes the whole pages of the range back to the file, and drops them.  Pages the range only partly covers are left alone, since the
+	neighboring ranges may still be in use.*/
+	void DoRelease(const char* address, size_t bytes) {
+		size_t pageSize = GetPageSize();
+		size_t start = ((size_t)address + pageSize - 1) / pageSize * pageSize;
+		size_t end = ((size_t)address + bytes) / pageSize * pageSize;
+		if (end <= start) return;
+#if defined(_WIN32)
+		FlushViewOfFile((void*)start, end - start);
+		VirtualUnlock((void*)start, end - start);		//Unlocking pages which are not locked takes them out of the working set.
+#else
+		msync((void*)start, end - start, MS_SYNC);
+		madvise((void*)start, end - start, MADV_DONTNEED);
+
+		//The pages are clean now, so the cache can let them go too.
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto iter = _mappings.upper_bound((char*)start);
+		if (iter == _mappings.begin()) return;
+		--iter;
+		posix_fadvise(iter->second.file, (off_t)((char*)start - iter->first), (off_t)(end - start), POSIX_FADV_DONTNEED);
+#endif
+	}
+
+};
+
+
+/*An allocator for the standard containers which places their elements in a MappedArena, or on the heap if it has none.  Elements a
+container grows by are left default-initialized in mapped memory, rather than value-initialized, since the memory is zeros already and
+writing them would write out every page of the file.*/
+template <typename T>
+class MappedAllocator {
+
+public:
+
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	MappedArena* arena = nullptr;
+
+	MappedAllocator(MappedArena* arena = nullptr) : arena(arena) {}
+	template <typename U> MappedAllocator(const MappedAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t count) {
+		if (arena == nullptr) return std::allocator<T>().allocate(count);
+		return (T*)arena->Allocate(count * sizeof(T));
+	}
+
+	void deallocate(T* pointer, size_t count) {
+		if (arena == nullptr) std::allocator<T>().deallocate(pointer, count);
+		else arena->Free(pointer);
+	}
+
+	template <typename U, typename... Args>
+	void construct(U* pointer, Args&&... args) { ::new((void*)pointer) U(std::forward<Args>(args)...); }
+	template <typename U>
+	void construct(U* pointer) {
+		if (arena == nullptr) ::new((void*)pointer) U();
+		else ::new((void*)pointer) U;
+	}
+
+	template <typename U> bool operator==(const MappedAllocator<U>& other) const { return arena == other.arena; }
+	template <typename U> bool operator!=(const MappedAllocator<U>& other) const { return arena != other.arena; }
+};
+
+/*A vector whose elements may live in a MappedArena.  Give it MappedAllocator<T>(arena) when it is made; a default one is on the heap.*/
+template <typename T>
+using MappedVector = std::vector<T, MappedAllocator<T>>;
+
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef _OBSTACLE_MAP_H	//Not all compilers allow "#pragma once"
+#define _OBSTACLE_MAP_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "cyPoint.h"
+#include "lodepng.h"
+#include "CpuProfiler.h"
+
+
+/*A host-side copy of the reflection map, with an API for editing the obstacles in it.  Each texel holds the obstacle normal in xy (pointing
+away from the obstacle, into the water), and the damping multiplier in z.  Open water is (0, 0, 1, 1); the inside of an obstacle is
+damped, (0, 0, 0, 1); and an obstacle cell next to open water reflects, with its normal set and no damping.  Every edit grows a dirty
+rectangle, so that only the changed texels need to be uploaded.*/
+class ObstacleMap {
+
+public:
+
+	const int width;
+	const int height;
+
+	ObstacleMap(int width, int height) : width(width), height(height), _texels(width * height, cy::Point4f(0, 0, 1, 1)) { MarkDirty(0, 0, width, height); }
+
+	/*Returns the texels, in row-major order.*/
+	const std::vector<cy::Point4f>& GetTexels() const { return _texels; }
+
+	/*Returns whether the given cell is part of an obstacle, either damping or reflecting.*/
+	bool IsObstacle(int x, int y) const {
+		const cy::Point4f& t = _texels[x + (y * width)];
+		return t.x != 0 || t.y != 0 || t.z == 0;
+	}
+
+	/*Replaces every texel, which must number width*height.*/
+	void Set(const std::vector<cy::Point4f>& texels) {
+		if ((int)texels.size() != width * height) return;
+		_texels = texels;
+		MarkDirty(0, 0, width, height);
+	}
+
+	/*Adds (or removes) a solid rectangle covering the cells [x0, x1) by [y0, y1).*/
+	void StampRectangle(int x0, int y0, int x1, int y1, bool add = true) {
+		x0 = std::max(x0, 0);	y0 = std::max(y0, 0);
+		x1 = std::min(x1, width);	y1 = std::min(y1, height);
+		if (x0 >= x1 || y0 >= y1) return;
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++) SetCell(x, y, add);
+		RebuildNormals(x0 - 1, y0 - 1, x1 + 1, y1 + 1);
+	}
+
+	/*Adds (or removes) a solid disc of the given radius, centered on the given point.*/
+	void StampCircle(float centerX, float centerY, float radius, bool add = true) {
+		int x0 = std::max((int)std::floor(centerX - radius), 0), x1 = std::min((int)std::ceil(centerX + radius) + 1, width);
+		int y0 = std::max((int)std::floor(centerY - radius), 0), y1 = std::min((int)std::ceil(centerY + radius) + 1, height);
+		if (x0 >= x1 || y0 >= y1) return;
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				float dx = (float)x - centerX, dy = (float)y - centerY;
+				if ((dx * dx) + (dy * dy) <= radius * radius) SetCell(x, y, add);
+			}
+		}
+		RebuildNormals(x0 - 1, y0 - 1, x1 + 1, y1 + 1);
+	}
+
+	/*Adds (or removes) the cells set in the given mask, which is maskWidth by maskHeight bytes in row-major order, placed with its first
+	byte at (x, y).  Zero bytes leave their cells alone.*/
+	void ApplyMask(const unsigned char* mask, int maskWidth, int maskHeight, int x, int y, bool add = true) {
+		int x0 = std::max(x, 0), x1 = std::min(x + maskWidth, width);
+		int y0 = std::max(y, 0), y1 = std::min(y + maskHeight, height);
+		if (x0 >= x1 || y0 >= y1) return;
+		for (int gy = y0; gy < y1; gy++) {
+			for (int gx = x0; gx < x1; gx++) {
+				if (mask[(gx - x) + ((gy - y) * maskWidth)] != 0) SetCell(gx, gy, add);
+			}
+		}
+		RebuildNormals(x0 - 1, y0 - 1, x1 + 1, y1 + 1);
+	}
+
+	/*Adds the obstacles drawn in the given PNG file, placed with its first pixel at (x, y).  Dark, opaque pixels (red below half and alpha
+	above half) are obstacles; the image rows map straight onto grid rows.  Returns false if the file could not be loaded.*/
+	bool LoadPNG(const char* filename, int x = 0, int y = 0) {
+		CPU_PROFILE_ZONE("ObstacleMap::LoadPNG");
+		std::vector<unsigned char> pixels;
+		unsigned int imageWidth, imageHeight;
+		unsigned int error = lodepng::decode(pixels, imageWidth, imageHeight, filename);
+		if (error > 0) return false;
+
+		std::vector<unsigned char> mask(imageWidth * imageHeight);
+		for (unsigned int i = 0; i < imageWidth * imageHeight; i++)
+			mask[i] = (pixels[i * 4] < 128 && pixels[(i * 4) + 3] >= 128) ? 1 : 0;
+		ApplyMask(&mask[0], (int)imageWidth, (int)imageHeight, x, y, true);
+		return true;
+	}
+
+
+	/*Returns whether any texels have changed since the last call to ClearDirty().*/
+	bool IsDirty() const { return _dirty_x0 < _dirty_x1 && _dirty_y0 < _dirty_y1; }
+
+	/*Gets the rectangle [x0, x1) by [y0, y1) which holds every changed texel.*/
+	void GetDirtyRect(int& x0, int& y0, int& x1, int& y1) const { x0 = _dirty_x0; y0 = _dirty_y0; x1 = _dirty_x1; y1 = _dirty_y1; }
+
+	/*Marks every texel as changed, so the whole map is uploaded again.*/
+	void Invalidate() { MarkDirty(0, 0, width, height); }
+
+	void ClearDirty() { _dirty_x0 = width; _dirty_y0 = height; _dirty_x1 = 0; _dirty_y1 = 0; }
+
+
+private:
+
+	std::vector<cy::Point4f> _texels;
+	int _dirty_x0 = 0;
+	int _dirty_y0 = 0;
+	int _dirty_x1 = 0;
+	int _dirty_y1 = 0;
+
+	void MarkDirty(int x0, int y0, int x1, int y1) {
+		_dirty_x0 = std::min(_dirty_x0, x0);
+		_dirty_y0 = std::min(_dirty_y0, y0);
+		_dirty_x1 = std::max(_dirty_x1, x1);
+		_dirty_y1 = std::max(_dirty_y1, y1);
+	}
+
+	/*Makes the given cell damped obstacle or open water.  The reflecting edges are found afterward by RebuildNormals().*/
+	void SetCell(int x, int y, bool obstacle) {
+		_texels[x + (y * width)] = obstacle ? cy::Point4f(0, 0, 0, 1) : cy::Point4f(0, 0, 1, 1);
+	}
+
+	/*Recomputes the texels of every obstacle cell in the given rectangle (clipped to the map) from its neighbors.  An obstacle cell with
+	open water around it reflects, with its normal pointing toward that water; one with none (or with water on opposite sides, as in a
+	wall a single cell thick) damps.  Cells off the map count as obstacles, so the map's border reflects back inward.*/
+	void RebuildNormals(int x0, int y0, int x1, int y1) {
+		static const int cardinals[16] = { 1,0,  1,1,  0,1,  -1,1,  -1,0,  -1,-1,  0,-1,  1,-1 };
+		x0 = std::max(x0, 0);	y0 = std::max(y0, 0);
+		x1 = std::min(x1, width);	y1 = std::min(y1, height);
+
+		//Work out every normal before writing any, since the writes change which cells look like obstacles.
+		std::vector<cy::Point4f> rebuilt;
+		rebuilt.reserve((x1 - x0) * (y1 - y0));
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				if (!IsObstacle(x, y)) { rebuilt.push_back(cy::Point4f(0, 0, 1, 1)); continue; }
+				float nx = 0.0f, ny = 0.0f;
+				for (int c = 0; c < 8; c++) {
+					int n_x = x + cardinals[c * 2], n_y = y + cardinals[c * 2 + 1];
+					if (n_x < 0 || n_y < 0 || n_x >= width || n_y >= height || IsObstacle(n_x, n_y)) continue;
+					nx += (float)cardinals[c * 2];
+					ny += (float)cardinals[c * 2 + 1];
+				}
+				float len = std::sqrt((nx * nx) + (ny * ny));
+				if (len < 0.5f) rebuilt.push_back(cy::Point4f(0, 0, 0, 1));
+				else rebuilt.push_back(cy::Point4f(nx / len, ny / len, 1, 1));
+			}
+		}
+		int i = 0;
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++) _texels[x + (y * width)] = rebuilt[i++];
+		MarkDirty(x0, y0, x1, y1);
+	}
+
+};
+
+
+#endif
@@ -106,6 +106,7 @@ private:
 
 		//std::cout << "blah" << std::endl;
 		CHECK_GL_ERROR("GraphicsPassCubeMapping::Execute start", name);
+		GpuProfileZone profileZone(name);
 		//What was already bound?
 		GLint prev_fbo;
 		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prev_fbo);
@@ -154,6 +155,7 @@ private:
 	void RenderFace(GraphicsWindow* window,  GLenum face, GraphicsCamera* cam) {
 
 		////Render each face of the cube.
+		CPU_PROFILE_ZONE("GraphicsPassCubeMapping::RenderFace");
 		CHECK_FRAMEBUFFER_STATUS("GraphicsPassCubeMmapping::RenderFace");
 		cam->SetLens(_render_lens);
 
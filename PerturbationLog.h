@@ -0,0 +1,119 @@
+#ifndef _PERTURBATION_LOG_H	//Not all compilers allow "#pragma once"
+#define _PERTURBATION_LOG_H
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include "cyPoint.h"
+
+#define PERTURBATION_LOG_MAGIC		0x474C5052		//"RPLG", read as a little-endian integer.
+#define PERTURBATION_LOG_VERSION	1
+
+
+/*One call to Perturb(), with the run count of the simulator at the time, so that it can be fed back in before the same step.  The layout
+is written to the log exactly as it is, 40 bytes a record.*/
+struct PerturbationRecord {
+	unsigned int step;
+	unsigned int time_stamp;
+	float location_x;
+	float location_y;
+	int level;
+	float origin_x;
+	float origin_y;
+	float wave_number;
+	float amplitude;
+	float phase_offset;
+};
+
+
+/*Records every perturbation made to a simulator, and saves them to (or loads them from) a compact binary log.  A simulator with a log set
+as its recorder appends to it on every accepted call to Perturb() or PerturbPoint().*/
+class PerturbationLog {
+
+public:
+
+	/*Appends a perturbation made before the given step.*/
+	void Record(unsigned int step, cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset) {
+		PerturbationRecord r = { step, timeStamp, location.x, location.y, level, origin.x, origin.y, waveNumber, amplitude, phase_offset };
+		_records.push_back(r);
+	}
+
+	const std::vector<PerturbationRecord>& GetRecords() const { return _records; }
+
+	int Size() const { return (int)_records.size(); }
+
+	void Clear() { _records.clear(); }
+
+	/*Writes the log to the given file.  Returns false if it could not be written.*/
+	bool Save(const char* filename) const {
+		FILE* file = std::fopen(filename, "wb");
+		if (file == nullptr) return false;
+		unsigned int header[3] = { PERTURBATION_LOG_MAGIC, PERTURBATION_LOG_VERSION, (unsigned int)_records.size() };
+		bool ok = std::fwrite(header, sizeof(header), 1, file) == 1;
+		if (ok && _records.size() > 0) ok = std::fwrite(&_records[0], sizeof(PerturbationRecord), _records.size(), file) == _records.size();
+		return (std::fclose(file) == 0) && ok;
+	}
+
+	/*Replaces the log with the one in the given file.  Returns false, leaving the log empty, if the file could not be read or is not a
+	perturbation log.*/
+	bool Load(const char* filename) {
+		_records.clear();
+		FILE* file = std::fopen(filename, "rb");
+		if (file == nullptr) return false;
+		unsigned int header[3];
+		bool ok = std::fread(header, sizeof(header), 1, file) == 1 && header[0] == PERTURBATION_LOG_MAGIC && header[1] == PERTURBATION_LOG_VERSION;
+		if (ok && header[2] > 0) {
+			_records.resize(header[2]);
+			ok = std::fread(&_records[0], sizeof(PerturbationRecord), _records.size(), file) == _records.size();
+		}
+		std::fclose(file);
+		if (!ok) _records.clear();
+		return ok;
+	}
+
+
+private:
+
+	std::vector<PerturbationRecord> _records;
+
+};
+
+
+/*Feeds a recorded log back into a simulator, each perturbation before the same step it was first made before.  Call Feed() just before
+every Execute().  The simulator must start from the same state (cleared, at the same run count) as when the log was recorded, and should
+step by the same elapsed times, for the replay to match.*/
+class PerturbationReplayer {
+
+public:
+
+	PerturbationReplayer(const PerturbationLog& log) : _log(log) {}
+
+	/*Makes every logged perturbation due at or before the simulator's current step.  Returns the number made.  Works with either
+	WaterSimulator or WaterSimulatorCPU.*/
+	template <typename Simulator>
+	int Feed(Simulator& simulator) {
+		const std::vector<PerturbationRecord>& records = _log.GetRecords();
+		int fed = 0;
+		for (; _next < records.size() && records[_next].step <= (unsigned int)simulator.runCount; _next++, fed++) {
+			const PerturbationRecord& r = records[_next];
+			simulator.Perturb(cy::Point2f(r.location_x, r.location_y), r.level, cy::Point2f(r.origin_x, r.origin_y), r.wave_number, r.amplitude, r.time_stamp, r.phase_offset);
+		}
+		return fed;
+	}
+
+	/*Returns whether every logged perturbation has been made.*/
+	bool IsFinished() const { return _next >= _log.GetRecords().size(); }
+
+	/*Starts again from the beginning of the log.*/
+	void Rewind() { _next = 0; }
+
+
+private:
+
+	const PerturbationLog& _log;
+	size_t _next = 0;
+
+};
+
+
+#endif
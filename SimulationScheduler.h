@@ -0,0 +1,97 @@
+#ifndef _SIMULATION_SCHEDULER_H	//Not all compilers allow "#pragma once"
+#define _SIMULATION_SCHEDULER_H
+
+#include <chrono>
+#include <thread>
+#include <functional>
+
+
+/*Runs a simulation in fixed time steps, decoupled from how often it is polled.  Wall time is banked in an accumulator each frame, and
+spent on as many whole steps as it covers, up to a catch-up cap.  Time beyond the cap is dropped rather than carried, so a machine that
+cannot keep up runs the simulation slow instead of spiralling ever further behind, and the dropped time is reported as drift.*/
+class SimulationScheduler {
+
+public:
+
+	/*The simulated time each step advances, in milliseconds.*/
+	int step_milliseconds;
+
+	/*The most steps run in a single frame.*/
+	int max_steps_per_frame;
+
+	SimulationScheduler(int stepMilliseconds = 30, int maxStepsPerFrame = 4) : step_milliseconds(stepMilliseconds), max_steps_per_frame(maxStepsPerFrame) {}
+
+	/*Runs as many steps as the wall time since the last call has paid for, up to the cap, passing each the step length in milliseconds.
+	Returns the number of steps run.*/
+	int Advance(const std::function<void(int)>& step) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (!_started) { _last_tick = now; _started = true; }
+		long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - _last_tick).count();
+		_last_tick = now;
+		_wall_us += elapsed;
+		_accumulator_us += elapsed;
+
+		long long stepUs = (long long)step_milliseconds * 1000;
+		int steps = 0;
+		while (_accumulator_us >= stepUs && steps < max_steps_per_frame) {
+			step(step_milliseconds);
+			_accumulator_us -= stepUs;
+			_simulated_us += stepUs;
+			steps++;
+		}
+
+		//Drop whatever whole steps the cap left over, keeping only the fraction of a step.
+		if (_accumulator_us >= stepUs) {
+			long long excess = _accumulator_us - (_accumulator_us % stepUs);
+			_dropped_us += excess;
+			_accumulator_us -= excess;
+		}
+		return steps;
+	}
+
+	/*Forgets the wall time since the last call, so that time spent paused is not caught up afterward.*/
+	void Hold() {
+		_last_tick = std::chrono::steady_clock::now();
+		_started = true;
+	}
+
+	/*Sleeps until the next step is due, rather than spinning on the clock.*/
+	void WaitForNextStep() const {
+		long long sinceTick = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _last_tick).count();
+		long long wait = ((long long)step_milliseconds * 1000) - _accumulator_us - sinceTick;
+		if (wait > 0) std::this_thread::sleep_for(std::chrono::microseconds(wait));
+	}
+
+	/*Returns the simulated time run so far, in milliseconds.*/
+	long long GetSimulatedTime() const { return _simulated_us / 1000; }
+
+	/*Returns the wall time spent running (not held) so far, in milliseconds.*/
+	long long GetWallTime() const { return _wall_us / 1000; }
+
+	/*Returns the wall time dropped by the catch-up cap so far, in milliseconds.*/
+	long long GetDroppedTime() const { return _dropped_us / 1000; }
+
+	/*Returns how far the simulated time lags behind the wall time, in milliseconds.  Up to a step of this is just the time banked
+	toward the next step; the rest was dropped.*/
+	long long GetDrift() const { return (_wall_us - _simulated_us) / 1000; }
+
+	/*Zeroes the totals and the accumulator.*/
+	void Reset() {
+		_wall_us = _simulated_us = _dropped_us = _accumulator_us = 0;
+		_started = false;
+	}
+
+
+private:
+
+	std::chrono::steady_clock::time_point _last_tick;
+	bool _started = false;
+	long long _accumulator_us = 0;
+	long long _wall_us = 0;
+	long long _simulated_us = 0;
+	long long _dropped_us = 0;
+
+};
+
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _SIMULATION_STATS_H	//Not all compilers allow "#pragma once"
+#define _SIMULATION_STATS_H
+
+#include <vector>
+#include <algorithm>
+
+
+/*The statistics of one level of a simulation.  The bounding box is inclusive, and empty (max below min) when no cell is active.*/
+struct LevelStats {
+	/*The physical wave energy, (pg + sk^2) * A^2 / 2, of every cell's ebbed amplitude, summed.*/
+	float total_energy = 0.0f;
+	float max_amplitude = 0.0f;
+	/*The number of cells whose amplitude is above the simulator's active threshold.*/
+	int active_cells = 0;
+	int min_x = 0;
+	int min_y = 0;
+	int max_x = -1;
+	int max_y = -1;
+};
+
+/*The statistics of a whole simulation, as of the end of one step.*/
+struct SimulationStats {
+	/*The run count, and the simulation time in milliseconds, of the step these were taken after.  A run count of -1 means there are no
+	statistics yet.*/
+	int run_count = -1;
+	int time = 0;
+	std::vector<LevelStats> levels;
+
+	float GetTotalEnergy() const {
+		float total = 0.0f;
+		for (const LevelStats& level : levels) total += level.total_energy;
+		return total;
+	}
+
+	int GetActiveCells() const {
+		int total = 0;
+		for (const LevelStats& level : levels) total += level.active_cells;
+		return total;
+	}
+
+	float GetMaxAmplitude() const {
+		float result = 0.0f;
+		for (const LevelStats& level : levels) result = std::max(result, level.max_amplitude);
+		return result;
+	}
+
+	/*Returns whether the pond has settled:  there are statistics, and the total energy is no more than the given threshold.*/
+	bool IsSettled(float energyThreshold) const { return run_count >= 0 && GetTotalEnergy() <= energyThreshold; }
+};
+
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef _THREAD_POOL_H	//Not all compilers allow "#pragma once"
+#define _THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+
+/*A fixed set of worker threads used to split a range of work (such as the rows of a simulation grid) across all cores.  The calling
+thread participates in the work as well, so a pool of size 1 spawns no workers at all and simply runs everything inline.*/
+class ThreadPool {
+
+private:
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _work_ready;
+	std::condition_variable _work_done;
+
+	/*The job currently being run.  These are only written while holding the mutex and while no workers are busy.*/
+	std::function<void(int, int)> _task;
+	int _count = 0;
+	int _grain = 1;
+	std::atomic<int> _next_index;
+
+	/*Bumped every time a new job is posted, so sleeping workers can tell a new job from a spurious wakeup.*/
+	unsigned int _generation = 0;
+	int _busy_workers = 0;
+	bool _stopping = false;
+
+	/*Claims chunks of the current job until the range is exhausted.*/
+	void RunChunks() {
+		while (true) {
+			int begin = _next_index.fetch_add(_grain);
+			if (begin >= _count) return;
+			int end = std::min(begin + _grain, _count);
+			_task(begin, end);
+		}
+	}
+
+	void WorkerLoop() {
+		unsigned int seenGeneration = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_work_ready.wait(lock, [&] { return _stopping || _generation != seenGeneration; });
+				if (_stopping) return;
+				seenGeneration = _generation;
+			}
+			RunChunks();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (--_busy_workers == 0) _work_done.notify_one();
+			}
+		}
+	}
+
+public:
+
+	/*Creates a pool with the given number of threads, including the calling thread.  A count of 0 or less uses every hardware thread.*/
+	ThreadPool(int threadCount = 0) : _next_index(0) {
+		if (threadCount <= 0) threadCount = (int)std::thread::hardware_concurrency();
+		if (threadCount <= 0) threadCount = 1;
+		for (int i = 1; i < threadCount; i++) _workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_work_ready.notify_all();
+		for (std::thread& worker : _workers) worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/*Returns the number of threads that work on a job, including the calling thread.*/
+	int GetThreadCount() const { return (int)_workers.size() + 1; }
+
+	/*Runs task(begin, end) over the range [0, count), in chunks of at most 'grain' items, and blocks until every chunk is finished.
+	Chunks may run in any order and on any thread, so the task must not depend on ordering between chunks.*/
+	void ParallelFor(int count, std::function<void(int, int)> task, int grain = 1) {
+		if (count <= 0) return;
+		if (grain < 1) grain = 1;
+		if (_workers.size() == 0 || count <= grain) { task(0, count); return; }
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_task = task;
+			_count = count;
+			_grain = grain;
+			_next_index = 0;
+			_busy_workers = (int)_workers.size();
+			_generation++;
+		}
+		_work_ready.notify_all();
+
+		//The calling thread pitches in too, rather than idling while the workers go.
+		RunChunks();
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_work_done.wait(lock, [&] { return _busy_workers == 0; });
+		_task = nullptr;
+	}
+
+};
+
+
+#endif
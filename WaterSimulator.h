@@ -5,26 +5,204 @@
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 #include <exception>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
 #include "Helpers.h"
 #include "wo.h"
-
+#include "WaveFragment.h"
+#include "WaterSimulatorCPU.h"
+#include "ObstacleMap.h"
+#include "PerturbationLog.h"
+#include "GpuProfiler.h"
+#include "SimulationStats.h"
+
+#define WATER_SIM_CLEAR_COMPUTE_SHADER_FILENAME			"SHADERS/waterSim0Clear.compShdr.txt"
 #define WATER_SIM_COMPUTE_SHADER_FILENAME				"SHADERS/waterSim2Waves.compShdr.txt"
 #define WATER_SIM_PERTURBATION_COMPUTE_SHADER_FILENAME	"SHADERS/waterSim1Perturb.compShdr.txt"
+#define WATER_SIM_TILED_COMPUTE_SHADER_FILENAME			"SHADERS/waterSim2WavesTiled.compShdr.txt"
+#define WATER_SIM_REDUCE_COMPUTE_SHADER_FILENAME		"SHADERS/waterSim3Reduce.compShdr.txt"
+#define WATER_SIM_TILE_COMPACT_COMPUTE_SHADER_FILENAME	"SHADERS/waterSimTileCompact.compShdr.txt"
+#define WATER_SIM_STATS_COMPUTE_SHADER_FILENAME			"SHADERS/waterSim4Stats.compShdr.txt"
+#define WATER_SIM_QUERY_COMPUTE_SHADER_FILENAME			"SHADERS/waterSim5Query.compShdr.txt"
+#define WATER_SIM_PARAMETERS_SHADER_FILENAME			"SHADERS/waterSimParameters.inclShdr.txt"
+#define WATER_SIM_PHYSICS_SHADER_FILENAME				"SHADERS/waterSimPhysics.inclShdr.txt"
+#define WATER_SIM_PACKED_FRAGMENTS_SHADER_FILENAME		"SHADERS/waterSimPackedFragments.inclShdr.txt"
+#define WATER_SIM_WAVE_FRAGMENTS_SHADER_FILENAME		"SHADERS/waterSimWaveFragments.inclShdr.txt"
 #define DEFAULT_TIME_STEP				0.033f
 #define WORK_GROUP_SIZE_X					16
 #define WORK_GROUP_SIZE_Y					16
 #define WORK_GROUP_SIZE_PERTURBATIONS		8
+#define WORK_GROUP_SIZE_TILE_COMPACT		64
+#define WORK_GROUP_SIZE_QUERY				64
+#define SIMULATION_PARAMETERS_BINDING		0
+#define REFLECTION_MAP_TEXTURE_UNIT			1
+#define QUERY_NORMAL_MAP_TEXTURE_UNIT		6
+#define PERTURBATION_RING_SEGMENTS			3
+#define PERTURBATION_RING_SEGMENT_SIZE		1024
+#define STATS_READBACK_SLOTS				3
+#define QUERY_RING_SLOTS					3
+#define QUERY_BATCH_CAPACITY				16384
+#define WORK_GROUP_CACHE_FILENAME			"SHADERS/workGroupSizes.txt"
+#define WORK_GROUP_TUNING_STEPS				8
+
+
+/*The parameters shared by every simulation shader, laid out as the std140 SimulationParameters uniform block, which every one of them 
+has injected from WATER_SIM_PARAMETERS_SHADER_FILENAME.  Every member is a 4-byte scalar (bools are 4 bytes in a uniform block), so std140 packs them with no padding.*/
+struct SimulationParameters {
+	GLint width;
+	GLint height;
+	GLint levels;
+	GLfloat gravity;
+	GLfloat surfaceTension;
+	GLfloat density;
+	GLfloat depth;
+	GLfloat ampTimeEbb;
+	GLfloat ampDistanceEbb;
+	GLfloat solitonSpeed;
+	GLfloat scale;
+	GLint tilesX;
+	GLint tilesY;
+	GLuint fuseLevels;
+	GLuint sparseTiles;
+	GLuint packedFragments;
+	GLint instances;
+	GLuint batched;
+	GLint ringX;
+	GLint ringY;
+};
+
+/*The statistics of one level as the statistics shader leaves them, laid out as its std430 LevelStats.  The maximum amplitude is held as 
+the bits of a float, so that the shader can take it with an integer atomicMax().*/
+struct GPULevelStats {
+	GLfloat energy;
+	GLuint max_amplitude_bits;
+	GLuint active_cells;
+	GLint min_x;
+	GLint min_y;
+	GLint max_x;
+	GLint max_y;
+	GLuint unused;
+};
 
 class WaterSimulator {
 
+	//The batch simulator shares the dispatch and shader setup helpers.
+	friend class WaterSimulatorBatch;
+
+public:
+
+	/*Members describe where the simulation steps are run.*/
+	enum Backend {
+		/*The simulation runs in the compute shaders, and the normal map lives in a texture.*/
+		GPU,
+		/*The simulation runs on a host thread pool with no OpenGL calls at all, and the normal map lives in a host buffer.*/
+		CPU
+	};
+
+	/*Members describe which wave compute shader the GPU backend dispatches.*/
+	enum WaveKernel {
+		/*Each invocation reads its neighbors straight from the fragment storage buffer.*/
+		Standard,
+		/*Each work group loads a halo tile of the scanned fields into shared memory first.*/
+		Tiled
+	};
+
+	/*The wave shader used by the GPU backend.  The tiled shader is compiled the first time it is selected.*/
+	WaveKernel wave_kernel = Standard;
+
+	/*If true, the GPU backend runs every level in a single dispatch, writing each level's contribution to a layer of a texture array, 
+	and then sums the layers into the normal map with a cheap reduction pass.  This keeps the number of dispatches and barriers flat as 
+	levels grow.  The development textures are not written in this mode.*/
+	bool fuse_levels = false;
+
+	/*If true, only the WORK_GROUP_SIZE_X by WORK_GROUP_SIZE_Y tiles which held moving water on the last step (or which were just 
+	perturbed), plus the tiles around them, are simulated.  On the GPU the active tiles are compacted into a list which feeds an indirect 
+	dispatch; the CPU backend keeps a plain list.  Step cost then follows the disturbed area rather than the size of the pond.*/
+	bool sparse_tiles = false;
+
+	/*If true, every step ends by reducing the fragments to their statistics (see GetStats()).  On the GPU the results are copied into a 
+	ring of persistently mapped buffers and only read once their fence has passed, so they arrive a step or so late but never stall.*/
+	bool compute_stats = false;
+
+	/*Cells with a larger amplitude than this count as active in the statistics.*/
+	float stats_active_amplitude = 0.001f;
+
+	/*The most work groups the GPU backend runs along x or y in one dispatch.  A grid which needs more is covered by several dispatches, 
+	and the sparse tile list is dispatched in rows of at most this many tiles.  0 goes up to the device's limit, which is at least 65535; 
+	a lower limit keeps each dispatch short, as some systems reset a GPU which is busy too long on one.*/
+	int dispatch_group_limit = 0;
+
 private:
 	
-	wo::ComputeShaderProgram perturbation_program = wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_PERTURBATION_COMPUTE_SHADER_FILENAME));
-	wo::ComputeShaderProgram wave_program = wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_COMPUTE_SHADER_FILENAME));
+	wo::ComputeShaderProgram* clear_program = nullptr;
+	wo::ComputeShaderProgram* perturbation_program = nullptr;
+	wo::ComputeShaderProgram* wave_program = nullptr;
+	wo::ComputeShaderProgram* wave_program_tiled = nullptr;
+	wo::ComputeShaderProgram* wave_program_tuned = nullptr;
+	wo::ComputeShaderProgram* reduce_program = nullptr;
+	wo::ComputeShaderProgram* tile_compact_program = nullptr;
+	wo::ComputeShaderProgram* stats_program = nullptr;
+	wo::ComputeShaderProgram* query_program = nullptr;
+
+	/*The host engine, which exists only for the CPU backend.*/
+	WaterSimulatorCPU* _cpu = nullptr;
+
+	/*The locations of the uniforms that change on every step, resolved once when a program is compiled.*/
+	struct StepUniforms {
+		GLint in_A_out_B = -1;
+		GLint timeNow = -1;
+		GLint timeElapsed = -1;
+		GLint timeBase = -1;
+		GLint zLevel = -1;
+		GLint perturbationOffset = -1;
+		GLint perturbationCount = -1;
+		GLint originShift = -1;
+		GLint clearRect = -1;
+		GLint groupOffset = -1;
+		void Resolve(wo::ShaderProgram* program) {
+			in_A_out_B = program->GetUniformLocation("in_A_out_B");
+			timeNow = program->GetUniformLocation("timeNow");
+			timeElapsed = program->GetUniformLocation("timeElapsed");
+			timeBase = program->GetUniformLocation("timeBase");
+			zLevel = program->GetUniformLocation("zLevel");
+			perturbationOffset = program->GetUniformLocation("perturbationOffset");
+			perturbationCount = program->GetUniformLocation("perturbationCount");
+			originShift = program->GetUniformLocation("originShift");
+			clearRect = program->GetUniformLocation("clearRect");
+			groupOffset = program->GetUniformLocation("groupOffset");
+		}
+	};
+	StepUniforms _clear_uniforms;
+	StepUniforms _perturbation_uniforms;
+	StepUniforms _wave_uniforms;
+	StepUniforms _wave_tiled_uniforms;
+	StepUniforms _wave_tuned_uniforms;
+
+	/*The work group size of the wave shader's dense dispatches (see SetWaveWorkGroupSize()).  Unless it is the default, those dispatches 
+	run wave_program_tuned, a variant compiled for it.*/
+	int _wave_group_x = WORK_GROUP_SIZE_X;
+	int _wave_group_y = WORK_GROUP_SIZE_Y;
+
+	/*The uniform buffer holding the SimulationParameters, and the values last uploaded to it.*/
+	GLuint _ubo_parameters = INVALID_ID;
+	SimulationParameters _uploaded_parameters;
+	bool _parameters_uploaded = false;
 
 
 public:
 
+	const Backend backend;
+
+	/*How the fragments are stored, on either backend.  The packed encoding triples the number of fragments that fit in memory, at the 
+	cost of half-float precision and some unpacking arithmetic on every read.*/
+	const FragmentEncoding encoding;
+
 	const int width;
 	const int height;
 	const int levels;
@@ -41,44 +219,104 @@ public:
 	int currentTime = 0;
 	int runCount = 0;
 
-	struct WaveFragment {
-		cy::Point2f origin = cy::Point2f(0.0f, 0.0f);
-		float wave_number = 0.0f;
-		float amplitude = 0.0f;
-		int time_start = 0;
-		float phase_offset = 0.0f;
-		float energy = 0.0f;
-		float celerity = 0.0f;
-		cy::Point2f reflection = cy::Point2f(0.0f, 0.0f);
-		float traversal = 0.0f;
-		float unused;
-
-		WaveFragment(float originX, float originY, float waveNumber, float amplitude, int timeStart, float phase, float energy, float celerity, float traversal) 
-			: origin(cy::Point2f(originX, originY)), wave_number(waveNumber), amplitude(amplitude), time_start(timeStart), phase_offset(phase), energy(energy), celerity(celerity), traversal(traversal) {}
-		WaveFragment() {}
-	};
-
-	struct Perturbation {
-		cy::Point2f location;
-		int level;
-		float unused;
-		WaveFragment wave_fragment;
-		Perturbation(cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, int time_start, float phase, float energy, float celerity) 
-			: location(location), level(level), wave_fragment(WaveFragment(origin.x, origin.y, waveNumber, amplitude, time_start, phase, energy, celerity, 0.0f)) {}
-		//Perturbation() : location(cy::Point2f(0, 0)), level(0), wave_fragment(WaveFragment()) {}
-	};
+	/*If set, every accepted perturbation is appended to this log, tagged with the step it precedes.*/
+	PerturbationLog* recorder = nullptr;
 
 	GLuint GetReflectionMapID() { return _tex_reflection_map; }
+
+	/*Returns the obstacles, for editing.  Edits are uploaded at the start of the next step, and only the changed rectangle is sent.*/
+	ObstacleMap& GetObstacleMap() { return _obstacles; }
 	GLuint GetNormalMapID() { return _tex_normal_map; }
 
+	/*Returns the normal map as width*height RGBA floats in a host buffer, or nullptr if the simulation is running on the GPU backend.*/
+	const float* GetNormalMapData() { return (_cpu == nullptr) ? nullptr : _cpu->GetNormalMapData(); }
+
+	/*Returns the host engine, or nullptr if the simulation is running on the GPU backend.*/
+	WaterSimulatorCPU* GetCPUEngine() { return _cpu; }
+
+	/*Gets the statistics of the simulation.  The CPU backend reduces them on the spot, from the last step.  The GPU backend returns the 
+	newest statistics read back so far, which lag a step or more behind (see their run_count), and only exist while compute_stats is set; 
+	it returns false until the first have arrived.*/
+	bool GetStats(SimulationStats& stats) {
+		if (_cpu != nullptr) {
+			_cpu->stats_active_amplitude = stats_active_amplitude;
+			stats = _cpu->ComputeStats();
+			return true;
+		}
+		if (_ssbo_stats != INVALID_ID) CollectStats();
+		stats = _stats;
+		return _stats.run_count >= 0;
+	}
+
+	/*Queues a batch of height and normal queries at the given points, in cells (see WaterSimulatorCPU::QueryBatch()), against the normal 
+	map as the last step left it.  On the GPU the whole batch is sampled in one dispatch, and GetQueryResults() returns the samples once 
+	the GPU has finished, usually by the next frame; the CPU backend samples them at once.  Returns a ticket for the results, or -1 if the 
+	batch holds more than QUERY_BATCH_CAPACITY points, or if the GPU is still busy with the batch that last used the next slot of the ring.*/
+	int QueryBatch(const std::vector<cy::Point2f>& points) {
+		if (points.size() > QUERY_BATCH_CAPACITY) return -1;
+		int ticket = _next_query_ticket;
+		int slot = ticket % QUERY_RING_SLOTS;
+		int count = (int)points.size();
+		if (_cpu != nullptr) _cpu->QueryBatch(points, _query_host_samples[slot]);
+		else {
+			PrepareQueries();
+			if (!PollFence(_query_fences[slot])) return -1;
+			GpuProfileZone queryZone("WaterSimulator query");
+			int offset = slot * QUERY_BATCH_CAPACITY;
+			if (count > 0) std::memcpy(_query_points + offset, &points[0], count * sizeof(cy::Point2f));
+
+			UploadParameters();
+			if (!query_program->Bind()) return -1;
+			query_program->SetUniform(_query_uniform_queryOffset, offset);
+			query_program->SetUniform(_query_uniform_queryCount, count);
+			glActiveTexture(GL_TEXTURE0 + QUERY_NORMAL_MAP_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, _tex_normal_map);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, _ssbo_query_points);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, _ssbo_query_samples);
+
+			//The wave shader wrote the normal map as an image, and this reads it as a texture.
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+			glDispatchCompute((count + WORK_GROUP_SIZE_QUERY - 1) / WORK_GROUP_SIZE_QUERY, 1, 1);
+			glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+			_query_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		_query_tickets[slot] = ticket;
+		_query_counts[slot] = count;
+		_next_query_ticket++;
+		return ticket;
+	}
+
+	/*Gets the samples of the batch with the given ticket, one per point in the order given.  Never waits:  returns false if the GPU has 
+	not finished the batch yet, or if the ticket is unknown or so old that its slot has been reused.*/
+	bool GetQueryResults(int ticket, std::vector<WaterSample>& samples) {
+		if (ticket <= 0) return false;
+		int slot = ticket % QUERY_RING_SLOTS;
+		if (_query_tickets[slot] != ticket) return false;
+		if (_cpu != nullptr) { samples = _query_host_samples[slot]; return true; }
+		if (!PollFence(_query_fences[slot])) return false;
+		WaterSample* first = _query_samples + (slot * QUERY_BATCH_CAPACITY);
+		samples.assign(first, first + _query_counts[slot]);
+		return true;
+	}
+
 
 	bool Perturb(cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
-		if (location.x < 0 || location.x >= width * scale) return false;
-		if (location.y < 0 || location.y >= height * scale) return false;
-		if (level < 0 || level > levels) return false;
+		//The location is in cells, and indexes the fragments directly.
+		if (location.x < 0 || location.x >= width) return false;
+		if (location.y < 0 || location.y >= height) return false;
+		if (level < 0 || level >= levels) return false;
 		if (waveNumber <= 0.0f) return false;
 		if (amplitude <= 0.0f) return false;
 		
+		if (recorder != nullptr) recorder->Record(runCount, location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+		if (_cpu != nullptr) {
+			//Already recorded above, so keep the engine from recording it again.
+			PerturbationLog* cpuRecorder = _cpu->recorder;
+			_cpu->recorder = nullptr;
+			bool perturbed = _cpu->Perturb(location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+			_cpu->recorder = cpuRecorder;
+			return perturbed;
+		}
 		Perturbation p = Perturbation(cy::Point2f(location.x, location.y), level, origin, waveNumber, amplitude, timeStamp, phase_offset, 0, 0);
 		_perturbations.push_back(p);
 
@@ -94,16 +332,97 @@ private:
 
 	std::vector<Perturbation> _perturbations;
 
+	ObstacleMap _obstacles;
+
+	/*If true, the reflection map is stored as RGBA8_SNORM rather than RGBA32F.*/
+	bool _compact_obstacles = false;
+
 	GLuint _ssbo_fragments_A = INVALID_ID;
 	GLuint _ssbo_fragments_B = INVALID_ID;
 
+	/*The perturbations are uploaded through a ring of PERTURBATION_RING_SEGMENTS segments in a persistently mapped buffer.  Each segment
+	is fenced when a dispatch reads it, and only waited on when the ring comes back round to it, so an upload never has to reallocate
+	the buffer or wait for the GPU to finish with the last step's perturbations.*/
 	GLuint _ssbo_perturbations = INVALID_ID;
+	Perturbation* _perturbation_ring = nullptr;
+	GLsync _perturbation_fences[PERTURBATION_RING_SEGMENTS] = {};
+	int _perturbation_segment = 0;
 
 	GLuint _tex_normal_map = INVALID_ID;
 	GLuint _tex_reflection_map = INVALID_ID;
 
+	/*The per-level contributions to the normal map, used only when the levels are fused into one dispatch.*/
+	GLuint _tex_level_maps = INVALID_ID;
+	GLint _reduce_uniform_groupOffset = -1;
+
+	/*The active tile flags, the compacted list of active tiles, and the indirect dispatch command, used only for sparse tiles.*/
+	GLuint _ssbo_tile_flags = INVALID_ID;
+	GLuint _ssbo_tile_list = INVALID_ID;
+	GLuint _buf_tile_dispatch = INVALID_ID;
+	int _tiles_x = 0;
+	int _tiles_y = 0;
+	GLint _tile_compact_uniform_dispatchRow = -1;
+
+	/*The world cell shown at cell (0, 0) of the window, where that cell is stored in the toroidal fragment buffers, and how far the window
+	has scrolled since the input fragments were written (whose full-encoding origins are still in the window as it was then).*/
+	int _window_x = 0;
+	int _window_y = 0;
+	int _ring_x = 0;
+	int _ring_y = 0;
+	int _origin_shift_x = 0;
+	int _origin_shift_y = 0;
+	int _snapshot_window[6] = {};
+
+	/*Whether the last step ran sparse.  If it didn't, no tiles were flagged, so the next sparse step must run them all.*/
+	bool _last_step_sparse = false;
+
 	bool _in_A_out_B = true;
 
+	/*The time of the last wave step, from which the ages of packed input fragments are measured.*/
+	int _time_base = 0;
+
+	/*The spare fragment buffer which holds a snapshot of the simulation state, and the clocks at the time it was taken.*/
+	GLuint _ssbo_snapshot = INVALID_ID;
+	bool _has_snapshot = false;
+	int _snapshot_time = 0;
+	int _snapshot_time_base = 0;
+	int _snapshot_run_count = 0;
+
+	/*The statistics of the last step reduced, the partial energies of each work group, and the readback ring:  STATS_READBACK_SLOTS 
+	copies of the statistics in a persistently mapped buffer, each fenced when its copy is made, and stamped with the step it describes.*/
+	GLuint _ssbo_stats = INVALID_ID;
+	GLuint _ssbo_stats_partials = INVALID_ID;
+	GLuint _buf_stats_readback = INVALID_ID;
+	GPULevelStats* _stats_readback = nullptr;
+	GLsync _stats_fences[STATS_READBACK_SLOTS] = {};
+	int _stats_run_counts[STATS_READBACK_SLOTS] = {};
+	int _stats_times[STATS_READBACK_SLOTS] = {};
+	int _stats_slot = 0;
+	GLint _stats_uniform_timeNow = -1;
+	GLint _stats_uniform_activeAmplitude = -1;
+	GLint _stats_uniform_finalizeStats = -1;
+	GLint _stats_uniform_partialCount = -1;
+	GLint _stats_uniform_groupOffset = -1;
+
+	/*The newest statistics read back.*/
+	SimulationStats _stats;
+
+	/*Height queries go through a ring of QUERY_RING_SLOTS slots, each with room for QUERY_BATCH_CAPACITY points and their samples in a 
+	pair of persistently mapped buffers.  A slot is fenced when its batch is dispatched, and its samples are only read once the fence has 
+	passed.  Each slot remembers the ticket of the batch it holds, so results outlive their batch until the ring comes back round.  The 
+	CPU backend answers at once, into the host samples of the slot.*/
+	GLuint _ssbo_query_points = INVALID_ID;
+	GLuint _ssbo_query_samples = INVALID_ID;
+	cy::Point2f* _query_points = nullptr;
+	WaterSample* _query_samples = nullptr;
+	GLsync _query_fences[QUERY_RING_SLOTS] = {};
+	int _query_tickets[QUERY_RING_SLOTS] = {};
+	int _query_counts[QUERY_RING_SLOTS] = {};
+	std::vector<WaterSample> _query_host_samples[QUERY_RING_SLOTS];
+	int _next_query_ticket = 1;
+	GLint _query_uniform_queryOffset = -1;
+	GLint _query_uniform_queryCount = -1;
+
 	
 	int GetIndex(int x, int y, int level) {
 		int levelContribution = level * width * height;
@@ -113,35 +432,51 @@ private:
 	
 
 public:
-	WaterSimulator(int width, int height, int levels, float scale = 10.0f) : width(width), height(height), levels(levels), scale(scale) {
+	/*Creates a simulator of the given size, which need not be a multiple of the work group size.  The CPU backend makes no OpenGL calls, 
+	so it may be constructed without a context; a thread count of 0 or less uses every hardware thread.  The GPU backend ignores the thread 
+	count, and always stores the fragments densely.*/
+	WaterSimulator(int width, int height, int levels, float scale = 10.0f, Backend backend = GPU, int threadCount = 0, FragmentEncoding encoding = FullFragments,
+		FragmentStorage storage = DenseStorage) 
+		: backend(backend), encoding(encoding), width(width), height(height), levels(levels), scale(scale), _obstacles(width, height) {
+
+		if (backend == CPU) {
+			_cpu = new WaterSimulatorCPU(width, height, levels, scale, threadCount, encoding, storage);
+			return;
+		}
 
-		//GL_MAX_COMPUTE_WORK_GROUP_COUNT x = y = z = 65535
+		clear_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_CLEAR_COMPUTE_SHADER_FILENAME, GetLocalSizeDefines(WORK_GROUP_SIZE_X, WORK_GROUP_SIZE_Y), GetShaderIncludes()));
+		perturbation_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_PERTURBATION_COMPUTE_SHADER_FILENAME, GetLocalSizeDefines(WORK_GROUP_SIZE_PERTURBATIONS), GetShaderIncludes()));
+		wave_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_COMPUTE_SHADER_FILENAME, GetWaveDefines(WORK_GROUP_SIZE_X, WORK_GROUP_SIZE_Y, false), GetWaveShaderIncludes()));
+		_clear_uniforms.Resolve(clear_program);
+		_perturbation_uniforms.Resolve(perturbation_program);
+		_wave_uniforms.Resolve(wave_program);
 
-		int numFragments = width * height * levels;
+		//The tiles are the wave shader's work groups, and the edge tiles may hang over the edge of the grid.
+		_tiles_x = (width + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X;
+		_tiles_y = (height + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y;
 
-		//Generate the fragment buffers.
-		std::vector<WaveFragment> emptyFragments(numFragments);
-		int idx = 0;
-		for (int z = 0; z < levels; z++) {
-			for (int y = 0; y < height; y++) {
-				for (int x = 0; x < width; x++) {
-					emptyFragments[idx++] = WaveFragment(x*scale, y*scale, 0, 0, 0, 0, 0, 0,0);
-				}
-			}
-		}
+		//The parameter block is filled on the first step.
+		glGenBuffers(1, &_ubo_parameters);
+		glBindBuffer(GL_UNIFORM_BUFFER, _ubo_parameters);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(SimulationParameters), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, NULL);
+
+		//Generate the fragment buffers.  Their storage is allocated once here, and Clear() fills them on the GPU.
 		glGenBuffers(1, &_ssbo_fragments_A);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_fragments_A);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, numFragments * sizeof(WaveFragment), &emptyFragments[0], GL_STATIC_DRAW);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, GetFragmentBufferSize(), NULL, GL_DYNAMIC_COPY);
 		glGenBuffers(1, &_ssbo_fragments_B);
-		
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_fragments_B);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, numFragments * sizeof(WaveFragment), &emptyFragments[0], GL_STATIC_DRAW);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, GetFragmentBufferSize(), NULL, GL_DYNAMIC_COPY);
 		Clear();
 
-		//Generate the perturbation buffer, but don't fill it with anything yet.  That will come later.
+		//Generate the perturbation ring, and map it for good.  It is filled as perturbations arrive.
+		GLsizeiptr ringSize = PERTURBATION_RING_SEGMENTS * PERTURBATION_RING_SEGMENT_SIZE * sizeof(Perturbation);
+		GLbitfield ringFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
 		glGenBuffers(1, &_ssbo_perturbations);
-		//glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_perturbations);
-		//glBufferData(GL_SHADER_STORAGE_BUFFER, max_perturbation_size * sizeof(Perturbation), NULL, GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_perturbations);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, ringSize, NULL, ringFlags);
+		_perturbation_ring = (Perturbation*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ringSize, ringFlags);
 
 		//Build the normal map.
 		//Relying on http://antongerdelan.net/opengl/compute.html and http://malideveloper.arm.com/sample-code/introduction-compute-shaders-2/ here
@@ -162,14 +497,7 @@ public:
 							GL_RGBA32F);		/*Format */			//This call is unique for an "image" cf a "texture"
 
 		
-		glGenTextures(1, &_tex_reflection_map);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, _tex_reflection_map);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);				
-		
+		CreateReflectionMap();
 		SetObstacles(false, false, false);
 
 		//TODO:   Development only - create the development textures.
@@ -181,166 +509,444 @@ public:
 		CHECK_GL_ERROR("Here");
 	}
 	~WaterSimulator() {
+		if (_cpu != nullptr) { delete _cpu; return; }
+		delete clear_program;
+		delete perturbation_program;
+		delete wave_program;
+		delete wave_program_tiled;
+		delete wave_program_tuned;
+		delete reduce_program;
+		delete tile_compact_program;
+		delete stats_program;
+		delete query_program;
 		if (_ssbo_fragments_A != INVALID_ID) glDeleteBuffers(1, &_ssbo_fragments_A);
 		if (_ssbo_fragments_B != INVALID_ID) glDeleteBuffers(1, &_ssbo_fragments_B);
-		if (_ssbo_perturbations != INVALID_ID) glDeleteBuffers(1, &_ssbo_perturbations);
+		if (_ssbo_snapshot != INVALID_ID) glDeleteBuffers(1, &_ssbo_snapshot);
+		for (int i = 0; i < PERTURBATION_RING_SEGMENTS; i++) if (_perturbation_fences[i] != NULL) glDeleteSync(_perturbation_fences[i]);
+		if (_ssbo_perturbations != INVALID_ID) {
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_perturbations);
+			glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+			glDeleteBuffers(1, &_ssbo_perturbations);
+		}
 		if (_tex_normal_map != INVALID_ID) glDeleteTextures(1, &_tex_normal_map);
+		if (_tex_reflection_map != INVALID_ID) glDeleteTextures(1, &_tex_reflection_map);
+		if (_tex_level_maps != INVALID_ID) glDeleteTextures(1, &_tex_level_maps);
+		if (_ssbo_tile_flags != INVALID_ID) glDeleteBuffers(1, &_ssbo_tile_flags);
+		if (_ssbo_tile_list != INVALID_ID) glDeleteBuffers(1, &_ssbo_tile_list);
+		if (_buf_tile_dispatch != INVALID_ID) glDeleteBuffers(1, &_buf_tile_dispatch);
+		if (_ubo_parameters != INVALID_ID) glDeleteBuffers(1, &_ubo_parameters);
+		for (int i = 0; i < STATS_READBACK_SLOTS; i++) if (_stats_fences[i] != NULL) glDeleteSync(_stats_fences[i]);
+		if (_buf_stats_readback != INVALID_ID) {
+			glBindBuffer(GL_COPY_WRITE_BUFFER, _buf_stats_readback);
+			glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+			glDeleteBuffers(1, &_buf_stats_readback);
+		}
+		if (_ssbo_stats != INVALID_ID) glDeleteBuffers(1, &_ssbo_stats);
+		if (_ssbo_stats_partials != INVALID_ID) glDeleteBuffers(1, &_ssbo_stats_partials);
+		for (int i = 0; i < QUERY_RING_SLOTS; i++) if (_query_fences[i] != NULL) glDeleteSync(_query_fences[i]);
+		if (_ssbo_query_points != INVALID_ID) {
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_query_points);
+			glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+			glDeleteBuffers(1, &_ssbo_query_points);
+		}
+		if (_ssbo_query_samples != INVALID_ID) {
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_query_samples);
+			glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+			glDeleteBuffers(1, &_ssbo_query_samples);
+		}
 	}
 
 
 	void SetObstacles(bool border, bool square, bool bar) {
-		
-		std::vector<cy::Point4f> reflections(width*height);
-		for (int i = 0; i < (width * height); i++) reflections[i] = cy::Point4f(0, 0, 1, 1);
+		_obstacles.Set(WaterSimulatorCPU::BuildObstacles(width, height, border, square, bar));
+		UploadObstacles();
+	}
 
-		if (border) {
-			for (int x = 0; x < width; x++) {
-				reflections[GetIndex(x, 0, 0)] = cy::Point4f(0, 1, 1, 1);
-				reflections[GetIndex(x, height - 1, 0)] = cy::Point4f(0, -1, 1, 1);
-			}
-			for (int y = 0; y < height; y++) {
-				reflections[GetIndex(0, y, 0)] = cy::Point4f(1, 0, 1, 1);
-				reflections[GetIndex(width - 1, y, 0)] = cy::Point4f(-1, 0, 1, 1);
-			}
-		}
+	/*Chooses whether the reflection map is stored compactly, as RGBA8_SNORM (4 bytes a texel, with normals quantized to 1/127), or as 
+	RGBA32F (16 bytes a texel).  The shaders read it with texelFetch(), so they work with either.  The CPU backend ignores this.*/
+	void SetCompactObstacles(bool compact) {
+		if (compact == _compact_obstacles || _cpu != nullptr) return;
+		_compact_obstacles = compact;
+
+		//The storage is immutable, so the texture is made afresh and filled from the host copy.
+		glDeleteTextures(1, &_tex_reflection_map);
+		CreateReflectionMap();
+		_obstacles.Invalidate();
+		UploadObstacles();
+	}
 
-		if (square) {
-			int centerX = width / 4, centerY = width / 2;
-			int square_width = width / 8, square_height = height / 8;
-			int xStart = centerX - square_width, xEnd = centerX + square_width;
-			int yStart = centerY - square_height, yEnd = centerY + square_height;
-			//Damp it all
-			for (int x = xStart; x <= xEnd; x++) {
-				for (int y = yStart; y <= yEnd; y++) {
-					reflections[GetIndex(x, y, 0)] = cy::Point4f(0, 0, 0, 1);
-				}
-			}
-			//The inset box.
-			for (int x = xStart; x <= xEnd; x++) {
-				reflections[GetIndex(x, yStart, 0)] = cy::Point4f(0, -1, 1, 1);
-				reflections[GetIndex(x, yEnd, 0)] = cy::Point4f(0, 1, 1, 1);
-			}
-			for (int y = yStart; y <= yEnd; y++) {
-				reflections[GetIndex(xStart, y, 0)] = cy::Point4f(-1, 0, 1, 1);
-				reflections[GetIndex(xEnd, y, 0)] = cy::Point4f(1, 0, 1, 1);
-			}
-		}
+	/*Sends the changed rectangle of the obstacle map to the reflection map.*/
+	void UploadObstacles() {
+		if (!_obstacles.IsDirty()) return;
+		int x0, y0, x1, y1;
+		_obstacles.GetDirtyRect(x0, y0, x1, y1);
+		_obstacles.ClearDirty();
+		const std::vector<cy::Point4f>& texels = _obstacles.GetTexels();
+		if (_cpu != nullptr) { _cpu->UpdateReflections(texels, x0, y0, x1, y1); return; }
 
-		if (bar) {
-			int centerX = 3*(width / 4), centerY = width / 2;
-			int square_width = width / 10;
-			int xStart = centerX - square_width, xEnd = centerX + square_width;
-			int yEnd = height-square_width;
-			//Damp it all
-			for (int x = xStart; x <= xEnd; x++) {
-				for (int y = 0; y <= yEnd; y++) {
-					reflections[GetIndex(x, y, 0)] = cy::Point4f(0, 0, 0, 1);
+		glActiveTexture(GL_TEXTURE0 + REFLECTION_MAP_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D, _tex_reflection_map);
+		if (_compact_obstacles) {
+			std::vector<GLbyte> packed((x1 - x0) * (y1 - y0) * 4);
+			int i = 0;
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) {
+					const cy::Point4f& t = texels[x + (y * width)];
+					for (int c = 0; c < 4; c++) packed[i++] = (GLbyte)std::round(std::max(-1.0f, std::min(t[c], 1.0f)) * 127.0f);
 				}
 			}
-			//The inset box.
-			for (int x = xStart; x <= xEnd; x++) {
-				//reflections[GetIndex(x, yStart, 0)] = cy::Point4f(0, -1, 1, 1);
-				reflections[GetIndex(x, yEnd, 0)] = cy::Point4f(0, 1, 1, 1);
-			}
-			for (int y = 0; y <= yEnd; y++) {
-				reflections[GetIndex(xStart, y, 0)] = cy::Point4f(-1, 0, 1, 1);
-				reflections[GetIndex(xEnd, y, 0)] = cy::Point4f(1, 0, 1, 1);
-			}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1 - x0, y1 - y0, GL_RGBA, GL_BYTE, &packed[0]);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+		else {
+			//Upload straight out of the host copy, skipping the texels on either side of the rectangle.
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1 - x0, y1 - y0, GL_RGBA, GL_FLOAT, &texels[x0 + (y0 * width)]);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 		}
-
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, _tex_reflection_map);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, &reflections[0]);
-		glBindImageTexture(3, _tex_reflection_map, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
 	}
 
 	
 
 	void Clear() {
-		int numFragments = width * height * levels;
-		//Generate the fragment buffers.
-		std::vector<WaveFragment> emptyFragments(numFragments);
-		int idx = 0;
-		for (int z = 0; z < levels; z++) {
-			for (int y = 0; y < height; y++) {
-				for (int x = 0; x < width; x++) {
-					emptyFragments[idx++] = WaveFragment(x*scale, y*scale, 0, 0, 0, 0, 0, 0, 0);
+		if (_cpu != nullptr) { _cpu->currentTime = currentTime; _cpu->Clear(); return; }
+		_time_base = currentTime;
+		_origin_shift_x = 0;
+		_origin_shift_y = 0;
+
+		//Reset both buffers in place.
+		ClearCells(0, 0, width, height);
+
+		//Every tile has to be rewritten once after a reset.
+		_last_step_sparse = false;
+	}
+
+	/*Scrolls the window dx cells along x and dy along y, across water which stays put in the world.  The fragment buffers are addressed 
+	toroidally, so nothing is copied:  only the cells scrolled into view are reset, and the fragments' origins are rebased by the next step 
+	as it reads them.  Perturbations not applied yet move with the water, and are dropped if they leave the window.  The reflection map 
+	stays with the window, and the normal map is out of date until the next step.*/
+	void Scroll(int dx, int dy) {
+		if (dx == 0 && dy == 0) return;
+		if (_cpu != nullptr) { _cpu->Scroll(dx, dy); return; }
+
+		_window_x += dx;
+		_window_y += dy;
+		_ring_x = (((_ring_x + dx) % width) + width) % width;
+		_ring_y = (((_ring_y + dy) % height) + height) % height;
+		if (encoding == FullFragments) {
+			_origin_shift_x += dx;
+			_origin_shift_y += dy;
+		}
+
+		cy::Point2f delta((float)dx, (float)dy);
+		auto left = std::remove_if(_perturbations.begin(), _perturbations.end(), [&](Perturbation& p) {
+			p.location = p.location - delta;
+			p.wave_fragment.origin = p.wave_fragment.origin - delta;
+			return p.location.x < 0 || p.location.y < 0 || (int)p.location.x >= width || (int)p.location.y >= height;
+		});
+		_perturbations.erase(left, _perturbations.end());
+
+		//Reset the cells scrolled into view:  a band of columns on one side of the window, and a band of rows on another.
+		int columns = std::min(std::abs(dx), width), rows = std::min(std::abs(dy), height);
+		int x0 = (dx > 0) ? width - columns : 0;
+		int y0 = (dy > 0) ? height - rows : 0;
+		if (columns > 0) ClearCells(x0, 0, x0 + columns, height);
+		if (rows > 0) ClearCells(0, y0, width, y0 + rows);
+
+		//The tile flags are kept by window tile, and the window's tiles now hold different water, so every tile has to run once.
+		_last_step_sparse = false;
+	}
+
+	/*Scrolls the window so that the given world cell lies at its center.*/
+	void CenterOn(cy::Point2f cell) {
+		Scroll((int)std::floor(cell.x) - (width / 2) - GetWindowX(), (int)std::floor(cell.y) - (height / 2) - GetWindowY());
+	}
+
+	/*Returns the world cell shown at cell (0, 0) of the window.  This only moves when the window is scrolled.*/
+	int GetWindowX() const { return (_cpu != nullptr) ? _cpu->GetWindowX() : _window_x; }
+	int GetWindowY() const { return (_cpu != nullptr) ? _cpu->GetWindowY() : _window_y; }
+
+	/*Copies the simulation state into a spare buffer, replacing any earlier snapshot.  Pending perturbations are not part of the 
+	snapshot.*/
+	void Snapshot() {
+		_snapshot_time = currentTime;
+		_snapshot_run_count = runCount;
+		_has_snapshot = true;
+		if (_cpu != nullptr) { _cpu->Snapshot(); return; }
+
+		_snapshot_time_base = _time_base;
+		int window[6] = { _window_x, _window_y, _ring_x, _ring_y, _origin_shift_x, _origin_shift_y };
+		std::copy(window, window + 6, _snapshot_window);
+		if (_ssbo_snapshot == INVALID_ID) {
+			glGenBuffers(1, &_ssbo_snapshot);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, _ssbo_snapshot);
+			glBufferData(GL_COPY_WRITE_BUFFER, GetFragmentBufferSize(), NULL, GL_DYNAMIC_COPY);
+		}
+		//Only the input buffer matters:  the next step overwrites the output buffer and the normal map.
+		glBindBuffer(GL_COPY_READ_BUFFER, _in_A_out_B ? _ssbo_fragments_A : _ssbo_fragments_B);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, _ssbo_snapshot);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, GetFragmentBufferSize());
+		glBindBuffer(GL_COPY_READ_BUFFER, NULL);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, NULL);
+	}
+
+	/*Rolls the simulation back to the last snapshot, including its clock.  Returns false if no snapshot has been taken.*/
+	bool Restore() {
+		if (!_has_snapshot) return false;
+		currentTime = _snapshot_time;
+		runCount = _snapshot_run_count;
+		if (_cpu != nullptr) return _cpu->Restore();
+
+		_time_base = _snapshot_time_base;
+		_window_x = _snapshot_window[0];
+		_window_y = _snapshot_window[1];
+		_ring_x = _snapshot_window[2];
+		_ring_y = _snapshot_window[3];
+		_origin_shift_x = _snapshot_window[4];
+		_origin_shift_y = _snapshot_window[5];
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_COPY_READ_BUFFER, _ssbo_snapshot);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, _in_A_out_B ? _ssbo_fragments_A : _ssbo_fragments_B);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, GetFragmentBufferSize());
+		glBindBuffer(GL_COPY_READ_BUFFER, NULL);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, NULL);
+
+		//The tile flags describe the state that was rolled away from, so every tile has to run once.
+		_last_step_sparse = false;
+		return true;
+	}
+
+	/*Gets the work group size of the wave shader's dense dispatches.*/
+	void GetWaveWorkGroupSize(int& x, int& y) const { x = _wave_group_x; y = _wave_group_y; }
+
+	/*Compiles a variant of the wave shader with the given work group size, and runs the dense dispatches with it from the next step on.  
+	The size must be allowed by the device; the edge groups hang over the edge of a grid which is not a multiple of it.  Sparse tiles and 
+	the tiled kernel keep WORK_GROUP_SIZE_X by WORK_GROUP_SIZE_Y, since their tiles are their work groups.  Returns false, leaving the size 
+	as it was, if the size cannot be used; the CPU backend has no work groups, and always returns false.*/
+	bool SetWaveWorkGroupSize(int x, int y) {
+		if (_cpu != nullptr || x <= 0 || y <= 0) return false;
+		GLint maxInvocations = 0, maxX = 0, maxY = 0;
+		glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+		glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxX);
+		glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &maxY);
+		if (x > maxX || y > maxY || x * y > maxInvocations) return false;
+
+		wo::ComputeShaderProgram* program = nullptr;
+		if (x != WORK_GROUP_SIZE_X || y != WORK_GROUP_SIZE_Y) {
+			wo::Shader shader(GL_COMPUTE_SHADER, WATER_SIM_COMPUTE_SHADER_FILENAME, GetWaveDefines(x, y, true), GetWaveShaderIncludes());
+			try { program = new wo::ComputeShaderProgram(shader.GetID()); }
+			catch (std::exception&) { return false; }
+			_wave_tuned_uniforms.Resolve(program);
+		}
+		delete wave_program_tuned;
+		wave_program_tuned = program;
+		_wave_group_x = x;
+		_wave_group_y = y;
+		return true;
+	}
+
+	/*Sets the wave shader's work group size (see SetWaveWorkGroupSize()) to whichever of a few candidates steps fastest on this device 
+	and grid, and caches the choice in the given file, keyed by the device, the grid and the encoding, so that later runs on the same 
+	machine only read it back.  Each candidate is timed over WORK_GROUP_TUNING_STEPS steps of a freshly disturbed pond, all from the same 
+	state.  Meant to be called once at startup.  The timing steps are rolled back with a snapshot of their own, so any snapshot already 
+	taken is kept, and the perturbations already pending are kept for the next step.  Returns false on the CPU backend, which has nothing 
+	to tune.*/
+	bool AutotuneWorkGroups(const char* cacheFilename = WORK_GROUP_CACHE_FILENAME) {
+		if (_cpu != nullptr) return false;
+		std::string key = GetWorkGroupCacheKey();
+		int x, y;
+		if (ReadWorkGroupCache(cacheFilename, key, x, y) && SetWaveWorkGroupSize(x, y)) return true;
+
+		//Only the dense dispatches of the standard kernel use the tuned size, so the switches which bypass them are off while timing.
+		static const int candidates[][2] = { { 16, 16 }, { 8, 8 }, { 16, 8 }, { 8, 16 }, { 32, 8 }, { 8, 32 }, { 32, 16 }, { 16, 32 }, { 32, 32 }, { 64, 4 }, { 64, 1 } };
+		std::vector<Perturbation> pending;
+		pending.swap(_perturbations);
+		PerturbationLog* oldRecorder = recorder;
+		bool oldStats = compute_stats, oldSparse = sparse_tiles;
+		WaveKernel oldKernel = wave_kernel;
+		recorder = nullptr;
+		compute_stats = false;
+		sparse_tiles = false;
+		wave_kernel = Standard;
+
+		//Set the caller's snapshot aside, so that the one taken here goes in a buffer of its own.
+		GLuint callerSnapshot = _ssbo_snapshot;
+		bool callerHasSnapshot = _has_snapshot;
+		int callerSnapshotClock[3] = { _snapshot_time, _snapshot_time_base, _snapshot_run_count };
+		int callerSnapshotWindow[6];
+		std::copy(_snapshot_window, _snapshot_window + 6, callerSnapshotWindow);
+		_ssbo_snapshot = INVALID_ID;
+		Snapshot();
+
+		int stepTime = (int)(DEFAULT_TIME_STEP * 1000.0f);
+		double bestSeconds = -1.0;
+		int bestX = WORK_GROUP_SIZE_X, bestY = WORK_GROUP_SIZE_Y;
+		for (const int* candidate : candidates) {
+			if (!SetWaveWorkGroupSize(candidate[0], candidate[1])) continue;
+			Restore();
+			for (int level = 0; level < levels; level++) {
+				for (int i = 0; i < 4; i++) {
+					cy::Point2f drop((float)(((2 * i) + 1) * width / 8), (float)(((2 * ((i + level) % 4)) + 1) * height / 8));
+					PerturbPoint(drop, level, 0.2f * (level + 1), 1.0f, currentTime);
 				}
 			}
+
+			//The first step also applies the perturbations, and may finish compiling the variant, so it is not timed.
+			Execute(stepTime);
+			glFinish();
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < WORK_GROUP_TUNING_STEPS; i++) Execute(stepTime);
+			glFinish();
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (bestSeconds < 0.0 || seconds < bestSeconds) {
+				bestSeconds = seconds;
+				bestX = candidate[0];
+				bestY = candidate[1];
+			}
 		}
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_fragments_A);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, numFragments * sizeof(WaveFragment), &emptyFragments[0], GL_STATIC_DRAW);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_fragments_B);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, numFragments * sizeof(WaveFragment), &emptyFragments[0], GL_STATIC_DRAW);
 
+		Restore();
+		glDeleteBuffers(1, &_ssbo_snapshot);
+		_ssbo_snapshot = callerSnapshot;
+		_has_snapshot = callerHasSnapshot;
+		_snapshot_time = callerSnapshotClock[0];
+		_snapshot_time_base = callerSnapshotClock[1];
+		_snapshot_run_count = callerSnapshotClock[2];
+		std::copy(callerSnapshotWindow, callerSnapshotWindow + 6, _snapshot_window);
+		_perturbations.swap(pending);
+		recorder = oldRecorder;
+		compute_stats = oldStats;
+		sparse_tiles = oldSparse;
+		wave_kernel = oldKernel;
+		SetWaveWorkGroupSize(bestX, bestY);
+		WriteWorkGroupCache(cacheFilename, key, bestX, bestY);
+		return true;
 	}
 
 	bool Execute(int elapsedTime) {
 
+		CPU_PROFILE_ZONE("WaterSimulator::Execute");
+		UploadObstacles();
+		if (_cpu != nullptr) return ExecuteCPU(elapsedTime);
+		GpuProfileZone executeZone("WaterSimulator::Execute");
+
+		if (sparse_tiles) {
+			PrepareTiles();
+			if (!_last_step_sparse) MarkAllTilesActive();
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _ssbo_tile_flags);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _ssbo_tile_list);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _buf_tile_dispatch);
+		}
+		_last_step_sparse = sparse_tiles;
+		UploadParameters();
 		
-		
-		//Run the perturbation shader - the amount sent must be a multiple of the perturb work group size.
-		if (!perturbation_program.Bind()) return false;
+		//Run the perturbation shader, one ring segment at a time.
+		if (!perturbation_program->Bind()) return false;
 		if (_perturbations.size() > 0) {
+			GpuProfileZone perturbZone("WaterSimulator perturb");
+			CoalescePerturbations();
+			perturbation_program->SetUniform(_perturbation_uniforms.timeBase, _time_base);
+			perturbation_program->SetUniform(_perturbation_uniforms.originShift, (float)_origin_shift_x, (float)_origin_shift_y);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 8 : 1, _in_A_out_B ? _ssbo_fragments_A : _ssbo_fragments_B);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _ssbo_perturbations);
 
-			//Fill up the list with duplicates of the last one, up to the nearest multiple of the group size.
-			while (_perturbations.size() % WORK_GROUP_SIZE_PERTURBATIONS != 0)
-				_perturbations.push_back(_perturbations[_perturbations.size() - 1]);
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_perturbations);
-			glBufferData(GL_SHADER_STORAGE_BUFFER, _perturbations.size() * sizeof(Perturbation), &_perturbations[0], GL_STATIC_DRAW);
-
-			perturbation_program.SetUniform("width", width);
-			perturbation_program.SetUniform("height", height);
-			perturbation_program.SetUniform("gravity", gravity);
-			perturbation_program.SetUniform("surfaceTension", surfaceTension);
-			perturbation_program.SetUniform("density", density);
-			perturbation_program.SetUniform("depth", depth);
-			perturbation_program.SetUniform("scale", scale);
+			for (int start = 0; start < (int)_perturbations.size(); start += PERTURBATION_RING_SEGMENT_SIZE) {
+				int count = std::min((int)_perturbations.size() - start, PERTURBATION_RING_SEGMENT_SIZE);
+				int segment = _perturbation_segment;
+				_perturbation_segment = (_perturbation_segment + 1) % PERTURBATION_RING_SEGMENTS;
 
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _in_A_out_B ? _ssbo_fragments_A : _ssbo_fragments_B);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _ssbo_perturbations);
-			int workGroupCount = _perturbations.size() / WORK_GROUP_SIZE_PERTURBATIONS;
-			glDispatchCompute(workGroupCount, 1, 1);
+				//Wait until the GPU is done with whatever this segment held last time round.
+				if (_perturbation_fences[segment] != NULL) {
+					while (glClientWaitSync(_perturbation_fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+					glDeleteSync(_perturbation_fences[segment]);
+					_perturbation_fences[segment] = NULL;
+				}
+				int offset = segment * PERTURBATION_RING_SEGMENT_SIZE;
+				std::memcpy(_perturbation_ring + offset, &_perturbations[start], count * sizeof(Perturbation));
+
+				//The count goes in a uniform, so the list needn't be padded out to a whole number of work groups.
+				perturbation_program->SetUniform(_perturbation_uniforms.perturbationOffset, offset);
+				perturbation_program->SetUniform(_perturbation_uniforms.perturbationCount, count);
+				glDispatchCompute((count + WORK_GROUP_SIZE_PERTURBATIONS - 1) / WORK_GROUP_SIZE_PERTURBATIONS, 1, 1);
+				_perturbation_fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			}
 			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
 			_perturbations.clear();
 		}
 		
 
+		//Compact the active tiles into the list, counting them into the indirect dispatch.
+		if (sparse_tiles) {
+			GpuProfileZone compactZone("WaterSimulator tile compaction");
+			GLuint command[4] = { 0, 1, (GLuint)(fuse_levels ? levels : 1), 0 };		//The groups along x, y and z, then the tile count.
+			glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, _buf_tile_dispatch);
+			glBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, 0, sizeof(command), command);
+
+			if (!tile_compact_program->Bind()) return false;
+			tile_compact_program->SetUniform(_tile_compact_uniform_dispatchRow, GetDispatchGroupLimit(0, dispatch_group_limit));
+			int tileCount = _tiles_x * _tiles_y;
+			glDispatchCompute((tileCount + WORK_GROUP_SIZE_TILE_COMPACT - 1) / WORK_GROUP_SIZE_TILE_COMPACT, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+		}
+
 		//Run the wave simulation shader.	
 		GLuint inputs, outputs;
 		if (_in_A_out_B) { inputs = _ssbo_fragments_A;	outputs = _ssbo_fragments_B; }
 		else { inputs = _ssbo_fragments_B; outputs = _ssbo_fragments_A; }
 		{
-			if (!wave_program.Bind()) return false;
-			wave_program.SetUniform("in_A_out_B", _in_A_out_B);
-			wave_program.SetUniform("width", width);
-			wave_program.SetUniform("height", height);
-			wave_program.SetUniform("levels", levels);
-			wave_program.SetUniform("gravity", gravity);
-			wave_program.SetUniform("surfaceTension", surfaceTension);
-			wave_program.SetUniform("density", density);
-			wave_program.SetUniform("depth", depth);
-			wave_program.SetUniform("scale", scale);
-			wave_program.SetUniform("ampTimeEbb", amplitude_time_ebb);
-			wave_program.SetUniform("ampDistanceEbb", amplitude_distance_ebb);
-			wave_program.SetUniform("solitonSpeed", soliton_speed);
-			wave_program.SetUniform("timeNow", currentTime);
-			wave_program.SetUniform("timeElapsed", elapsedTime);
-
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, inputs);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, outputs);
-
-			for (int zLevel = 0; zLevel < levels; zLevel++) {
-				wave_program.SetUniform("zLevel", zLevel);
-				if (zLevel < 4) {
-					glActiveTexture(GL_TEXTURE2 + zLevel);
-					glBindTexture(GL_TEXTURE_2D, devTextures[zLevel]);
-					glBindImageTexture(4, devTextures[zLevel], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+			wo::ComputeShaderProgram* program = GetWaveProgram();
+			const StepUniforms& uniforms = (program == wave_program) ? _wave_uniforms : (program == wave_program_tuned) ? _wave_tuned_uniforms : _wave_tiled_uniforms;
+			int groupX = (program == wave_program_tuned) ? _wave_group_x : WORK_GROUP_SIZE_X;
+			int groupY = (program == wave_program_tuned) ? _wave_group_y : WORK_GROUP_SIZE_Y;
+			int groupsX = (width + groupX - 1) / groupX;
+			int groupsY = (height + groupY - 1) / groupY;
+			if (!program->Bind()) return false;
+			program->SetUniform(uniforms.in_A_out_B, _in_A_out_B);
+			program->SetUniform(uniforms.timeNow, currentTime);
+			program->SetUniform(uniforms.timeElapsed, elapsedTime);
+			program->SetUniform(uniforms.timeBase, _time_base);
+			program->SetUniform(uniforms.originShift, (float)_origin_shift_x, (float)_origin_shift_y);
+
+			glActiveTexture(GL_TEXTURE0 + REFLECTION_MAP_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, _tex_reflection_map);
+
+			//The packed encoding has its own binding points, since the shaders declare its buffers with a different element type.
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 7 : 0, inputs);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 8 : 1, outputs);
+
+			if (fuse_levels) {
+				//All levels at once, then sum the layers into the normal map.
+				PrepareLevelMaps();
+				glBindImageTexture(5, _tex_level_maps, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+				{
+					GpuProfileZone wavesZone("WaterSimulator waves (fused levels)");
+					if (sparse_tiles) glDispatchComputeIndirect(0);
+					else DispatchGroups(program, uniforms.groupOffset, groupsX, groupsY, levels, dispatch_group_limit);
+					glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 				}
+
+				if (!reduce_program->Bind()) return false;
+				GpuProfileZone reduceZone("WaterSimulator reduce");
+				glBindImageTexture(5, _tex_level_maps, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
+				DispatchGroups(reduce_program, _reduce_uniform_groupOffset, (width + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X, (height + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y, 1, dispatch_group_limit);
+				glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+			}
+			else {
+				for (int zLevel = 0; zLevel < levels; zLevel++) {
+					program->SetUniform(uniforms.zLevel, zLevel);
+					if (zLevel < 4) {
+						glActiveTexture(GL_TEXTURE2 + zLevel);
+						glBindTexture(GL_TEXTURE_2D, devTextures[zLevel]);
+						glBindImageTexture(4, devTextures[zLevel], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+					}
 				
-				glDispatchCompute(width / WORK_GROUP_SIZE_X, height / WORK_GROUP_SIZE_Y, 1);
-				glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);			
+					GpuProfileZone wavesZone("WaterSimulator waves level", zLevel);
+					if (sparse_tiles) glDispatchComputeIndirect(0);
+					else DispatchGroups(program, uniforms.groupOffset, groupsX, groupsY, 1, dispatch_group_limit);
+					glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);			
+				}
 			}
 		}
 		
@@ -352,9 +958,14 @@ public:
 		
 		
 
+		if (compute_stats) ReduceStats(outputs);
+
 		CHECK_GL_ERROR("Here");
 
 		_in_A_out_B = !_in_A_out_B;		
+		_time_base = currentTime;
+		_origin_shift_x = 0;		//The outputs were written in the window as it is now.
+		_origin_shift_y = 0;
 		currentTime += elapsedTime;
 		runCount++;
 
@@ -363,6 +974,393 @@ public:
 	}
 
 
+private:
+
+	/*Creates the reflection map texture, with immutable storage in the selected format.*/
+	void CreateReflectionMap() {
+		glGenTextures(1, &_tex_reflection_map);
+		glActiveTexture(GL_TEXTURE0 + REFLECTION_MAP_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D, _tex_reflection_map);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, 1, _compact_obstacles ? GL_RGBA8_SNORM : GL_RGBA32F, width, height);
+	}
+
+	/*Returns the size in bytes of each fragment buffer, in whichever encoding is used.*/
+	GLsizeiptr GetFragmentBufferSize() {
+		GLsizeiptr fragmentSize = (encoding == PackedFragments) ? sizeof(PackedWaveFragment) : sizeof(WaveFragment);
+		return (GLsizeiptr)width * height * levels * fragmentSize;
+	}
+
+	/*Resets the cells [x0, x1) by [y0, y1) of the window to still water, on every level of both buffers.*/
+	void ClearCells(int x0, int y0, int x1, int y1) {
+		UploadParameters();
+		if (!clear_program->Bind()) return;
+		clear_program->SetUniform(_clear_uniforms.timeBase, _time_base);
+		clear_program->SetUniform(_clear_uniforms.clearRect, x0, y0, x1, y1);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 7 : 0, _ssbo_fragments_A);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 8 : 1, _ssbo_fragments_B);
+		DispatchGroups(clear_program, _clear_uniforms.groupOffset, (x1 - x0 + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X, (y1 - y0 + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y, levels, dispatch_group_limit);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	}
+
+	/*Returns the most work groups a dispatch may run along the given axis:  the device's limit, or the given limit if it is lower and 
+	above 0.*/
+	static int GetDispatchGroupLimit(int axis, int groupLimit) {
+		static GLint deviceLimits[3] = { 0, 0, 0 };
+		if (deviceLimits[axis] == 0) glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, axis, &deviceLimits[axis]);
+		return (groupLimit > 0) ? std::min(groupLimit, (int)deviceLimits[axis]) : (int)deviceLimits[axis];
+	}
+
+	/*Runs groupsX by groupsY by groupsZ work groups of the given program, which must be bound, in as many dispatches as the group limit 
+	(see GetDispatchGroupLimit()) calls for.  Each dispatch sets the given uniform to the first group it covers, which the shader adds to 
+	gl_WorkGroupID.xy.*/
+	static void DispatchGroups(wo::ComputeShaderProgram* program, GLint groupOffsetUniform, int groupsX, int groupsY, int groupsZ, int groupLimit) {
+		int limitX = GetDispatchGroupLimit(0, groupLimit), limitY = GetDispatchGroupLimit(1, groupLimit);
+		for (int y = 0; y < groupsY; y += limitY) {
+			for (int x = 0; x < groupsX; x += limitX) {
+				program->SetUniform(groupOffsetUniform, x, y);
+				glDispatchCompute(std::min(groupsX - x, limitX), std::min(groupsY - y, limitY), groupsZ);
+			}
+		}
+	}
+
+	/*Returns the files injected into every simulation shader as it is compiled:  the SimulationParameters block, the wave fragment and 
+	the physics the shaders share, and the packed fragment codec, each kept in one file so that the shaders cannot drift apart.*/
+	static std::vector<std::string> GetShaderIncludes() {
+		return { WATER_SIM_PARAMETERS_SHADER_FILENAME, WATER_SIM_PHYSICS_SHADER_FILENAME, WATER_SIM_PACKED_FRAGMENTS_SHADER_FILENAME };
+	}
+
+	/*Returns the files injected into the wave shaders:  those of GetShaderIncludes(), then the fragment buffers a step reads and writes.*/
+	static std::vector<std::string> GetWaveShaderIncludes() {
+		std::vector<std::string> includes = GetShaderIncludes();
+		includes.push_back(WATER_SIM_WAVE_FRAGMENTS_SHADER_FILENAME);
+		return includes;
+	}
+
+	/*Returns the #defines which give a shader the given work group size.*/
+	static std::vector<std::string> GetLocalSizeDefines(int x, int y = 1) {
+		return { "LOCAL_SIZE_X " + std::to_string(x), "LOCAL_SIZE_Y " + std::to_string(y) };
+	}
+
+	/*Returns the #defines for a variant of the wave shader with the given work group size.  The encoding is fixed for the life of the 
+	simulator, and it is never batched, so both are compiled in; so are sparse tiles, for a variant only run densely.  Level fusion can 
+	change from step to step, and stays in the parameter block.*/
+	std::vector<std::string> GetWaveDefines(int x, int y, bool denseOnly) {
+		std::vector<std::string> defines = GetLocalSizeDefines(x, y);
+		defines.push_back(std::string("PACKED_FRAGMENTS ") + ((encoding == PackedFragments) ? "1" : "0"));
+		defines.push_back("BATCHED 0");
+		if (denseOnly) defines.push_back("SPARSE_TILES 0");
+		return defines;
+	}
+
+	/*Returns the key under which the work group size is cached:  the device and driver, the grid, and the encoding.*/
+	std::string GetWorkGroupCacheKey() {
+		const GLubyte* vendor = glGetString(GL_VENDOR);
+		const GLubyte* renderer = glGetString(GL_RENDERER);
+		const GLubyte* version = glGetString(GL_VERSION);
+		std::ostringstream key;
+		key << (vendor ? (const char*)vendor : "?") << " | " << (renderer ? (const char*)renderer : "?") << " | " << (version ? (const char*)version : "?");
+		key << " | " << width << "x" << height << "x" << levels << " | " << ((encoding == PackedFragments) ? "packed" : "full");
+		return key.str();
+	}
+
+	/*Looks up the given key in the work group cache, whose lines each hold a key, a tab, and the size as x and y.  Returns false if the 
+	file or the key is missing.*/
+	static bool ReadWorkGroupCache(const char* filename, const std::string& key, int& x, int& y) {
+		std::ifstream file(filename);
+		std::string line;
+		while (std::getline(file, line)) {
+			if (line.size() <= key.size() || line.compare(0, key.size(), key) != 0 || line[key.size()] != '\t') continue;
+			std::istringstream size(line.substr(key.size() + 1));
+			if (size >> x >> y) return true;
+		}
+		return false;
+	}
+
+	/*Stores the given size under the given key in the work group cache, replacing any size it held already.*/
+	static void WriteWorkGroupCache(const char* filename, const std::string& key, int x, int y) {
+		std::vector<std::string> lines;
+		{
+			std::ifstream file(filename);
+			std::string line;
+			while (std::getline(file, line)) {
+				if (line.empty() || line.compare(0, key.size() + 1, key + "\t") == 0) continue;
+				lines.push_back(line);
+			}
+		}
+		lines.push_back(key + "\t" + std::to_string(x) + " " + std::to_string(y));
+		std::ofstream file(filename, std::ios::trunc);
+		for (const std::string& line : lines) file << line << std::endl;
+	}
+
+	/*Returns the program for the selected wave kernel, compiling it if necessary.  Sparse tiles are simulated a work group apiece, so they 
+	always run the default size.*/
+	wo::ComputeShaderProgram* GetWaveProgram() {
+		if (wave_kernel != Tiled) return (wave_program_tuned != nullptr && !sparse_tiles) ? wave_program_tuned : wave_program;
+		if (wave_program_tiled == nullptr) {
+			wave_program_tiled = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_TILED_COMPUTE_SHADER_FILENAME, std::vector<std::string>(), GetWaveShaderIncludes()));
+			_wave_tiled_uniforms.Resolve(wave_program_tiled);
+		}
+		return wave_program_tiled;
+	}
+
+	/*Drops every perturbation which is overwritten by a later perturbation of the same cell and level.  The perturbation shader writes 
+	its list in parallel, so without this the survivor of a duplicate would be arbitrary; the CPU backend applies perturbations in order, 
+	so the last one wins there, and now here too.*/
+	void CoalescePerturbations() {
+		std::unordered_map<int, int> slots;
+		slots.reserve(_perturbations.size());
+		int kept = 0;
+		for (int i = 0; i < (int)_perturbations.size(); i++) {
+			const Perturbation& p = _perturbations[i];
+			int idx = GetIndex((int)p.location.x, (int)p.location.y, p.level);
+			auto iter = slots.find(idx);
+			if (iter != slots.end()) _perturbations[iter->second] = p;
+			else {
+				slots[idx] = kept;
+				_perturbations[kept++] = p;
+			}
+		}
+		_perturbations.erase(_perturbations.begin() + kept, _perturbations.end());
+	}
+
+	/*Uploads the SimulationParameters block, if any parameter has changed since it was last uploaded, and binds it for the shaders.*/
+	void UploadParameters() {
+		SimulationParameters params;
+		std::memset(&params, 0, sizeof(params));
+		params.width = width;
+		params.height = height;
+		params.levels = levels;
+		params.gravity = gravity;
+		params.surfaceTension = surfaceTension;
+		params.density = density;
+		params.depth = depth;
+		params.ampTimeEbb = amplitude_time_ebb;
+		params.ampDistanceEbb = amplitude_distance_ebb;
+		params.solitonSpeed = soliton_speed;
+		params.scale = scale;
+		params.tilesX = _tiles_x;
+		params.tilesY = _tiles_y;
+		params.fuseLevels = fuse_levels;
+		params.sparseTiles = sparse_tiles;
+		params.packedFragments = (encoding == PackedFragments);
+		params.instances = 1;
+		params.batched = false;
+		params.ringX = _ring_x;
+		params.ringY = _ring_y;
+
+		glBindBufferBase(GL_UNIFORM_BUFFER, SIMULATION_PARAMETERS_BINDING, _ubo_parameters);
+		if (_parameters_uploaded && std::memcmp(&params, &_uploaded_parameters, sizeof(params)) == 0) return;
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(params), &params);
+		_uploaded_parameters = params;
+		_parameters_uploaded = true;
+	}
+
+	/*Creates the level map texture array and the reduction program, the first time the levels are fused.*/
+	void PrepareLevelMaps() {
+		if (_tex_level_maps != INVALID_ID) return;
+		glGenTextures(1, &_tex_level_maps);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, _tex_level_maps);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA32F, width, height, levels);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, NULL);
+		reduce_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_REDUCE_COMPUTE_SHADER_FILENAME, GetLocalSizeDefines(WORK_GROUP_SIZE_X, WORK_GROUP_SIZE_Y), GetShaderIncludes()));
+		_reduce_uniform_groupOffset = reduce_program->GetUniformLocation("groupOffset");
+	}
+
+	/*Creates the tile buffers and the compaction program, the first time tiles are run sparse.*/
+	void PrepareTiles() {
+		if (_ssbo_tile_flags != INVALID_ID) return;
+		int tileCount = _tiles_x * _tiles_y;
+
+		glGenBuffers(1, &_ssbo_tile_flags);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_tile_flags);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, tileCount * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glGenBuffers(1, &_ssbo_tile_list);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_tile_list);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, tileCount * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glGenBuffers(1, &_buf_tile_dispatch);
+		glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, _buf_tile_dispatch);
+		glBufferData(GL_DISPATCH_INDIRECT_BUFFER, 4 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+
+		tile_compact_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_TILE_COMPACT_COMPUTE_SHADER_FILENAME, GetLocalSizeDefines(WORK_GROUP_SIZE_TILE_COMPACT), GetShaderIncludes()));
+		_tile_compact_uniform_dispatchRow = tile_compact_program->GetUniformLocation("dispatchRow");
+	}
+
+	/*Flags every tile to be run on the next step.*/
+	void MarkAllTilesActive() {
+		std::vector<GLuint> flags(_tiles_x * _tiles_y, 1);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_tile_flags);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, flags.size() * sizeof(GLuint), &flags[0]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+	}
+
+	/*Steps the host engine, after copying across the parameters which may have been changed since the last step.*/
+	bool ExecuteCPU(int elapsedTime) {
+		_cpu->gravity = gravity;
+		_cpu->surfaceTension = surfaceTension;
+		_cpu->density = density;
+		_cpu->depth = depth;
+		_cpu->amplitude_time_ebb = amplitude_time_ebb;
+		_cpu->amplitude_distance_ebb = amplitude_distance_ebb;
+		_cpu->soliton_speed = soliton_speed;
+		_cpu->scale = scale;
+		_cpu->sparse_tiles = sparse_tiles;
+		_cpu->currentTime = currentTime;
+
+		if (!_cpu->Execute(elapsedTime)) return false;
+		currentTime += elapsedTime;
+		runCount++;
+		return true;
+	}
+
+	/*Creates the statistics buffers, the readback ring and the statistics program, the first time statistics are reduced.*/
+	void PrepareStats() {
+		if (_ssbo_stats != INVALID_ID) return;
+		int groups = ((width + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X) * ((height + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y);
+
+		glGenBuffers(1, &_ssbo_stats);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_stats);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, levels * sizeof(GPULevelStats), NULL, GL_DYNAMIC_COPY);
+		glGenBuffers(1, &_ssbo_stats_partials);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_stats_partials);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)groups * levels * sizeof(GLfloat), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+
+		//Map the readback ring for good.  It is coherent, so a copy is visible to the host as soon as its fence has passed.
+		GLsizeiptr ringSize = STATS_READBACK_SLOTS * levels * sizeof(GPULevelStats);
+		GLbitfield ringFlags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &_buf_stats_readback);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, _buf_stats_readback);
+		glBufferStorage(GL_COPY_WRITE_BUFFER, ringSize, NULL, ringFlags);
+		_stats_readback = (GPULevelStats*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, ringSize, ringFlags);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, NULL);
+
+		stats_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_STATS_COMPUTE_SHADER_FILENAME, std::vector<std::string>(), GetShaderIncludes()));
+		_stats_uniform_timeNow = stats_program->GetUniformLocation("timeNow");
+		_stats_uniform_activeAmplitude = stats_program->GetUniformLocation("activeAmplitude");
+		_stats_uniform_finalizeStats = stats_program->GetUniformLocation("finalizeStats");
+		_stats_uniform_partialCount = stats_program->GetUniformLocation("partialCount");
+		_stats_uniform_groupOffset = stats_program->GetUniformLocation("groupOffset");
+	}
+
+	/*Reduces the fragments the step just wrote to their statistics, and queues a copy of them into the next slot of the readback ring.  
+	If that slot's last copy has still not been read, these statistics are skipped rather than waited for.*/
+	void ReduceStats(GLuint fragments) {
+		PrepareStats();
+		CollectStats();
+		int slot = _stats_slot;
+		if (_stats_fences[slot] != NULL) return;
+		GpuProfileZone statsZone("WaterSimulator stats");
+
+		//The counts and bounds are folded in with atomics, so start them from their identities.
+		std::vector<GPULevelStats> initial(levels);
+		for (GPULevelStats& s : initial) {
+			std::memset(&s, 0, sizeof(s));
+			s.min_x = width;
+			s.min_y = height;
+			s.max_x = -1;
+			s.max_y = -1;
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_stats);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, levels * sizeof(GPULevelStats), &initial[0]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+
+		if (!stats_program->Bind()) return;
+		int groupsX = (width + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X;
+		int groupsY = (height + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y;
+		stats_program->SetUniform(_stats_uniform_timeNow, currentTime);
+		stats_program->SetUniform(_stats_uniform_activeAmplitude, stats_active_amplitude);
+		stats_program->SetUniform(_stats_uniform_finalizeStats, false);
+		stats_program->SetUniform(_stats_uniform_partialCount, groupsX * groupsY);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 7 : 0, fragments);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, _ssbo_stats);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, _ssbo_stats_partials);
+		DispatchGroups(stats_program, _stats_uniform_groupOffset, groupsX, groupsY, levels, dispatch_group_limit);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		//Add up each level's partial energies.
+		stats_program->SetUniform(_stats_uniform_finalizeStats, true);
+		glDispatchCompute(1, 1, levels);
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+		glBindBuffer(GL_COPY_READ_BUFFER, _ssbo_stats);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, _buf_stats_readback);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, slot * levels * sizeof(GPULevelStats), levels * sizeof(GPULevelStats));
+		glBindBuffer(GL_COPY_READ_BUFFER, NULL);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, NULL);
+		_stats_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		_stats_run_counts[slot] = runCount + 1;
+		_stats_times[slot] = currentTime;
+		_stats_slot = (slot + 1) % STATS_READBACK_SLOTS;
+	}
+
+	/*Creates the query buffers and the query program, the first time a batch of queries is made on the GPU.  Both buffers are mapped for 
+	good:  the points for writing, and the samples for reading.*/
+	void PrepareQueries() {
+		if (_ssbo_query_points != INVALID_ID) return;
+		GLsizeiptr pointsSize = QUERY_RING_SLOTS * QUERY_BATCH_CAPACITY * sizeof(cy::Point2f);
+		GLbitfield pointsFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &_ssbo_query_points);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_query_points);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, pointsSize, NULL, pointsFlags);
+		_query_points = (cy::Point2f*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, pointsSize, pointsFlags);
+
+		GLsizeiptr samplesSize = QUERY_RING_SLOTS * QUERY_BATCH_CAPACITY * sizeof(WaterSample);
+		GLbitfield samplesFlags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &_ssbo_query_samples);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_query_samples);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, samplesSize, NULL, samplesFlags);
+		_query_samples = (WaterSample*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, samplesSize, samplesFlags);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+
+		query_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_QUERY_COMPUTE_SHADER_FILENAME, GetLocalSizeDefines(WORK_GROUP_SIZE_QUERY), GetShaderIncludes()));
+		_query_uniform_queryOffset = query_program->GetUniformLocation("queryOffset");
+		_query_uniform_queryCount = query_program->GetUniformLocation("queryCount");
+	}
+
+	/*Returns true, and deletes the fence, if the given fence is not set or has passed.  Never waits.*/
+	static bool PollFence(GLsync& fence) {
+		if (fence == NULL) return true;
+		GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return false;
+		glDeleteSync(fence);
+		fence = NULL;
+		return true;
+	}
+
+	/*Reads every slot of the readback ring whose fence has passed, oldest first, so that the newest statistics are kept.  Never waits.*/
+	void CollectStats() {
+		for (int i = 0; i < STATS_READBACK_SLOTS; i++) {
+			int slot = (_stats_slot + i) % STATS_READBACK_SLOTS;
+			if (_stats_fences[slot] == NULL || !PollFence(_stats_fences[slot])) continue;
+
+			_stats.run_count = _stats_run_counts[slot];
+			_stats.time = _stats_times[slot];
+			_stats.levels.resize(levels);
+			for (int z = 0; z < levels; z++) {
+				const GPULevelStats& s = _stats_readback[(slot * levels) + z];
+				LevelStats& level = _stats.levels[z];
+				level.total_energy = s.energy;
+				std::memcpy(&level.max_amplitude, &s.max_amplitude_bits, sizeof(float));
+				level.active_cells = (int)s.active_cells;
+				bool empty = (s.active_cells == 0);
+				level.min_x = empty ? 0 : s.min_x;
+				level.min_y = empty ? 0 : s.min_y;
+				level.max_x = empty ? -1 : s.max_x;
+				level.max_y = empty ? -1 : s.max_y;
+			}
+		}
+	}
+
+
+public:
+
 	GLuint devTextures[4];
 	void CreateDevelopmentTexture(int i) {
 		glGenTextures(1, &devTextures[i]);
@@ -0,0 +1,386 @@
+
+#ifndef _WATER_SIMULATOR_BATCH_H	//Not all compilers allow "#pragma once"
+#define _WATER_SIMULATOR_BATCH_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "WaterSimulator.h"
+
+#define INSTANCE_PARAMETERS_BINDING			13
+#define BATCH_NORMAL_MAPS_IMAGE_UNIT		6
+#define BATCH_REFLECTION_MAPS_TEXTURE_UNIT	7
+
+
+/*Many equally sized simulations, stepped together.  Every instance's fragments live one after another in a single pair of buffers (each
+instance levels deep, as if the batch were one simulation of instances * levels levels), every instance's normal map and reflection map
+is a layer of a texture array, and every instance's physical parameters are a row of a table in a storage buffer.  A step then costs one
+perturbation dispatch and one wave dispatch per level, with the instances along the work groups' z, however many instances there are;
+a separate WaterSimulator per pond would bind, set uniforms and dispatch for each of them in turn.
+
+The batch uses the same clear, perturbation and wave shaders as WaterSimulator, with the batched flag set in SimulationParameters.  It
+runs on the GPU only, with the standard wave kernel, levels one dispatch at a time, and every tile, and all instances share a clock.*/
+class WaterSimulatorBatch {
+
+public:
+
+	/*The physical parameters of one instance, laid out as the std430 InstanceParameters of the simulation shaders.*/
+	struct InstanceParameters {
+		GLfloat gravity = 9.8f;
+		GLfloat surfaceTension = 1.0f;
+		GLfloat density = 1.0f;
+		GLfloat depth = 10.0f;
+		GLfloat amplitude_time_ebb = 0.5f;
+		GLfloat amplitude_distance_ebb = 0.3f;
+		GLfloat soliton_speed = 0.75f;
+		GLfloat unused = 0.0f;
+	};
+
+	const FragmentEncoding encoding;
+	const int width;
+	const int height;
+	const int levels;
+	const int instances;
+	float scale = 1.0f;
+
+	/*The time since the start of the simulation, in  milliseconds, and the number of steps run, shared by every instance.*/
+	int currentTime = 0;
+	int runCount = 0;
+
+private:
+
+	wo::ComputeShaderProgram* clear_program = nullptr;
+	wo::ComputeShaderProgram* perturbation_program = nullptr;
+	wo::ComputeShaderProgram* wave_program = nullptr;
+
+	GLint _clear_uniform_timeBase = -1;
+	GLint _clear_uniform_firstLevel = -1;
+	GLint _clear_uniform_clearRect = -1;
+	GLint _clear_uniform_groupOffset = -1;
+	GLint _perturbation_uniform_timeBase = -1;
+	GLint _perturbation_uniform_perturbationOffset = -1;
+	GLint _perturbation_uniform_perturbationCount = -1;
+	GLint _wave_uniform_in_A_out_B = -1;
+	GLint _wave_uniform_timeNow = -1;
+	GLint _wave_uniform_timeElapsed = -1;
+	GLint _wave_uniform_timeBase = -1;
+	GLint _wave_uniform_zLevel = -1;
+	GLint _wave_uniform_groupOffset = -1;
+
+	/*The parameter block, and the instance parameter table with the rows last uploaded to it.*/
+	GLuint _ubo_parameters = INVALID_ID;
+	SimulationParameters _uploaded_block;
+	bool _block_uploaded = false;
+	GLuint _ssbo_instance_parameters = INVALID_ID;
+	std::vector<InstanceParameters> _parameters;
+	std::vector<InstanceParameters> _uploaded_parameters;
+
+	GLuint _ssbo_fragments_A = INVALID_ID;
+	GLuint _ssbo_fragments_B = INVALID_ID;
+	bool _in_A_out_B = true;
+
+	/*The time of the last wave step, from which the ages of packed input fragments are measured.*/
+	int _time_base = 0;
+
+	/*The perturbations waiting for the next step, and the buffer they are uploaded to, which grows as needed.*/
+	std::vector<Perturbation> _perturbations;
+	GLuint _ssbo_perturbations = INVALID_ID;
+	GLsizeiptr _perturbations_capacity = 0;
+
+	GLuint _tex_normal_maps = INVALID_ID;
+	GLuint _tex_reflection_maps = INVALID_ID;
+	std::vector<ObstacleMap> _obstacles;
+
+
+public:
+
+	/*Creates a batch of the given number of simulations, each of the given size, with default parameters and open water.*/
+	WaterSimulatorBatch(int width, int height, int levels, int instances, float scale = 10.0f, FragmentEncoding encoding = FullFragments)
+		: encoding(encoding), width(width), height(height), levels(levels), instances(instances), scale(scale), _parameters(instances) {
+
+		//Every switch of the wave shader is fixed for a batch, so its variant has them all compiled in.
+		std::vector<std::string> waveDefines = WaterSimulator::GetLocalSizeDefines(WORK_GROUP_SIZE_X, WORK_GROUP_SIZE_Y);
+		waveDefines.push_back(std::string("PACKED_FRAGMENTS ") + ((encoding == PackedFragments) ? "1" : "0"));
+		waveDefines.push_back("BATCHED 1");
+		waveDefines.push_back("SPARSE_TILES 0");
+		waveDefines.push_back("FUSE_LEVELS 0");
+		clear_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_CLEAR_COMPUTE_SHADER_FILENAME, WaterSimulator::GetLocalSizeDefines(WORK_GROUP_SIZE_X, WORK_GROUP_SIZE_Y), WaterSimulator::GetShaderIncludes()));
+		perturbation_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_PERTURBATION_COMPUTE_SHADER_FILENAME, WaterSimulator::GetLocalSizeDefines(WORK_GROUP_SIZE_PERTURBATIONS), WaterSimulator::GetShaderIncludes()));
+		wave_program = new wo::ComputeShaderProgram(wo::Shader(GL_COMPUTE_SHADER, WATER_SIM_COMPUTE_SHADER_FILENAME, waveDefines, WaterSimulator::GetWaveShaderIncludes()));
+		_clear_uniform_timeBase = clear_program->GetUniformLocation("timeBase");
+		_clear_uniform_firstLevel = clear_program->GetUniformLocation("firstLevel");
+		_clear_uniform_clearRect = clear_program->GetUniformLocation("clearRect");
+		_clear_uniform_groupOffset = clear_program->GetUniformLocation("groupOffset");
+		_perturbation_uniform_timeBase = perturbation_program->GetUniformLocation("timeBase");
+		_perturbation_uniform_perturbationOffset = perturbation_program->GetUniformLocation("perturbationOffset");
+		_perturbation_uniform_perturbationCount = perturbation_program->GetUniformLocation("perturbationCount");
+		_wave_uniform_in_A_out_B = wave_program->GetUniformLocation("in_A_out_B");
+		_wave_uniform_timeNow = wave_program->GetUniformLocation("timeNow");
+		_wave_uniform_timeElapsed = wave_program->GetUniformLocation("timeElapsed");
+		_wave_uniform_timeBase = wave_program->GetUniformLocation("timeBase");
+		_wave_uniform_zLevel = wave_program->GetUniformLocation("zLevel");
+		_wave_uniform_groupOffset = wave_program->GetUniformLocation("groupOffset");
+
+		//The parameter block and the instance table are filled on the first step.
+		glGenBuffers(1, &_ubo_parameters);
+		glBindBuffer(GL_UNIFORM_BUFFER, _ubo_parameters);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(SimulationParameters), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, NULL);
+		glGenBuffers(1, &_ssbo_instance_parameters);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_instance_parameters);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, instances * sizeof(InstanceParameters), NULL, GL_DYNAMIC_DRAW);
+
+		glGenBuffers(1, &_ssbo_fragments_A);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_fragments_A);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, GetFragmentBufferSize(), NULL, GL_DYNAMIC_COPY);
+		glGenBuffers(1, &_ssbo_fragments_B);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_fragments_B);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, GetFragmentBufferSize(), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+		Clear();
+
+		//One layer of each map per instance.
+		glGenTextures(1, &_tex_normal_maps);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, _tex_normal_maps);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA32F, width, height, instances);
+		glGenTextures(1, &_tex_reflection_maps);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, _tex_reflection_maps);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA32F, width, height, instances);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, NULL);
+
+		_obstacles.reserve(instances);
+		for (int i = 0; i < instances; i++) _obstacles.emplace_back(width, height);
+		UploadObstacles();
+
+		CHECK_GL_ERROR("WaterSimulatorBatch::ctor");
+	}
+	~WaterSimulatorBatch() {
+		delete clear_program;
+		delete perturbation_program;
+		delete wave_program;
+		if (_ubo_parameters != INVALID_ID) glDeleteBuffers(1, &_ubo_parameters);
+		if (_ssbo_instance_parameters != INVALID_ID) glDeleteBuffers(1, &_ssbo_instance_parameters);
+		if (_ssbo_fragments_A != INVALID_ID) glDeleteBuffers(1, &_ssbo_fragments_A);
+		if (_ssbo_fragments_B != INVALID_ID) glDeleteBuffers(1, &_ssbo_fragments_B);
+		if (_ssbo_perturbations != INVALID_ID) glDeleteBuffers(1, &_ssbo_perturbations);
+		if (_tex_normal_maps != INVALID_ID) glDeleteTextures(1, &_tex_normal_maps);
+		if (_tex_reflection_maps != INVALID_ID) glDeleteTextures(1, &_tex_reflection_maps);
+	}
+
+
+	/*Returns the physical parameters of the given instance, for editing.  Edits are uploaded at the start of the next step.*/
+	InstanceParameters& GetParameters(int instance) { return _parameters[instance]; }
+
+	/*Returns the obstacles of the given instance, for editing.  Edits are uploaded at the start of the next step.*/
+	ObstacleMap& GetObstacleMap(int instance) { return _obstacles[instance]; }
+
+	void SetObstacles(int instance, bool border, bool square, bool bar) {
+		_obstacles[instance].Set(WaterSimulatorCPU::BuildObstacles(width, height, border, square, bar));
+	}
+
+	/*Returns the texture array holding every instance's normal map, one layer per instance, laid out as WaterSimulator's normal map.*/
+	GLuint GetNormalMapsID() { return _tex_normal_maps; }
+	GLuint GetReflectionMapsID() { return _tex_reflection_maps; }
+
+
+	bool Perturb(int instance, cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
+		if (instance < 0 || instance >= instances) return false;
+		//The location is in cells, and indexes the instance's fragments directly.
+		if (location.x < 0 || location.x >= width) return false;
+		if (location.y < 0 || location.y >= height) return false;
+		if (level < 0 || level >= levels) return false;
+		if (waveNumber <= 0.0f) return false;
+		if (amplitude <= 0.0f) return false;
+
+		Perturbation p = Perturbation(cy::Point2f(location.x, location.y), level, origin, waveNumber, amplitude, timeStamp, phase_offset, 0, 0);
+		p.instance = instance;
+		_perturbations.push_back(p);
+		return true;
+	}
+
+	bool PerturbPoint(int instance, cy::Point2f location, int level, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
+		cy::Point2f origin = scale * cy::Point2f(location.x, location.y);
+		return Perturb(instance, location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+	}
+
+
+	/*Resets every instance to still water.*/
+	void Clear() {
+		ClearLevels(0, levels * instances);
+	}
+
+	/*Resets the given instance to still water, leaving the others be.  Its normal map keeps its last contents until the next step.*/
+	void ClearInstance(int instance) {
+		if (instance < 0 || instance >= instances) return;
+		ClearLevels(instance * levels, levels);
+	}
+
+
+	bool Execute(int elapsedTime) {
+		CPU_PROFILE_ZONE("WaterSimulatorBatch::Execute");
+		GpuProfileZone executeZone("WaterSimulatorBatch::Execute");
+		UploadObstacles();
+		UploadParameters();
+
+		//Apply every instance's perturbations in one dispatch.
+		if (_perturbations.size() > 0) {
+			GpuProfileZone perturbZone("WaterSimulatorBatch perturb");
+			CoalescePerturbations();
+			UploadPerturbations();
+			if (!perturbation_program->Bind()) return false;
+			perturbation_program->SetUniform(_perturbation_uniform_timeBase, _time_base);
+			perturbation_program->SetUniform(_perturbation_uniform_perturbationOffset, 0);
+			perturbation_program->SetUniform(_perturbation_uniform_perturbationCount, (int)_perturbations.size());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 8 : 1, _in_A_out_B ? _ssbo_fragments_A : _ssbo_fragments_B);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _ssbo_perturbations);
+			glDispatchCompute(((int)_perturbations.size() + WORK_GROUP_SIZE_PERTURBATIONS - 1) / WORK_GROUP_SIZE_PERTURBATIONS, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			_perturbations.clear();
+		}
+
+		//Run the wave shader, a level at a time, every instance at once.
+		GLuint inputs = _in_A_out_B ? _ssbo_fragments_A : _ssbo_fragments_B;
+		GLuint outputs = _in_A_out_B ? _ssbo_fragments_B : _ssbo_fragments_A;
+		if (!wave_program->Bind()) return false;
+		wave_program->SetUniform(_wave_uniform_in_A_out_B, _in_A_out_B);
+		wave_program->SetUniform(_wave_uniform_timeNow, currentTime);
+		wave_program->SetUniform(_wave_uniform_timeElapsed, elapsedTime);
+		wave_program->SetUniform(_wave_uniform_timeBase, _time_base);
+		glActiveTexture(GL_TEXTURE0 + BATCH_REFLECTION_MAPS_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, _tex_reflection_maps);
+		glBindImageTexture(BATCH_NORMAL_MAPS_IMAGE_UNIT, _tex_normal_maps, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA32F);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 7 : 0, inputs);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 8 : 1, outputs);
+		for (int zLevel = 0; zLevel < levels; zLevel++) {
+			GpuProfileZone wavesZone("WaterSimulatorBatch waves level", zLevel);
+			wave_program->SetUniform(_wave_uniform_zLevel, zLevel);
+			WaterSimulator::DispatchGroups(wave_program, _wave_uniform_groupOffset, (width + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X, (height + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y, instances, 0);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		}
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+		CHECK_GL_ERROR("WaterSimulatorBatch::Execute");
+
+		_in_A_out_B = !_in_A_out_B;
+		_time_base = currentTime;
+		currentTime += elapsedTime;
+		runCount++;
+		return true;
+	}
+
+
+private:
+
+	/*Returns the size in bytes of each fragment buffer, in whichever encoding is used.*/
+	GLsizeiptr GetFragmentBufferSize() {
+		GLsizeiptr fragmentSize = (encoding == PackedFragments) ? sizeof(PackedWaveFragment) : sizeof(WaveFragment);
+		return (GLsizeiptr)width * height * levels * instances * fragmentSize;
+	}
+
+	/*Resets the given run of levels, counting on through every instance, to still water in both buffers.*/
+	void ClearLevels(int firstLevel, int count) {
+		_time_base = currentTime;
+		UploadParameters();
+		if (!clear_program->Bind()) return;
+		clear_program->SetUniform(_clear_uniform_timeBase, _time_base);
+		clear_program->SetUniform(_clear_uniform_firstLevel, firstLevel);
+		clear_program->SetUniform(_clear_uniform_clearRect, 0, 0, width, height);		//The batch never scrolls, so its ring stays at 0.
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 7 : 0, _ssbo_fragments_A);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (encoding == PackedFragments) ? 8 : 1, _ssbo_fragments_B);
+		WaterSimulator::DispatchGroups(clear_program, _clear_uniform_groupOffset, (width + WORK_GROUP_SIZE_X - 1) / WORK_GROUP_SIZE_X, (height + WORK_GROUP_SIZE_Y - 1) / WORK_GROUP_SIZE_Y, count, 0);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	}
+
+	/*Uploads the SimulationParameters block, and whichever rows of the instance table have changed since they were last uploaded, and
+	binds both for the shaders.*/
+	void UploadParameters() {
+		SimulationParameters params;
+		std::memset(&params, 0, sizeof(params));
+		params.width = width;
+		params.height = height;
+		params.levels = levels;
+		params.scale = scale;
+		params.packedFragments = (encoding == PackedFragments);
+		params.instances = instances;
+		params.batched = true;
+		glBindBufferBase(GL_UNIFORM_BUFFER, SIMULATION_PARAMETERS_BINDING, _ubo_parameters);
+		if (!_block_uploaded || std::memcmp(&params, &_uploaded_block, sizeof(params)) != 0) {
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(params), &params);
+			_uploaded_block = params;
+			_block_uploaded = true;
+		}
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_PARAMETERS_BINDING, _ssbo_instance_parameters);
+		if (_uploaded_parameters.size() != _parameters.size()) {
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instances * sizeof(InstanceParameters), &_parameters[0]);
+			_uploaded_parameters = _parameters;
+			return;
+		}
+		for (int i = 0; i < instances; i++) {
+			if (std::memcmp(&_parameters[i], &_uploaded_parameters[i], sizeof(InstanceParameters)) == 0) continue;
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * sizeof(InstanceParameters), sizeof(InstanceParameters), &_parameters[i]);
+			_uploaded_parameters[i] = _parameters[i];
+		}
+	}
+
+	/*Sends the changed rectangle of each instance's obstacle map to its layer of the reflection maps.*/
+	void UploadObstacles() {
+		glActiveTexture(GL_TEXTURE0 + BATCH_REFLECTION_MAPS_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, _tex_reflection_maps);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+		for (int i = 0; i < instances; i++) {
+			ObstacleMap& obstacles = _obstacles[i];
+			if (!obstacles.IsDirty()) continue;
+			int x0, y0, x1, y1;
+			obstacles.GetDirtyRect(x0, y0, x1, y1);
+			obstacles.ClearDirty();
+			const std::vector<cy::Point4f>& texels = obstacles.GetTexels();
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x0, y0, i, x1 - x0, y1 - y0, 1, GL_RGBA, GL_FLOAT, &texels[x0 + (y0 * width)]);
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+
+	/*Drops every perturbation which is overwritten by a later perturbation of the same cell, level and instance, as
+	WaterSimulator::CoalescePerturbations() does.*/
+	void CoalescePerturbations() {
+		std::unordered_map<long long, int> slots;
+		slots.reserve(_perturbations.size());
+		int kept = 0;
+		for (int i = 0; i < (int)_perturbations.size(); i++) {
+			const Perturbation& p = _perturbations[i];
+			long long idx = (long long)(((p.instance * levels) + p.level) * height + (int)p.location.y) * width + (int)p.location.x;
+			auto iter = slots.find(idx);
+			if (iter != slots.end()) _perturbations[iter->second] = p;
+			else {
+				slots[idx] = kept;
+				_perturbations[kept++] = p;
+			}
+		}
+		_perturbations.erase(_perturbations.begin() + kept, _perturbations.end());
+	}
+
+	/*Copies the perturbations into their buffer, growing it first if they don't fit.*/
+	void UploadPerturbations() {
+		GLsizeiptr size = _perturbations.size() * sizeof(Perturbation);
+		if (_ssbo_perturbations == INVALID_ID) glGenBuffers(1, &_ssbo_perturbations);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo_perturbations);
+		if (size > _perturbations_capacity) {
+			_perturbations_capacity = std::max(size, 2 * _perturbations_capacity);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, _perturbations_capacity, NULL, GL_DYNAMIC_DRAW);
+		}
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, &_perturbations[0]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, NULL);
+	}
+
+};
+
+
+#endif
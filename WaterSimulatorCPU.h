@@ -0,0 +1,1552 @@
+#ifndef _WATER_SIMULATOR_CPU_H	//Not all compilers allow "#pragma once"
+#define _WATER_SIMULATOR_CPU_H
+
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <cstring>
+#include "cyPoint.h"
+#include "ThreadPool.h"
+#include "WaveFragment.h"
+#include "PerturbationLog.h"
+#include "CpuProfiler.h"
+#include "SimulationStats.h"
+#include "MappedMemory.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define ACTIVE_TILE_SIZE	16
+#define PAGE_POOL_MIN_PAGES	64
+#define EBB_TABLE_SIZE		1024
+#define TANH_TABLE_SIZE		4096
+#define TANH_TABLE_SPAN		9.0f		//tanh() rounds to 1 in a float past here.
+
+
+/*Members describe how the host engine keeps its fragments.*/
+enum FragmentStorage {
+	/*Every cell of every level has its fragments, allocated up front.*/
+	DenseStorage,
+	/*The grid is split into ACTIVE_TILE_SIZE square tiles, and only tiles with moving water have fragments of their own, in pages lent 
+	from a pool when a perturbation or a wave reaches them and handed back once they have gone quiet.  Every other tile reads as still 
+	water.  Paged storage always steps sparse.*/
+	PagedStorage,
+	/*Every cell has its fragments, but the fragment buffers, the snapshot and the normal and reflection maps are kept in files mapped 
+	into memory (see MappedArena), so the grid need not fit in RAM.  Each level's rows are interleaved, so that a band of rows is one run 
+	of each file, and ExecuteSteps() streams the bands through memory in a wavefront.  Mapped storage always steps dense.*/
+	MappedStorage
+};
+
+
+/*Structure-of-arrays storage for WaveFragments:  one plane per field, each holding width*height*levels entries.  The neighbor scan only
+needs energy, origin, celerity, time_start and traversal, so keeping those in their own planes means a step no longer drags whole 48-byte
+records through the cache just to compare energies.  The planes are on the heap, unless they are given an arena to be mapped in.*/
+struct WaveFragmentPlanes {
+	MappedVector<float> origin_x;
+	MappedVector<float> origin_y;
+	MappedVector<float> wave_number;
+	MappedVector<float> amplitude;
+	MappedVector<int> time_start;
+	MappedVector<float> phase_offset;
+	MappedVector<float> energy;
+	MappedVector<float> celerity;
+	MappedVector<float> reflection_x;
+	MappedVector<float> reflection_y;
+	MappedVector<float> traversal;
+
+	WaveFragmentPlanes(MappedArena* arena = nullptr)
+		: origin_x(MappedAllocator<float>(arena)), origin_y(MappedAllocator<float>(arena)), wave_number(MappedAllocator<float>(arena)), 
+		amplitude(MappedAllocator<float>(arena)), time_start(MappedAllocator<int>(arena)), phase_offset(MappedAllocator<float>(arena)), 
+		energy(MappedAllocator<float>(arena)), celerity(MappedAllocator<float>(arena)), reflection_x(MappedAllocator<float>(arena)), 
+		reflection_y(MappedAllocator<float>(arena)), traversal(MappedAllocator<float>(arena)) {}
+
+	void Resize(int count) {
+		origin_x.resize(count);
+		origin_y.resize(count);
+		wave_number.resize(count);
+		amplitude.resize(count);
+		time_start.resize(count);
+		phase_offset.resize(count);
+		energy.resize(count);
+		celerity.resize(count);
+		reflection_x.resize(count);
+		reflection_y.resize(count);
+		traversal.resize(count);
+	}
+
+	int Size() const { return (int)energy.size(); }
+
+	/*Releases any memory held beyond the current size.*/
+	void ShrinkToFit() {
+		origin_x.shrink_to_fit();
+		origin_y.shrink_to_fit();
+		wave_number.shrink_to_fit();
+		amplitude.shrink_to_fit();
+		time_start.shrink_to_fit();
+		phase_offset.shrink_to_fit();
+		energy.shrink_to_fit();
+		celerity.shrink_to_fit();
+		reflection_x.shrink_to_fit();
+		reflection_y.shrink_to_fit();
+		traversal.shrink_to_fit();
+	}
+
+	/*Copies count fragments from one index to another, within these planes.  The ranges must not overlap.*/
+	void Move(int to, int from, int count) {
+		ForEachPlane([=](auto& plane) { std::copy(plane.begin() + from, plane.begin() + from + count, plane.begin() + to); });
+	}
+
+	/*Calls fn(plane) for each of the planes.*/
+	template <typename F>
+	void ForEachPlane(F fn) {
+		fn(origin_x);
+		fn(origin_y);
+		fn(wave_number);
+		fn(amplitude);
+		fn(time_start);
+		fn(phase_offset);
+		fn(energy);
+		fn(celerity);
+		fn(reflection_x);
+		fn(reflection_y);
+		fn(traversal);
+	}
+
+	/*Gathers the fragment at the given index.*/
+	WaveFragment Get(int idx) const {
+		WaveFragment f(origin_x[idx], origin_y[idx], wave_number[idx], amplitude[idx], time_start[idx], phase_offset[idx], energy[idx], celerity[idx], traversal[idx]);
+		f.reflection = cy::Point2f(reflection_x[idx], reflection_y[idx]);
+		return f;
+	}
+
+	/*Scatters the given fragment to the given index.*/
+	void Set(int idx, const WaveFragment& f) {
+		origin_x[idx] = f.origin.x;
+		origin_y[idx] = f.origin.y;
+		wave_number[idx] = f.wave_number;
+		amplitude[idx] = f.amplitude;
+		time_start[idx] = f.time_start;
+		phase_offset[idx] = f.phase_offset;
+		energy[idx] = f.energy;
+		celerity[idx] = f.celerity;
+		reflection_x[idx] = f.reflection.x;
+		reflection_y[idx] = f.reflection.y;
+		traversal[idx] = f.traversal;
+	}
+};
+
+
+/*A lookup table for base^x, for the ebbing of the amplitudes, so that a step need not call std::pow() twice for every cell of every level.
+Since base^x = 2^(x log2(base)), the table need only hold one halving of the curve, 2^(-i / EBB_TABLE_SIZE), which is the same for every 
+base:  x log2(base) is split into whole halvings, which go straight into the float's exponent, and a fraction, which is interpolated from 
+the table.  The interpolation is done in double, so the error is that of interpolating linearly, (ln 2 / EBB_TABLE_SIZE)^2 / 8 relative, 
+plus the rounding of the table and of the result:  this agrees with std::pow() to two units in the last place.  Only bases between 0 and 1
+(ebbing curves) are tabled, and only for arguments of zero and up with a normal float result.  Anything else, or a base other than the one
+last given to Build(), falls back on std::pow(), so a stale table is slower rather than wrong.*/
+class EbbTable {
+
+public:
+
+	/*Sets the base the table is for.  This is cheap, and does nothing if the base has not changed.*/
+	void Build(float base) {
+		if (base == _base) return;
+		_base = base;
+		_tabled = (base > 0.0f) && (base < 1.0f);
+		_steps_per_unit = _tabled ? -std::log2((double)base) * EBB_TABLE_SIZE : 0.0;
+	}
+
+	float Evaluate(float base, float x) const {
+		if (base == _base && _tabled) {
+			double steps = (double)x * _steps_per_unit;		//How far down the curve x is, in table entries.
+			if (steps >= 0.0 && steps < 126.0 * EBB_TABLE_SIZE) {
+				unsigned int i = (unsigned int)steps;
+				double fraction = steps - (double)i;
+				unsigned int halvings = i / EBB_TABLE_SIZE;
+				const float* entry = GetHalving() + (i % EBB_TABLE_SIZE);
+				float value = (float)(entry[0] + (fraction * ((double)entry[1] - entry[0])));
+
+				//The value is in [0.5, 1], so taking fewer than 126 off its exponent leaves it a normal float.
+				unsigned int bits;
+				std::memcpy(&bits, &value, sizeof(bits));
+				bits -= halvings << 23;
+				std::memcpy(&value, &bits, sizeof(value));
+				return value;
+			}
+
+			//Still water has no celerity, so its arguments are infinite or NaN.  These are common, and std::pow() is slow to sort them out.
+			if (steps >= 151.0 * EBB_TABLE_SIZE) return 0.0f;		//std::pow() rounds to zero here too.
+			if (x != x) return x;
+		}
+		return std::pow(base, x);
+	}
+
+private:
+
+	float _base = -1.0f;
+	bool _tabled = false;
+	double _steps_per_unit = 0.0;
+
+	/*Returns 2^(-i / EBB_TABLE_SIZE), for i from 0 to EBB_TABLE_SIZE inclusive.*/
+	static const float* GetHalving() {
+		static const std::vector<float> table = [] {
+			std::vector<float> halving(EBB_TABLE_SIZE + 1);
+			for (int i = 0; i <= EBB_TABLE_SIZE; i++) halving[i] = (float)std::exp2(-(double)i / EBB_TABLE_SIZE);
+			return halving;
+		}();
+		return table.data();
+	}
+};
+
+
+/*A lookup table for tanh(k * depth), the depth term of the dispersion relation, over the wave numbers k at which it has not yet rounded
+to 1.  The table is of tanh() itself, over k * depth from 0 to TANH_TABLE_SPAN, so a change of depth only changes how the wave numbers 
+index it.  As with EbbTable, a depth other than the one last given to Build() falls back on std::tanh().*/
+class TanhTable {
+
+public:
+
+	/*Sets the depth the table is for.*/
+	void Build(float depth) {
+		_depth = depth;
+	}
+
+	float Evaluate(float depth, float waveNumber) const {
+		float kd = waveNumber * depth;
+		if (depth != _depth || !(kd >= 0.0f)) return std::tanh(kd);
+		if (kd >= TANH_TABLE_SPAN) return 1.0f;
+		float steps = kd * (TANH_TABLE_SIZE / TANH_TABLE_SPAN);
+		int i = (int)steps;
+		const float* entry = GetTanh() + i;
+		return entry[0] + ((steps - (float)i) * (entry[1] - entry[0]));
+	}
+
+private:
+
+	float _depth = -1.0f;
+
+	/*Returns tanh(i * TANH_TABLE_SPAN / TANH_TABLE_SIZE), for i from 0 to TANH_TABLE_SIZE inclusive.*/
+	static const float* GetTanh() {
+		static const std::vector<float> table = [] {
+			std::vector<float> values(TANH_TABLE_SIZE + 1);
+			for (int i = 0; i <= TANH_TABLE_SIZE; i++) values[i] = (float)std::tanh((double)i * TANH_TABLE_SPAN / TANH_TABLE_SIZE);
+			return values;
+		}();
+		return table.data();
+	}
+};
+
+
+/*A host-side implementation of the wave simulation.  It follows the same steps as the waterSim1Perturb and waterSim2Waves compute shaders,
+but needs no OpenGL context at all, so it can run on render-less batch nodes and serve as a reference for checking the GPU path.  The rows
+of the grid are spread across a thread pool each step.*/
+class WaterSimulatorCPU {
+
+public:
+
+	const int width;
+	const int height;
+	const int levels;
+	float gravity = 9.8f;
+	float surfaceTension = 1.0f;
+	float density = 1.0f;
+	float depth = 10.0f;
+	float amplitude_time_ebb = 0.5f;
+	float amplitude_distance_ebb = 0.3f;
+	float soliton_speed = 0.75f;
+	float scale = 1.0f;
+
+	/*The time since the start of the simulation, in  milliseconds.*/
+	int currentTime = 0;
+	int runCount = 0;
+
+	/*The number of rows handed to a thread at a time.*/
+	int row_grain = 4;
+
+	/*Whether to use the vectorized neighbor selection kernel, where the build supports it.  Turning this off runs the scalar path, which
+	is handy for A/B comparisons.*/
+	bool use_simd = true;
+
+	/*If true, only the ACTIVE_TILE_SIZE square tiles which held moving water on the last step (or which were just perturbed), plus the 
+	tiles around them, are simulated.*/
+	bool sparse_tiles = false;
+
+	/*If set, every accepted perturbation is appended to this log, tagged with the step it precedes.*/
+	PerturbationLog* recorder = nullptr;
+
+	/*With mapped storage, the rows in each band of the wavefront, the most steps ExecuteSteps() runs in one sweep over the files, and how
+	many bands ahead of the wavefront the files are read in.  About stream_depth + stream_lookahead + 2 bands of every file are held in 
+	memory at once.  A band should have several times row_grain rows for each thread, since the rows of a band are what is shared out.*/
+	int stream_band_rows = 64;
+	int stream_depth = 4;
+	int stream_lookahead = 2;
+
+	/*The row of a larger grid which row 0 of this one is, when this is one strip of it (see WaterSimulatorPartitioned).  Every position,
+	and so every fragment's origin, is measured in the larger grid's rows, so that the strips agree on the fragments they share to the 
+	bit.  Only the positions move:  the larger grid's edges are not this one's.  Set this before Clear(), and leave it alone after.*/
+	int row_offset = 0;
+
+	/*How the fragments are stored.  This is fixed at construction.*/
+	const FragmentEncoding encoding;
+
+	/*Whether the fragments are kept densely or in pages.  This is fixed at construction.*/
+	const FragmentStorage storage;
+
+
+	bool Perturb(cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
+		//The location is in cells, and indexes the fragments directly.
+		if (location.x < 0 || location.x >= width) return false;
+		if (location.y < 0 || location.y >= height) return false;
+		if (level < 0 || level >= levels) return false;
+		if (waveNumber <= 0.0f) return false;
+		if (amplitude <= 0.0f) return false;
+
+		if (recorder != nullptr) recorder->Record(runCount, location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+		Perturbation p = Perturbation(cy::Point2f(location.x, location.y), level, origin, waveNumber, amplitude, timeStamp, phase_offset, 0, 0);
+		_perturbations.push_back(p);
+
+		return true;
+	}
+
+	bool PerturbPoint(cy::Point2f location, int level, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
+		cy::Point2f origin = scale * cy::Point2f(location.x, location.y);
+		return Perturb(location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+	}
+
+
+	/*Returns the normal map, as RGBA floats in row-major order.  The xyz components are the (non-normalized) sum of the normals of every
+	level, and the w component is the summed height, exactly as written to the GPU normal map.*/
+	const float* GetNormalMapData() const { return &_normal_map[0].x; }
+
+	/*Returns the normal map, one cy::Point4f per cell in row-major order.*/
+	const MappedVector<cy::Point4f>& GetNormalMap() const { return _normal_map; }
+
+	/*Samples the water's height and normal at each of the given points, synchronously, as the height query shader does:  the points are
+	in cells, with cell (x, y) at exactly (x, y), the four cells around each point are blended bilinearly, and points off the pond are
+	clamped to its edge.  Large batches are spread across the thread pool.*/
+	void QueryBatch(const std::vector<cy::Point2f>& points, std::vector<WaterSample>& samples) {
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::QueryBatch");
+		samples.resize(points.size());
+		_pool.ParallelFor((int)points.size(), [&](int begin, int end) {
+			for (int i = begin; i < end; i++) samples[i] = SampleNormalMap(&_normal_map[0], width, height, points[i]);
+		}, 1024);
+	}
+
+	/*Blends the given normal map, of the given size, bilinearly at the given point, in cells, clamped to the pond.*/
+	static WaterSample SampleNormalMap(const cy::Point4f* normals, int width, int height, cy::Point2f point) {
+		float px = std::max(0.0f, std::min(point.x, (float)(width - 1)));
+		float py = std::max(0.0f, std::min(point.y, (float)(height - 1)));
+		int x0 = (int)std::floor(px), y0 = (int)std::floor(py);
+		int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+		float fx = px - (float)x0, fy = py - (float)y0;
+		cy::Point4f bottom = normals[x0 + (y0 * width)] * (1.0f - fx) + normals[x1 + (y0 * width)] * fx;
+		cy::Point4f top = normals[x0 + (y1 * width)] * (1.0f - fx) + normals[x1 + (y1 * width)] * fx;
+		cy::Point4f pixel = bottom * (1.0f - fy) + top * fy;
+
+		//The levels' normals are summed unnormalized into the map.
+		WaterSample sample;
+		cy::Point3f n(pixel.x, pixel.y, pixel.z);
+		if (n.LengthSquared() > 0.0f) sample.normal = n.GetNormalized();
+		sample.height = pixel.w;
+		return sample;
+	}
+
+	/*Returns the number of threads used to step the simulation.*/
+	int GetThreadCount() const { return _pool.GetThreadCount(); }
+
+	/*Returns the world cell shown at cell (0, 0) of the window.  This only moves when the window is scrolled.*/
+	int GetWindowX() const { return _window.window_x; }
+	int GetWindowY() const { return _window.window_y; }
+
+	/*Returns the number of pages lent to tiles, and the number the pool has room for, with paged storage.  Each page holds 
+	ACTIVE_TILE_SIZE*ACTIVE_TILE_SIZE*levels fragments in each of the two buffers.  Both are 0 with dense storage.*/
+	int GetPageCount() const { return (storage == PagedStorage) ? (int)(_page_tiles.size() - _free_pages.size()) - 1 : 0; }
+	int GetPageCapacity() const { return (storage == PagedStorage) ? (int)_page_tiles.size() - 1 : 0; }
+
+	/*Returns the number of bytes of files mapped, with mapped storage, or 0.*/
+	size_t GetMappedBytes() const { return (_arena != nullptr) ? _arena->GetMappedBytes() : 0; }
+
+	/*Cells with a larger amplitude than this count as active in the statistics.*/
+	float stats_active_amplitude = 0.001f;
+
+	/*Reduces the fragments written by the last step to their statistics, as the statistics shader does.  This runs synchronously, with
+	the levels spread across the thread pool.  Only the rows [y0, y1) are counted, or every row if y1 is negative, and the bounding boxes
+	are in the rows of the larger grid (see row_offset).*/
+	SimulationStats ComputeStats(int y0 = 0, int y1 = -1) {
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::ComputeStats");
+		if (y1 < 0) y1 = height;
+		SimulationStats stats;
+		stats.run_count = runCount;
+		stats.time = _time_base;
+		stats.levels.assign(levels, LevelStats());
+		UpdateTables();
+		_pool.ParallelFor(levels, [&](int zStart, int zEnd) {
+			for (int z = zStart; z < zEnd; z++) {
+				LevelStats& level = stats.levels[z];
+				level.min_x = width;
+				level.min_y = height + row_offset;
+				double energy = 0.0;
+				auto accumulate = [&](int x, int y) {
+					if (y < y0 || y >= y1) return;
+					WaveFragment f = GetInputFragment(x, y, z);
+					if (f.wave_number <= 0.0f || f.celerity <= 0.0f || f.amplitude <= 0.0f) return;
+					float pTime = (float)std::max(_time_base - f.time_start, 0) / 1000.0f;
+					float amplitude = GetAmplitude(f.amplitude, f.celerity, (cy::Point2f((float)x, (float)(y + row_offset)) - f.origin).Length(), pTime, f.celerity * pTime);
+					energy += GetPerturbationEnergy(amplitude, f.wave_number);
+					level.max_amplitude = std::max(level.max_amplitude, amplitude);
+					if (amplitude > stats_active_amplitude) {
+						level.active_cells++;
+						level.min_x = std::min(level.min_x, x);
+						level.min_y = std::min(level.min_y, y + row_offset);
+						level.max_x = std::max(level.max_x, x);
+						level.max_y = std::max(level.max_y, y + row_offset);
+					}
+				};
+				if (storage == PagedStorage) {
+					//Only the tiles with pages can hold anything but still water.
+					for (int page = 1; page < (int)_page_tiles.size(); page++) {
+						if (_page_tiles[page] < 0) continue;
+						ForEachTileSpan(_page_tiles[page], [&](int y, int x0, int x1) { for (int x = x0; x < x1; x++) accumulate(x, y); });
+					}
+				}
+				else {
+					for (int y = y0; y < y1; y++)
+						for (int x = 0; x < width; x++) accumulate(x, y);
+				}
+				level.total_energy = (float)energy;
+				if (level.active_cells == 0) { level.min_x = 0; level.min_y = 0; }
+			}
+		});
+		return stats;
+	}
+
+
+private:
+
+	std::vector<Perturbation> _perturbations;
+
+	/*The files every large buffer below is mapped from, with mapped storage.  This must come before them, as it is handed to them as they
+	are made.*/
+	std::unique_ptr<MappedArena> _arena;
+
+	WaveFragmentPlanes _fragments_A;
+	WaveFragmentPlanes _fragments_B;
+
+	/*The fragments, when the packed encoding is used instead of the planes.  The ages of the input fragments are measured from the time
+	base, which is the time of the last step.*/
+	MappedVector<PackedWaveFragment> _packed_A;
+	MappedVector<PackedWaveFragment> _packed_B;
+	int _time_base = 0;
+
+	/*Where the window lies.  Cell (x, y) of the window is world cell (x + window_x, y + window_y), and is stored toroidally, at 
+	((x + ring_x) mod width, (y + ring_y) mod height), so scrolling only moves the ring.  The full encoding's origins are in the cells of 
+	the window as it was when the input fragments were written, which is (shift_x, shift_y) behind where it is now; the next step rebases 
+	them as it reads them.  The packed encoding's origins are relative to their own cell, so they never need rebasing.*/
+	struct WindowState {
+		int window_x = 0;
+		int window_y = 0;
+		int ring_x = 0;
+		int ring_y = 0;
+		int shift_x = 0;
+		int shift_y = 0;
+	};
+	WindowState _window;
+
+	/*With paged storage, the page table holds the page of each tile, in the tiles of the storage (not of the window), and _page_tiles 
+	holds the tile each page is lent to, or -1 if it is free.  Page 0 is still water:  it is never written, and stands in for every tile 
+	without a page of its own.  Each page is _page_size fragments, laid out by level, then by row.*/
+	std::vector<int> _page_table;
+	std::vector<int> _page_tiles;
+	std::vector<int> _free_pages;
+	int _page_size = 0;
+
+	/*A copy of the input fragments, the clocks, the window and the pages, taken by Snapshot().*/
+	WaveFragmentPlanes _snapshot;
+	MappedVector<PackedWaveFragment> _packed_snapshot;
+	bool _has_snapshot = false;
+	int _snapshot_time = 0;
+	int _snapshot_time_base = 0;
+	int _snapshot_run_count = 0;
+	WindowState _snapshot_window;
+	std::vector<int> _snapshot_page_table;
+	std::vector<int> _snapshot_page_tiles;
+	std::vector<int> _snapshot_free_pages;
+
+	MappedVector<cy::Point4f> _normal_map;
+	MappedVector<cy::Point4f> _reflection_map;
+
+	bool _in_A_out_B = true;
+
+	ThreadPool _pool;
+
+	/*The tiles flagged to run on the next step, the compacted list of tiles for this step, and whether each listed tile had moving water.
+	The tiles are those of the storage, so they stay put as the window scrolls; until it does, they are also those of the window.*/
+	std::vector<unsigned char> _tile_flags;
+	std::vector<int> _tile_list;
+	std::vector<unsigned char> _tile_moving;
+	int _tiles_x;
+	int _tiles_y;
+
+	/*Whether the last step ran sparse.  If it didn't, no tiles were flagged, so the next sparse step must run them all.*/
+	bool _last_step_sparse = false;
+
+	/*The lookup tables for the transcendental functions of GetCelerity() and GetAmplitude().  UpdateTables() points them at the current
+	parameters before each step, while no tasks are running.*/
+	TanhTable _tanh_table;
+	EbbTable _time_ebb_table;
+	EbbTable _distance_ebb_table;
+
+
+	/*Returns the index of the fragment at the given cell of the window.  With paged storage, a cell whose tile has no page maps into the 
+	still water page, which must not be written.  With mapped storage, the rows of the levels are interleaved.*/
+	int GetIndex(int x, int y, int level) const {
+		x += _window.ring_x;
+		if (x >= width) x -= width;
+		y += _window.ring_y;
+		if (y >= height) y -= height;
+		if (storage == PagedStorage) {
+			int page = _page_table[(x / ACTIVE_TILE_SIZE) + ((y / ACTIVE_TILE_SIZE) * _tiles_x)];
+			return (page * _page_size) + (level * ACTIVE_TILE_SIZE * ACTIVE_TILE_SIZE) + ((y % ACTIVE_TILE_SIZE) * ACTIVE_TILE_SIZE) + (x % ACTIVE_TILE_SIZE);
+		}
+		if (storage == MappedStorage) return x + (level * width) + (y * width * levels);
+		int levelContribution = level * width * height;
+		int rowContribution = y * width;
+		return x + rowContribution + levelContribution;
+	}
+
+	/*Returns how many cells of the window's row, from the given cell on, lie one after another in storage:  up to the seam of the ring, 
+	or the edge of the page.*/
+	int GetContiguousCells(int x) const {
+		x += _window.ring_x;
+		if (x >= width) x -= width;
+		int run = width - x;
+		if (storage == PagedStorage) run = std::min(run, ACTIVE_TILE_SIZE - (x % ACTIVE_TILE_SIZE));
+		return run;
+	}
+
+	/*Returns the storage tile holding the given cell of the window.*/
+	int GetTile(int x, int y) const {
+		x += _window.ring_x;
+		if (x >= width) x -= width;
+		y += _window.ring_y;
+		if (y >= height) y -= height;
+		return (x / ACTIVE_TILE_SIZE) + ((y / ACTIVE_TILE_SIZE) * _tiles_x);
+	}
+
+	/*Calls fn(y, x0, x1) for each span [x0, x1) of a row of the window covered by the given storage tile.  A tile the window's edge runs 
+	through splits into two spans on each row.*/
+	template <typename F>
+	void ForEachTileSpan(int tile, F fn) const {
+		int sx0 = (tile % _tiles_x) * ACTIVE_TILE_SIZE, sx1 = std::min(sx0 + ACTIVE_TILE_SIZE, width);
+		int sy0 = (tile / _tiles_x) * ACTIVE_TILE_SIZE, sy1 = std::min(sy0 + ACTIVE_TILE_SIZE, height);
+		int x0 = sx0 - _window.ring_x;
+		if (x0 < 0) x0 += width;
+		int x1 = x0 + (sx1 - sx0);
+		for (int sy = sy0; sy < sy1; sy++) {
+			int y = sy - _window.ring_y;
+			if (y < 0) y += height;
+			if (x1 <= width) fn(y, x0, x1);
+			else {
+				fn(y, x0, width);
+				fn(y, 0, x1 - width);
+			}
+		}
+	}
+
+	/*Returns the input fragment at the given cell of the window, with its origin rebased to where the window is now.*/
+	WaveFragment GetInputFragment(int x, int y, int level) const {
+		if (encoding == PackedFragments) return UnpackFragment((_in_A_out_B ? _packed_A : _packed_B)[GetIndex(x, y, level)], x, y + row_offset, _time_base);
+		WaveFragment f = (_in_A_out_B ? _fragments_A : _fragments_B).Get(GetIndex(x, y, level));
+		f.origin.x -= (float)_window.shift_x;
+		f.origin.y -= (float)_window.shift_y;
+		return f;
+	}
+
+
+public:
+
+	/*Creates a simulator of the given size.  A thread count of 0 or less uses every hardware thread.  With mapped storage, the files go in
+	the given directory, or in the system's temporary directory if it is empty.  The grid may hold at most 2^31 fragments in any storage.*/
+	WaterSimulatorCPU(int width, int height, int levels, float scale = 10.0f, int threadCount = 0, FragmentEncoding encoding = FullFragments,
+		FragmentStorage storage = DenseStorage, const std::string& mappedDirectory = "")
+		: width(width), height(height), levels(levels), scale(scale), encoding(encoding), storage(storage),
+		_arena((storage == MappedStorage) ? new MappedArena(mappedDirectory) : nullptr), _fragments_A(_arena.get()), _fragments_B(_arena.get()),
+		_packed_A(MappedAllocator<PackedWaveFragment>(_arena.get())), _packed_B(MappedAllocator<PackedWaveFragment>(_arena.get())),
+		_snapshot(_arena.get()), _packed_snapshot(MappedAllocator<PackedWaveFragment>(_arena.get())),
+		_normal_map(MappedAllocator<cy::Point4f>(_arena.get())), _reflection_map(MappedAllocator<cy::Point4f>(_arena.get())), _pool(threadCount) {
+		_tiles_x = (width + ACTIVE_TILE_SIZE - 1) / ACTIVE_TILE_SIZE;
+		_tiles_y = (height + ACTIVE_TILE_SIZE - 1) / ACTIVE_TILE_SIZE;
+		_tile_flags.assign(_tiles_x * _tiles_y, 1);
+		_normal_map.assign(width * height, cy::Point4f(0, 0, (float)levels, 0));
+		_reflection_map.assign(width * height, cy::Point4f(0, 0, 1, 1));		//Open water, as BuildObstacles() makes it with no obstacles.
+		Clear();
+	}
+
+
+	/*Builds the reflection map for the standard obstacle configurations.  Each texel holds the obstacle normal in xy, and the damping
+	multiplier in z.*/
+	static std::vector<cy::Point4f> BuildObstacles(int width, int height, bool border, bool square, bool bar) {
+
+		std::vector<cy::Point4f> reflections(width*height);
+		for (int i = 0; i < (width * height); i++) reflections[i] = cy::Point4f(0, 0, 1, 1);
+		auto GetIndex = [width](int x, int y) { return x + (y * width); };
+
+		if (border) {
+			for (int x = 0; x < width; x++) {
+				reflections[GetIndex(x, 0)] = cy::Point4f(0, 1, 1, 1);
+				reflections[GetIndex(x, height - 1)] = cy::Point4f(0, -1, 1, 1);
+			}
+			for (int y = 0; y < height; y++) {
+				reflections[GetIndex(0, y)] = cy::Point4f(1, 0, 1, 1);
+				reflections[GetIndex(width - 1, y)] = cy::Point4f(-1, 0, 1, 1);
+			}
+		}
+
+		if (square) {
+			int centerX = width / 4, centerY = width / 2;
+			int square_width = width / 8, square_height = height / 8;
+			int xStart = centerX - square_width, xEnd = centerX + square_width;
+			int yStart = centerY - square_height, yEnd = centerY + square_height;
+			//Damp it all
+			for (int x = xStart; x <= xEnd; x++) {
+				for (int y = yStart; y <= yEnd; y++) {
+					reflections[GetIndex(x, y)] = cy::Point4f(0, 0, 0, 1);
+				}
+			}
+			//The inset box.
+			for (int x = xStart; x <= xEnd; x++) {
+				reflections[GetIndex(x, yStart)] = cy::Point4f(0, -1, 1, 1);
+				reflections[GetIndex(x, yEnd)] = cy::Point4f(0, 1, 1, 1);
+			}
+			for (int y = yStart; y <= yEnd; y++) {
+				reflections[GetIndex(xStart, y)] = cy::Point4f(-1, 0, 1, 1);
+				reflections[GetIndex(xEnd, y)] = cy::Point4f(1, 0, 1, 1);
+			}
+		}
+
+		if (bar) {
+			int centerX = 3 * (width / 4);
+			int square_width = width / 10;
+			int xStart = centerX - square_width, xEnd = centerX + square_width;
+			int yEnd = height - square_width;
+			//Damp it all
+			for (int x = xStart; x <= xEnd; x++) {
+				for (int y = 0; y <= yEnd; y++) {
+					reflections[GetIndex(x, y)] = cy::Point4f(0, 0, 0, 1);
+				}
+			}
+			//The inset box.
+			for (int x = xStart; x <= xEnd; x++) {
+				reflections[GetIndex(x, yEnd)] = cy::Point4f(0, 1, 1, 1);
+			}
+			for (int y = 0; y <= yEnd; y++) {
+				reflections[GetIndex(xStart, y)] = cy::Point4f(-1, 0, 1, 1);
+				reflections[GetIndex(xEnd, y)] = cy::Point4f(1, 0, 1, 1);
+			}
+		}
+
+		return reflections;
+	}
+
+	void SetObstacles(bool border, bool square, bool bar) { SetReflections(BuildObstacles(width, height, border, square, bar)); }
+
+	/*Sets the reflection map, which must hold width*height texels.*/
+	void SetReflections(const std::vector<cy::Point4f>& reflections) {
+		if ((int)reflections.size() != width * height) return;
+		_reflection_map.assign(reflections.begin(), reflections.end());
+	}
+
+	/*Copies the rectangle [x0, x1) by [y0, y1) of the given reflection map, which must hold width*height texels, into this one.*/
+	void UpdateReflections(const std::vector<cy::Point4f>& reflections, int x0, int y0, int x1, int y1) {
+		if ((int)reflections.size() != width * height) return;
+		for (int y = y0; y < y1; y++)
+			std::copy(reflections.begin() + (y * width) + x0, reflections.begin() + (y * width) + x1, _reflection_map.begin() + (y * width) + x0);
+	}
+
+
+	void Clear() {
+		//Still water has nothing to rebase.
+		_window.shift_x = 0;
+		_window.shift_y = 0;
+		if (storage == PagedStorage) { ResetPages(); return; }
+
+		int numFragments = width * height * levels;
+		if (storage == MappedStorage) {
+			//Rather than copying one buffer to the other, which would read a whole file back in, both are written a band of rows at a time,
+			//and each band is written back as soon as it is done.
+			if (encoding == PackedFragments) {
+				_packed_A.resize(numFragments);
+				_packed_B.resize(numFragments);
+				_time_base = currentTime;
+			}
+			else {
+				_fragments_A.Resize(numFragments);
+				_fragments_B.Resize(numFragments);
+			}
+			int bandRows = std::max(stream_band_rows, 1);
+			for (int band = 0; band * bandRows < height; band++) {
+				int y0 = band * bandRows, y1 = std::min(y0 + bandRows, height);
+				_pool.ParallelFor(y1 - y0, [&](int yStart, int yEnd) { for (int y = y0 + yStart; y < y0 + yEnd; y++) ResetCells(y, 0, width); }, row_grain);
+				StreamBand(band, false);
+			}
+			_last_step_sparse = false;
+			return;
+		}
+
+		if (encoding == PackedFragments) {
+			_packed_A.resize(numFragments);
+			_time_base = currentTime;
+		}
+		else
+			_fragments_A.Resize(numFragments);
+		int idx = 0;
+		for (int z = 0; z < levels; z++) {
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					WaveFragment f(x*scale, (y + row_offset)*scale, 0, 0, 0, 0, 0, 0, 0);
+					if (encoding == PackedFragments) _packed_A[idx++] = PackFragment(f, x, y + row_offset, _time_base);
+					else _fragments_A.Set(idx++, f);
+				}
+			}
+		}
+		_fragments_B = _fragments_A;
+		_packed_B = _packed_A;
+
+		//Every tile has to be rewritten once after a reset.
+		_last_step_sparse = false;
+	}
+
+
+	/*Copies the simulation state aside, replacing any earlier snapshot.  Pending perturbations are not part of the snapshot.*/
+	void Snapshot() {
+		//Only the inputs matter:  the next step overwrites the outputs and the normal map.
+		if (encoding == PackedFragments) _packed_snapshot = _in_A_out_B ? _packed_A : _packed_B;
+		else _snapshot = _in_A_out_B ? _fragments_A : _fragments_B;
+		_snapshot_time = currentTime;
+		_snapshot_time_base = _time_base;
+		_snapshot_run_count = runCount;
+		_snapshot_window = _window;
+		_snapshot_page_table = _page_table;
+		_snapshot_page_tiles = _page_tiles;
+		_snapshot_free_pages = _free_pages;
+		_has_snapshot = true;
+	}
+
+	/*Rolls the simulation back to the last snapshot, including its clock.  Returns false if no snapshot has been taken.*/
+	bool Restore() {
+		if (!_has_snapshot) return false;
+		if (storage == PagedStorage) StillMovingPixels();
+		if (encoding == PackedFragments) (_in_A_out_B ? _packed_A : _packed_B) = _packed_snapshot;
+		else (_in_A_out_B ? _fragments_A : _fragments_B) = _snapshot;
+		currentTime = _snapshot_time;
+		_time_base = _snapshot_time_base;
+		runCount = _snapshot_run_count;
+		_window = _snapshot_window;
+
+		if (storage == PagedStorage) {
+			_page_table = _snapshot_page_table;
+			_page_tiles = _snapshot_page_tiles;
+			_free_pages = _snapshot_free_pages;
+			if (encoding == PackedFragments) (_in_A_out_B ? _packed_B : _packed_A).resize(_packed_snapshot.size());
+			else (_in_A_out_B ? _fragments_B : _fragments_A).Resize(_snapshot.Size());
+
+			//Running every tile would lend every tile a page, so only the tiles with pages run once, and their neighbors.
+			std::fill(_tile_flags.begin(), _tile_flags.end(), 0);
+			for (int page = 1; page < (int)_page_tiles.size(); page++) if (_page_tiles[page] >= 0) MarkTileActive(_page_tiles[page]);
+			_tile_list.clear();
+			_tile_moving.clear();
+			return true;
+		}
+
+		//The tile flags describe the state that was rolled away from, so every tile has to run once.
+		_last_step_sparse = false;
+		return true;
+	}
+
+
+	/*Scrolls the window dx cells along x and dy along y, across water which stays put in the world, so that a window which follows the 
+	camera can simulate unbounded water in fixed memory and at a fixed cost.  Nothing is copied:  the storage is addressed toroidally, so 
+	only the cells scrolled into view are reset to still water, a column or row per cell scrolled, and the fragments' origins are rebased 
+	by the next step as it reads them.  Perturbations not applied yet move with the water, and are dropped if they leave the window.  The 
+	reflection map stays with the window, and the normal map is out of date until the next step.*/
+	void Scroll(int dx, int dy) {
+		if (dx == 0 && dy == 0) return;
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::Scroll");
+		StillMovingPixels();
+
+		_window.window_x += dx;
+		_window.window_y += dy;
+		_window.ring_x = (((_window.ring_x + dx) % width) + width) % width;
+		_window.ring_y = (((_window.ring_y + dy) % height) + height) % height;
+		if (encoding == FullFragments) {
+			_window.shift_x += dx;
+			_window.shift_y += dy;
+		}
+
+		cy::Point2f delta((float)dx, (float)dy);
+		auto left = std::remove_if(_perturbations.begin(), _perturbations.end(), [&](Perturbation& p) {
+			p.location = p.location - delta;
+			p.wave_fragment.origin = p.wave_fragment.origin - delta;
+			return p.location.x < 0 || p.location.y < 0 || (int)p.location.x >= width || (int)p.location.y >= height;
+		});
+		_perturbations.erase(left, _perturbations.end());
+
+		//Reset the cells scrolled into view:  a band of columns on one side of the window, and a band of rows on another.
+		int columns = std::min(std::abs(dx), width), rows = std::min(std::abs(dy), height);
+		int x0 = (dx > 0) ? width - columns : 0;
+		int y0 = (dy > 0) ? height - rows : 0;
+		if (columns > 0) for (int y = 0; y < height; y++) ResetCells(y, x0, x0 + columns);
+		for (int y = y0; y < y0 + rows; y++) ResetCells(y, 0, width);
+
+		//The window's edge has moved, so tiles across the edge of the storage may now be neighbors of the moving tiles.
+		if (_last_step_sparse)
+			for (int i = 0; i < (int)_tile_list.size(); i++) if (_tile_moving[i]) MarkTileActive(_tile_list[i]);
+	}
+
+	/*Scrolls the window so that the given world cell lies at its center.*/
+	void CenterOn(cy::Point2f cell) {
+		Scroll((int)std::floor(cell.x) - (width / 2) - _window.window_x, (int)std::floor(cell.y) - (height / 2) - _window.window_y);
+	}
+
+
+	bool Execute(int elapsedTime) {
+		if (storage == MappedStorage) return ExecuteSteps(1, elapsedTime);
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::Execute");
+
+		bool sparse = sparse_tiles || (storage == PagedStorage);
+		if (sparse && !_last_step_sparse) std::fill(_tile_flags.begin(), _tile_flags.end(), 1);
+		_last_step_sparse = sparse;
+		UpdateTables();
+		ApplyPerturbations(sparse);
+
+		//Run the wave simulation, one band of rows per task.  Each task runs every level for its rows, so the normal map sums need no
+		//synchronization.
+		if (sparse) {
+			//Compact the flagged tiles into a list, clearing the flags so the step can set them again for the next step.
+			_tile_list.clear();
+			for (int t = 0; t < (int)_tile_flags.size(); t++) {
+				if (_tile_flags[t] == 0) continue;
+				_tile_list.push_back(t);
+				_tile_flags[t] = 0;
+			}
+			_tile_moving.assign(_tile_list.size(), 0);
+
+			//Every tile which runs writes its fragments, so it needs a page.  The pool may grow here, but never while the tasks run.
+			if (storage == PagedStorage) for (int t : _tile_list) AllocatePage(t);
+
+			_pool.ParallelFor((int)_tile_list.size(), [&](int begin, int end) {
+				CPU_PROFILE_ZONE("WaterSimulatorCPU tiles");
+				for (int i = begin; i < end; i++) {
+					bool moving = false;
+					ForEachTileSpan(_tile_list[i], [&](int y, int x0, int x1) { moving |= StepSpan(y, x0, x1); });
+					_tile_moving[i] = moving;
+				}
+			});
+
+			//Flag the moving tiles and their neighbors.  This is done after the step, so the tasks never write to shared flags.
+			for (int i = 0; i < (int)_tile_list.size(); i++)
+				if (_tile_moving[i]) MarkTileActive(_tile_list[i]);
+
+			//Hand back the pages of the tiles which have gone quiet, unless a neighbor's waves are about to reach them again.
+			if (storage == PagedStorage) {
+				for (int i = 0; i < (int)_tile_list.size(); i++)
+					if (!_tile_moving[i] && _tile_flags[_tile_list[i]] == 0) FreePage(_tile_list[i]);
+				TrimPages();
+			}
+		}
+		else {
+			_pool.ParallelFor(height, [&](int yStart, int yEnd) {
+				CPU_PROFILE_ZONE("WaterSimulatorCPU rows");
+				for (int y = yStart; y < yEnd; y++) StepSpan(y, 0, width);
+			}, row_grain);
+		}
+
+		_in_A_out_B = !_in_A_out_B;
+		_time_base = currentTime;
+		currentTime += elapsedTime;
+		runCount++;
+
+		//The step wrote every origin in the window as it is now.
+		_window.shift_x = 0;
+		_window.shift_y = 0;
+
+		//Signify the successful operation.
+		return true;
+	}
+
+	/*Runs the given number of steps of the given length, with the same result as that many calls to Execute().  With mapped storage, 
+	the steps run in sweeps down the rows, up to stream_depth steps to a sweep, so that the files are only read and written once for 
+	every stream_depth steps rather than for every step.  Within a sweep, each step trails the one before it by a band of rows:  a band 
+	can take its next step as soon as the bands on either side of it have caught up, since they hold the rows above and below it that its 
+	cells read (its halo).  The files are read ahead of the sweep, and written back behind it, on the arena's thread.  Only the last step 
+	of a sweep leaves its normal map, so frames must be taken between calls.*/
+	bool ExecuteSteps(int steps, int elapsedTime) {
+		if (storage != MappedStorage) {
+			for (int i = 0; i < steps; i++) if (!Execute(elapsedTime)) return false;
+			return true;
+		}
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::ExecuteSteps");
+		_last_step_sparse = false;
+		UpdateTables();
+		while (steps > 0) {
+			int depth = std::min(steps, std::max(stream_depth, 1));
+			ApplyPerturbations(false);
+			Sweep(depth, elapsedTime);
+			steps -= depth;
+		}
+		return true;
+	}
+
+	/*Returns the size in bytes of a row of input fragments, across every level, as ReadRow() and WriteRow() copy them:  a WaveFragment 
+	or a PackedWaveFragment per cell, level by level.*/
+	size_t GetRowBytes() const { return (size_t)width * levels * ((encoding == PackedFragments) ? sizeof(PackedWaveFragment) : sizeof(WaveFragment)); }
+
+	/*Copies the given row of the input fragments, as the next step will read them, to the given buffer of GetRowBytes() bytes.  The 
+	fragments are copied as stored, so they are only good for writing back into a simulator with the same encoding and clocks.*/
+	void ReadRow(int y, void* data) const {
+		WaveFragment* fragments = (WaveFragment*)data;
+		PackedWaveFragment* packed = (PackedWaveFragment*)data;
+		for (int z = 0; z < levels; z++) {
+			for (int x = 0; x < width; x++) {
+				int idx = GetIndex(x, y, z);
+				if (encoding == PackedFragments) *packed++ = (_in_A_out_B ? _packed_A : _packed_B)[idx];
+				else *fragments++ = (_in_A_out_B ? _fragments_A : _fragments_B).Get(idx);
+			}
+		}
+	}
+
+	/*Replaces the given row of the input fragments with a row copied by ReadRow(), ahead of the next step.  Sparse steps flag the tiles 
+	the cells with moving water are in, as a perturbation does, and with paged storage those tiles are lent pages.*/
+	void WriteRow(int y, const void* data) {
+		bool sparse = sparse_tiles || (storage == PagedStorage);
+		const WaveFragment* fragments = (const WaveFragment*)data;
+		const PackedWaveFragment* packed = (const PackedWaveFragment*)data;
+		for (int z = 0; z < levels; z++) {
+			for (int x = 0; x < width; x++) {
+				bool moving = (encoding == PackedFragments) ? UnpackHalfLow(packed->amplitude_celerity) > 0.0f : fragments->energy > 0.0f;
+				int idx = GetIndex(x, y, z);
+				if (storage == PagedStorage && idx < _page_size) {
+					//Still water is already what a tile without a page reads as.
+					if (moving) {
+						AllocatePage(GetTile(x, y));
+						idx = GetIndex(x, y, z);
+					}
+					else idx = -1;
+				}
+				if (idx >= 0) {
+					if (encoding == PackedFragments) (_in_A_out_B ? _packed_A : _packed_B)[idx] = *packed;
+					else (_in_A_out_B ? _fragments_A : _fragments_B).Set(idx, *fragments);
+				}
+				if (sparse && moving) MarkTileActive(GetTile(x, y));
+				packed++;
+				fragments++;
+			}
+		}
+	}
+
+
+private:
+
+	/*Writes the perturbations into the input fragments, in order, so a later perturbation of the same cell wins.  Sparse steps flag the
+	tiles perturbed.*/
+	void ApplyPerturbations(bool sparse) {
+		WaveFragmentPlanes& inputs = _in_A_out_B ? _fragments_A : _fragments_B;
+		MappedVector<PackedWaveFragment>& packedInputs = _in_A_out_B ? _packed_A : _packed_B;
+		for (Perturbation& p : _perturbations) {
+			int x = (int)p.location.x, y = (int)p.location.y;
+			if (storage == PagedStorage) AllocatePage(GetTile(x, y));
+			WaveFragment f = p.wave_fragment;
+			f.energy = GetPerturbationEnergy(f.amplitude, f.wave_number);
+			f.celerity = GetCelerity(f.wave_number);
+			//The input origins are in the window as it was when they were written.
+			f.origin.x += (float)_window.shift_x;
+			f.origin.y += (float)_window.shift_y;
+			int idx = GetIndex(x, y, p.level);
+			if (encoding == PackedFragments) packedInputs[idx] = PackFragment(f, x, y + row_offset, _time_base);
+			else inputs.Set(idx, f);
+			if (sparse) MarkTileActive(GetTile(x, y));
+		}
+		_perturbations.clear();
+	}
+
+	/*Runs the given number of steps, densely, in one wavefront sweep down the bands of rows (see ExecuteSteps()).  At stage s, step j runs 
+	on band s - j, once step j - 1 has run on the band below it at the same stage.  The two buffers are enough:  by the time a step 
+	overwrites a band's fragments from two steps back, the steps which read them, on that band and on its neighbors, have all run.  The 
+	clocks, the buffer flip and the window shift are set for each step as Execute() would leave them, since the kernels read them.*/
+	void Sweep(int depth, int elapsedTime) {
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::Sweep");
+		int bandRows = std::max(stream_band_rows, 1);
+		int bands = (height + bandRows - 1) / bandRows;
+		int startTime = currentTime, startTimeBase = _time_base;
+		bool startInAOutB = _in_A_out_B;
+		WindowState startWindow = _window;
+
+		for (int band = 0; band < std::min(stream_lookahead + 1, bands); band++) StreamBand(band, true);
+		for (int stage = 0; stage < bands + depth - 1; stage++) {
+			if (stage + stream_lookahead + 1 < bands) StreamBand(stage + stream_lookahead + 1, true);
+			for (int step = 0; step < depth; step++) {
+				int band = stage - step;
+				if (band < 0 || band >= bands) continue;
+				currentTime = startTime + (step * elapsedTime);
+				_time_base = (step == 0) ? startTimeBase : startTime + ((step - 1) * elapsedTime);
+				_in_A_out_B = startInAOutB ^ ((step % 2) != 0);
+				_window.shift_x = (step == 0) ? startWindow.shift_x : 0;
+				_window.shift_y = (step == 0) ? startWindow.shift_y : 0;
+				int y0 = band * bandRows, y1 = std::min(y0 + bandRows, height);
+				_pool.ParallelFor(y1 - y0, [&](int yStart, int yEnd) {
+					CPU_PROFILE_ZONE("WaterSimulatorCPU band");
+					for (int y = y0 + yStart; y < y0 + yEnd; y++) StepSpan(y, 0, width);
+				}, row_grain);
+			}
+			//The band the last step left behind is no longer read by any step.
+			if (stage - depth >= 0) StreamBand(stage - depth, false);
+		}
+		StreamBand(bands - 1, false);
+
+		_in_A_out_B = startInAOutB ^ ((depth % 2) != 0);
+		_time_base = startTime + ((depth - 1) * elapsedTime);
+		currentTime = startTime + (depth * elapsedTime);
+		runCount += depth;
+		_window.shift_x = 0;
+		_window.shift_y = 0;
+	}
+
+	/*Queues the rows of the given band, in both fragment buffers and both maps, to be read in ahead of the sweep, or written back and 
+	dropped behind it.  The window's rows are stored from the ring's offset on, so a band may be two runs of each file.*/
+	void StreamBand(int band, bool prefetch) {
+		int bandRows = std::max(stream_band_rows, 1);
+		int y0 = band * bandRows, y1 = std::min(y0 + bandRows, height);
+		auto stream = [&](const auto& plane, size_t first, size_t count) {
+			if (prefetch) _arena->Prefetch(&plane[first], count * sizeof(plane[0]));
+			else _arena->Release(&plane[first], count * sizeof(plane[0]));
+		};
+		auto streamRows = [&](int s0, int s1) {
+			size_t first = (size_t)s0 * width * levels, count = (size_t)(s1 - s0) * width * levels;
+			if (encoding == PackedFragments) {
+				stream(_packed_A, first, count);
+				stream(_packed_B, first, count);
+			}
+			else {
+				_fragments_A.ForEachPlane([&](const auto& plane) { stream(plane, first, count); });
+				_fragments_B.ForEachPlane([&](const auto& plane) { stream(plane, first, count); });
+			}
+		};
+		int s0 = (y0 + _window.ring_y) % height, s1 = s0 + (y1 - y0);
+		if (s1 <= height) streamRows(s0, s1);
+		else {
+			streamRows(s0, height);
+			streamRows(0, s1 - height);
+		}
+		stream(_normal_map, (size_t)y0 * width, (size_t)(y1 - y0) * width);
+		stream(_reflection_map, (size_t)y0 * width, (size_t)(y1 - y0) * width);
+	}
+
+	/*Resets the cells [x0, x1) of the given row of the window to still water, in both buffers.  The cells of tiles without a page are 
+	still water already.*/
+	void ResetCells(int y, int x0, int x1) {
+		for (int z = 0; z < levels; z++) {
+			for (int x = x0; x < x1; x++) {
+				int idx = GetIndex(x, y, z);
+				if (storage == PagedStorage && idx < _page_size) continue;
+				WaveFragment f(x*scale, (y + row_offset)*scale, 0, 0, 0, 0, 0, 0, 0);
+				if (encoding == PackedFragments) _packed_A[idx] = _packed_B[idx] = PackFragment(f, x, y + row_offset, _time_base);
+				else {
+					_fragments_A.Set(idx, f);
+					_fragments_B.Set(idx, f);
+				}
+			}
+		}
+	}
+
+	/*Stills the normal map where the tiles which had moving water on the last step lie in the window now.  Those are the only pixels 
+	which are not still, so this leaves the whole map still, ready for the next step to write the moving tiles wherever they will lie.
+	It is only needed after a sparse step, since a dense step rewrites every pixel.*/
+	void StillMovingPixels() {
+		if (!_last_step_sparse) return;
+		const cy::Point4f still(0, 0, (float)levels, 0);
+		for (int i = 0; i < (int)_tile_list.size(); i++) {
+			if (!_tile_moving[i]) continue;
+			ForEachTileSpan(_tile_list[i], [&](int y, int x0, int x1) { std::fill(_normal_map.begin() + (y * width) + x0, _normal_map.begin() + (y * width) + x1, still); });
+		}
+	}
+
+	/*Hands back every page and shrinks the pool to its smallest.  No tile will run until something disturbs it, so the normal map is 
+	stilled here instead.*/
+	void ResetPages() {
+		_page_size = ACTIVE_TILE_SIZE * ACTIVE_TILE_SIZE * levels;
+		_page_table.assign(_tiles_x * _tiles_y, 0);
+		_page_tiles.assign(1, -1);
+		_free_pages.clear();
+		_fragments_A = WaveFragmentPlanes();
+		_fragments_B = WaveFragmentPlanes();
+		MappedVector<PackedWaveFragment>().swap(_packed_A);
+		MappedVector<PackedWaveFragment>().swap(_packed_B);
+		_time_base = currentTime;
+		GrowPool(PAGE_POOL_MIN_PAGES + 1);
+		ClearPage(0);
+
+		std::fill(_tile_flags.begin(), _tile_flags.end(), 0);
+		_tile_list.clear();
+		_tile_moving.clear();
+		std::fill(_normal_map.begin(), _normal_map.end(), cy::Point4f(0, 0, (float)levels, 0));
+		_last_step_sparse = true;
+	}
+
+	/*Grows the pool to the given number of pages, counting the still water page, and adds the new pages to the free list so that the 
+	lowest are lent first.*/
+	void GrowPool(int pages) {
+		int first = (int)_page_tiles.size();
+		if (encoding == PackedFragments) {
+			_packed_A.resize((size_t)pages * _page_size);
+			_packed_B.resize((size_t)pages * _page_size);
+		}
+		else {
+			_fragments_A.Resize(pages * _page_size);
+			_fragments_B.Resize(pages * _page_size);
+		}
+		_page_tiles.resize(pages, -1);
+		for (int page = pages - 1; page >= first; page--) _free_pages.push_back(page);
+	}
+
+	/*Fills the given page with still water, in both buffers.*/
+	void ClearPage(int page) {
+		WaveFragment f(0, 0, 0, 0, 0, 0, 0, 0, 0);
+		PackedWaveFragment packed = PackFragment(f, 0, 0, _time_base);
+		for (int idx = page * _page_size; idx < (page + 1) * _page_size; idx++) {
+			if (encoding == PackedFragments) _packed_A[idx] = _packed_B[idx] = packed;
+			else {
+				_fragments_A.Set(idx, f);
+				_fragments_B.Set(idx, f);
+			}
+		}
+	}
+
+	/*Lends a page of still water to the given tile, if it has none, doubling the pool if every page is lent.*/
+	void AllocatePage(int tile) {
+		if (_page_table[tile] != 0) return;
+		if (_free_pages.empty()) GrowPool((int)_page_tiles.size() * 2);
+		int page = _free_pages.back();
+		_free_pages.pop_back();
+		_page_table[tile] = page;
+		_page_tiles[page] = tile;
+		ClearPage(page);
+	}
+
+	/*Hands back the given tile's page, if it has one.  The tile must be still water in both buffers.*/
+	void FreePage(int tile) {
+		int page = _page_table[tile];
+		if (page == 0) return;
+		_page_table[tile] = 0;
+		_page_tiles[page] = -1;
+		_free_pages.push_back(page);
+	}
+
+	/*Once no more than a quarter of the pool is lent, moves the lent pages to the front of it and shrinks it, so that the memory held 
+	follows the activity back down as well as up.*/
+	void TrimPages() {
+		int capacity = (int)_page_tiles.size();
+		int used = capacity - (int)_free_pages.size();
+		if (capacity <= PAGE_POOL_MIN_PAGES + 1 || used * 4 > capacity) return;
+		CPU_PROFILE_ZONE("WaterSimulatorCPU::TrimPages");
+		int pages = std::max(used * 2, PAGE_POOL_MIN_PAGES + 1);
+
+		std::vector<int> holes;
+		for (int page = pages - 1; page > 0; page--) if (_page_tiles[page] < 0) holes.push_back(page);
+		for (int page = pages; page < capacity; page++) {
+			if (_page_tiles[page] < 0) continue;
+			int to = holes.back();
+			holes.pop_back();
+			if (encoding == PackedFragments) {
+				std::copy(_packed_A.begin() + (page * _page_size), _packed_A.begin() + ((page + 1) * _page_size), _packed_A.begin() + (to * _page_size));
+				std::copy(_packed_B.begin() + (page * _page_size), _packed_B.begin() + ((page + 1) * _page_size), _packed_B.begin() + (to * _page_size));
+			}
+			else {
+				_fragments_A.Move(to * _page_size, page * _page_size, _page_size);
+				_fragments_B.Move(to * _page_size, page * _page_size, _page_size);
+			}
+			_page_tiles[to] = _page_tiles[page];
+			_page_table[_page_tiles[to]] = to;
+		}
+
+		if (encoding == PackedFragments) {
+			_packed_A.resize((size_t)pages * _page_size);
+			_packed_A.shrink_to_fit();
+			_packed_B.resize((size_t)pages * _page_size);
+			_packed_B.shrink_to_fit();
+		}
+		else {
+			_fragments_A.Resize(pages * _page_size);
+			_fragments_A.ShrinkToFit();
+			_fragments_B.Resize(pages * _page_size);
+			_fragments_B.ShrinkToFit();
+		}
+		_page_tiles.resize(pages);
+		_free_pages = holes;
+	}
+
+	/*The eight neighbor offsets, in the same order the wave shader scans them.*/
+	static const int* GetCardinals() {
+		static const int cardinals[16] = { 1,0,  1,1,  0,1,  -1,1,  -1,0,  -1,-1,  0,-1,  1,-1 };
+		return cardinals;
+	}
+
+	static float Sign(float value) { return (value > 0.0f) ? 1.0f : ((value < 0.0f) ? -1.0f : 0.0f); }
+
+	/*Returns the energy of a fresh perturbation.  Matches GetPerturbationEnergy() in the shaders.*/
+	float GetPerturbationEnergy(float amplitude, float waveNumber) const {
+		float pg = density * gravity;
+		float sk2 = surfaceTension * waveNumber * waveNumber;
+		return (pg + sk2) * amplitude * amplitude / 2.0f;
+	}
+
+	/*Returns the energy at the given wave number and amplitude.  Matches GetEnergy() in the shaders, including its parameter order.*/
+	float GetEnergy(float waveNumber, float amplitude) const {
+		float pg = density * gravity;
+		float sk2 = surfaceTension * waveNumber * waveNumber;
+		return (pg + sk2) * amplitude * amplitude * 0.5f;
+	}
+
+	/*Points the lookup tables at the current depth and ebbing ratios, if they have changed.*/
+	void UpdateTables() {
+		_tanh_table.Build(depth);
+		_time_ebb_table.Build(amplitude_time_ebb);
+		_distance_ebb_table.Build(amplitude_distance_ebb);
+	}
+
+	/*Returns the celerity at the given wave number.*/
+	float GetCelerity(float waveNumber) const {
+		float gk = gravity / waveNumber;
+		float spk = surfaceTension * waveNumber / density;
+		float tanh_kd = _tanh_table.Evaluate(depth, waveNumber);
+		return std::sqrt((gk + spk) * tanh_kd) / scale;
+	}
+
+	float GetAmplitude(float originalAmplitude, float celerity, float traversal, float timePassed, float pTotal) const {
+		float solitonAmplitude = originalAmplitude * _time_ebb_table.Evaluate(amplitude_time_ebb, timePassed / celerity);
+		float solitonTraversal = soliton_speed * pTotal;
+		float distance = std::fabs(solitonTraversal - traversal);
+		if (traversal > solitonTraversal) {
+			distance = pTotal * (traversal - solitonTraversal) / (pTotal - solitonTraversal);
+		}
+		return solitonAmplitude * _distance_ebb_table.Evaluate(amplitude_distance_ebb, distance);
+	}
+
+	static float GetSemiManhattan(cy::Point2f straightVector) {
+		float abs_x = std::fabs(straightVector.x);
+		float abs_y = std::fabs(straightVector.y);
+		float min_xy = std::fmin(abs_x, abs_y);
+		return (min_xy * std::sqrt(2.0f)) + std::fmax(abs_x, abs_y) - min_xy;
+	}
+
+	static cy::Point3f GetNormal(cy::Point2f fromOrigin, float amplitude, float theta) {
+		float s = amplitude * std::sin(theta);
+		float delta_x, delta_y;
+
+		if (fromOrigin.x == 0.0f) {
+			delta_x = 0.0f;
+			delta_y = std::fabs(s);
+		}
+		else {
+			float ratio = fromOrigin.y / fromOrigin.x;
+			delta_x = (s*s) / (1.0f + (ratio * ratio));
+			delta_x = std::sqrt(delta_x);
+			delta_y = std::fabs(delta_x * ratio);
+		}
+
+		//With all the squaring, the signs get rather scrambled.
+		delta_x = delta_x * Sign(s) * Sign(fromOrigin.x);
+		delta_y = delta_y * Sign(s) * Sign(fromOrigin.y);
+		float delta_z = 1.0f;
+		float len = std::sqrt(delta_x * delta_x + delta_y * delta_y + delta_z * delta_z);
+		return cy::Point3f(delta_x / len, delta_y / len, delta_z / len);
+	}
+
+	/*Returns the index of the neighbor the given cell should propogate from, or -1 if the cell keeps its own fragment.  This is the
+	neighbor scan from main() in the wave shader.*/
+	int SelectNeighbor(int x, int y, int zLevel, const WaveFragmentPlanes& ins) const {
+		static const float rt = 1.0f / std::sqrt(2.0f);
+		static const float cardinals_normed[16] = { 1,0,  rt,rt,  0,1,  -rt,rt,  -1,0,  -rt,-rt,  0,-1,  rt,-rt };
+		const int* cardinals_i = GetCardinals();
+
+		int focusIdx = GetIndex(x, y, zLevel);
+		float reflection_x = ins.reflection_x[focusIdx], reflection_y = ins.reflection_y[focusIdx];
+
+		//The origins are compared where the window was when they were written.
+		float x_f = (float)(x + _window.shift_x), y_f = (float)(y + row_offset + _window.shift_y);
+
+		//Choose the most-energetic nearby fragment from which propogation could occur.
+		int chosenIdx = -1;
+		float chosenEnergy = ins.energy[focusIdx];
+		for (int c = 0; c < 8; c++) {
+			int n_x = x + cardinals_i[c * 2], n_y = y + cardinals_i[c * 2 + 1];
+
+			//Is this pixel off the board?
+			if (n_x < 0 || n_y < 0 || n_x == width || n_y == height) continue;
+
+			//Is this neighbor less energetic?
+			int n = GetIndex(n_x, n_y, zLevel);
+			if (ins.energy[n] <= chosenEnergy) continue;
+
+			//Is this focus too far for the neighbor to propogate to anyway?
+			float deltaTime = (float)(currentTime - ins.time_start[n]) / 1000.0f;
+			float pTotal = ins.celerity[n] * deltaTime;
+			cy::Point2f toOrigin(ins.origin_x[n] - x_f, ins.origin_y[n] - y_f);
+			if (std::sqrt(toOrigin.x * toOrigin.x + toOrigin.y * toOrigin.y) > pTotal) continue;
+
+			//Outside the fragment's range?
+			if (reflection_x != 0 || reflection_y != 0) {
+				float d = reflection_x * cardinals_normed[c * 2] + reflection_y * cardinals_normed[c * 2 + 1];
+				if (d > 0.0f) continue;
+			}
+
+			//Too far?
+			if (ins.traversal[n] > GetSemiManhattan(toOrigin) + 1) continue;
+
+			//After all checks, the neighbor can be a propogation source.
+			chosenIdx = c;
+			chosenEnergy = ins.energy[n];
+		}
+		return chosenIdx;
+	}
+
+#if defined(__AVX2__)
+	/*The vectorized neighbor scan:  runs SelectNeighbor() for the 8 cells starting at (x, y) at once, writing the chosen neighbor indices
+	to 'chosen'.  All eight cells and all of their neighbors must lie on the board, so the off-the-board test is skipped.  Each neighbor
+	direction is a contiguous unaligned load from the planes, so no gathers are needed, but the ten cells of each row the loads span must
+	lie one after another in storage (see GetContiguousCells()).*/
+	void SelectNeighbors8(int x, int y, int zLevel, const WaveFragmentPlanes& ins, int* chosen) const {
+		static const float rt = 1.0f / std::sqrt(2.0f);
+		static const float cardinals_normed[16] = { 1,0,  rt,rt,  0,1,  -rt,rt,  -1,0,  -rt,-rt,  0,-1,  rt,-rt };
+		const int* cardinals_i = GetCardinals();
+
+		int focusIdx = GetIndex(x, y, zLevel);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 root2 = _mm256_set1_ps(std::sqrt(2.0f));
+		const __m256 thousand = _mm256_set1_ps(1000.0f);
+		const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+		const __m256i timeNow = _mm256_set1_epi32(currentTime);
+		const __m256 xs = _mm256_add_ps(_mm256_set1_ps((float)(x + _window.shift_x)), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+		const __m256 ys = _mm256_set1_ps((float)(y + row_offset + _window.shift_y));
+
+		__m256 reflection_x = _mm256_loadu_ps(&ins.reflection_x[focusIdx]);
+		__m256 reflection_y = _mm256_loadu_ps(&ins.reflection_y[focusIdx]);
+		__m256 hasReflection = _mm256_or_ps(_mm256_cmp_ps(reflection_x, zero, _CMP_NEQ_UQ), _mm256_cmp_ps(reflection_y, zero, _CMP_NEQ_UQ));
+
+		__m256 chosenEnergy = _mm256_loadu_ps(&ins.energy[focusIdx]);
+		__m256i chosenIdx = _mm256_set1_epi32(-1);
+
+		for (int c = 0; c < 8; c++) {
+			int n = GetIndex(x + cardinals_i[c * 2], y + cardinals_i[c * 2 + 1], zLevel);
+			__m256 energy = _mm256_loadu_ps(&ins.energy[n]);
+
+			//Is this neighbor more energetic?  Written as !(energy <= chosen) so NaNs pass, as they do in the scalar scan.
+			__m256 accept = _mm256_cmp_ps(energy, chosenEnergy, _CMP_NLE_UQ);
+			if (_mm256_testz_ps(accept, accept)) continue;
+
+			//Is this focus close enough for the neighbor to propogate to?
+			__m256i timeStart = _mm256_loadu_si256((const __m256i*)&ins.time_start[n]);
+			__m256 deltaTime = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(timeNow, timeStart)), thousand);
+			__m256 pTotal = _mm256_mul_ps(_mm256_loadu_ps(&ins.celerity[n]), deltaTime);
+			__m256 toOrigin_x = _mm256_sub_ps(_mm256_loadu_ps(&ins.origin_x[n]), xs);
+			__m256 toOrigin_y = _mm256_sub_ps(_mm256_loadu_ps(&ins.origin_y[n]), ys);
+			__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(toOrigin_x, toOrigin_x), _mm256_mul_ps(toOrigin_y, toOrigin_y)));
+			accept = _mm256_and_ps(accept, _mm256_cmp_ps(length, pTotal, _CMP_NGT_UQ));
+
+			//Inside the fragment's range?
+			__m256 d = _mm256_add_ps(_mm256_mul_ps(reflection_x, _mm256_set1_ps(cardinals_normed[c * 2])), _mm256_mul_ps(reflection_y, _mm256_set1_ps(cardinals_normed[c * 2 + 1])));
+			accept = _mm256_andnot_ps(_mm256_and_ps(hasReflection, _mm256_cmp_ps(d, zero, _CMP_GT_OQ)), accept);
+
+			//Close enough?
+			__m256 abs_x = _mm256_and_ps(toOrigin_x, absMask);
+			__m256 abs_y = _mm256_and_ps(toOrigin_y, absMask);
+			__m256 min_xy = _mm256_min_ps(abs_x, abs_y);
+			__m256 semiManhattan = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(min_xy, root2), _mm256_max_ps(abs_x, abs_y)), min_xy);
+			__m256 traversal = _mm256_loadu_ps(&ins.traversal[n]);
+			accept = _mm256_and_ps(accept, _mm256_cmp_ps(traversal, _mm256_add_ps(semiManhattan, one), _CMP_NGT_UQ));
+
+			//The accepted lanes take this neighbor as their propogation source.
+			chosenEnergy = _mm256_blendv_ps(chosenEnergy, energy, accept);
+			chosenIdx = _mm256_blendv_epi8(chosenIdx, _mm256_set1_epi32(c), _mm256_castps_si256(accept));
+		}
+
+		_mm256_storeu_si256((__m256i*)chosen, chosenIdx);
+	}
+#endif
+
+	/*Flags the given storage tile and its neighbors to be run on the next step.  Once the window has scrolled off the storage's edge, the 
+	tiles on either side of that edge are neighbors too.*/
+	void MarkTileActive(int tile) {
+		int tx = tile % _tiles_x, ty = tile / _tiles_x;
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				int nx = tx + dx, ny = ty + dy;
+				if (_window.ring_x != 0) nx = (nx + _tiles_x) % _tiles_x;
+				if (_window.ring_y != 0) ny = (ny + _tiles_y) % _tiles_y;
+				if (nx < 0 || ny < 0 || nx >= _tiles_x || ny >= _tiles_y) continue;
+				_tile_flags[nx + (ny * _tiles_x)] = 1;
+			}
+		}
+	}
+
+	/*Steps every level of the cells [x0, x1) of the given row, and writes that span of the normal map.  Returns whether any of the cells
+	had moving water, before or after the step.*/
+	bool StepSpan(int y, int x0, int x1) {
+		cy::Point4f* pixels = &_normal_map[y * width];
+		for (int x = x0; x < x1; x++) pixels[x] = cy::Point4f(0, 0, 0, 0);
+
+		if (encoding == PackedFragments)
+			return StepSpanPacked(y, x0, x1, _in_A_out_B ? _packed_A : _packed_B, _in_A_out_B ? _packed_B : _packed_A, pixels);
+		const WaveFragmentPlanes& ins = _in_A_out_B ? _fragments_A : _fragments_B;
+		WaveFragmentPlanes& outs = _in_A_out_B ? _fragments_B : _fragments_A;
+
+		bool moving = false;
+		for (int zLevel = 0; zLevel < levels; zLevel++) {
+			int x = x0;
+#if defined(__AVX2__)
+			int chosen[8];
+			//Interior runs of 8 cells go through the vectorized scan.  The border cells are left to the scalar path.
+			if (use_simd && y > 0 && y < height - 1) {
+				if (x == 0) { moving |= StepCell(0, y, zLevel, SelectNeighbor(0, y, zLevel, ins), ins, outs, pixels[0]); x = 1; }
+				int xEnd = std::min(x1, width - 1);
+				while (x + 8 <= xEnd) {
+					//A run which would load across the ring's seam or a page's edge steps its first cell alone, and tries again.
+					if (GetContiguousCells(x - 1) < 10) {
+						moving |= StepCell(x, y, zLevel, SelectNeighbor(x, y, zLevel, ins), ins, outs, pixels[x]);
+						x++;
+						continue;
+					}
+					SelectNeighbors8(x, y, zLevel, ins, chosen);
+					for (int i = 0; i < 8; i++) moving |= StepCell(x + i, y, zLevel, chosen[i], ins, outs, pixels[x + i]);
+					x += 8;
+				}
+			}
+#endif
+			for (; x < x1; x++) moving |= StepCell(x, y, zLevel, SelectNeighbor(x, y, zLevel, ins), ins, outs, pixels[x]);
+		}
+		return moving;
+	}
+
+	/*Steps a single fragment from the given chosen neighbor (or from itself, if chosenIdx is -1), and adds its contribution to the given
+	normal map pixel.  Returns whether the cell had energy before or after the step.*/
+	bool StepCell(int x, int y, int zLevel, int chosenIdx, const WaveFragmentPlanes& ins, WaveFragmentPlanes& outs, cy::Point4f& pixelSum) const {
+		const int* cardinals_i = GetCardinals();
+
+		WaveFragment focus;
+		if (chosenIdx >= 0) {
+			focus = ins.Get(GetIndex(x + cardinals_i[chosenIdx * 2], y + cardinals_i[chosenIdx * 2 + 1], zLevel));
+			focus.traversal += (chosenIdx % 2 == 0) ? 1.0f : std::sqrt(2.0f);
+		}
+		else
+			focus = ins.Get(GetIndex(x, y, zLevel));
+		focus.origin.x -= (float)_window.shift_x;
+		focus.origin.y -= (float)_window.shift_y;
+		bool moving = ins.energy[GetIndex(x, y, zLevel)] > 0.0f;
+
+		AdvanceFragment(x, y, focus, pixelSum);
+		outs.Set(GetIndex(x, y, zLevel), focus);
+		return moving || (focus.energy > 0.0f);
+	}
+
+	/*Recomputes the energy of a packed fragment from its amplitude, as it was when the fragment was written at the time base.  A fresh
+	perturbation (stamped after the time base) is taken as not yet ebbed at all.*/
+	WaveFragment UnpackAt(const MappedVector<PackedWaveFragment>& ins, int x, int y, int zLevel) const {
+		WaveFragment f = UnpackFragment(ins[GetIndex(x, y, zLevel)], x, y + row_offset, _time_base);
+		cy::Point2f p = cy::Point2f((float)x, (float)(y + row_offset)) - f.origin;
+		float pTime = (float)std::max(_time_base - f.time_start, 0) / 1000.0f;
+		f.energy = GetEnergy(GetAmplitude(f.amplitude, f.celerity, p.Length(), pTime, f.celerity * pTime), f.wave_number);
+		return f;
+	}
+
+	/*The packed version of StepSpan().  The neighbor scan is the same as SelectNeighbor(), but runs on unpacked fragments.*/
+	bool StepSpanPacked(int y, int x0, int x1, const MappedVector<PackedWaveFragment>& ins, MappedVector<PackedWaveFragment>& outs, cy::Point4f* pixels) const {
+		static const float rt = 1.0f / std::sqrt(2.0f);
+		static const float cardinals_normed[16] = { 1,0,  rt,rt,  0,1,  -rt,rt,  -1,0,  -rt,-rt,  0,-1,  rt,-rt };
+		const int* cardinals_i = GetCardinals();
+
+		bool moving = false;
+		for (int zLevel = 0; zLevel < levels; zLevel++) {
+			for (int x = x0; x < x1; x++) {
+				WaveFragment focus = UnpackAt(ins, x, y, zLevel);
+				moving |= focus.energy > 0.0f;
+
+				int chosenIdx = -1;
+				WaveFragment chosen = focus;
+				for (int c = 0; c < 8; c++) {
+					int n_x = x + cardinals_i[c * 2], n_y = y + cardinals_i[c * 2 + 1];
+					if (n_x < 0 || n_y < 0 || n_x == width || n_y == height) continue;
+
+					WaveFragment neighbor = UnpackAt(ins, n_x, n_y, zLevel);
+					if (neighbor.energy <= chosen.energy) continue;
+
+					float deltaTime = (float)(currentTime - neighbor.time_start) / 1000.0f;
+					float pTotal = neighbor.celerity * deltaTime;
+					cy::Point2f toOrigin = neighbor.origin - cy::Point2f((float)x, (float)(y + row_offset));
+					if (toOrigin.Length() > pTotal) continue;
+
+					if (focus.reflection.x != 0 || focus.reflection.y != 0) {
+						float d = focus.reflection.x * cardinals_normed[c * 2] + focus.reflection.y * cardinals_normed[c * 2 + 1];
+						if (d > 0.0f) continue;
+					}
+
+					if (neighbor.traversal > GetSemiManhattan(toOrigin) + 1) continue;
+
+					chosenIdx = c;
+					chosen = neighbor;
+				}
+				if (chosenIdx >= 0) chosen.traversal += (chosenIdx % 2 == 0) ? 1.0f : std::sqrt(2.0f);
+
+				AdvanceFragment(x, y, chosen, pixels[x]);
+				outs[GetIndex(x, y, zLevel)] = PackFragment(chosen, x, y + row_offset, currentTime);
+				moving |= chosen.energy > 0.0f;
+			}
+		}
+		return moving;
+	}
+
+	/*Advances the given fragment, which has just propogated to (or stayed at) the given cell, and adds its contribution to the given normal
+	map pixel.  This is the remainder of main() in the wave shader.*/
+	void AdvanceFragment(int x, int y, WaveFragment& focus, cy::Point4f& pixelSum) const {
+		cy::Point2f xy_f((float)x, (float)(y + row_offset));
+
+		//Figure out if there is any reflection, and look for reflections or damping.
+		cy::Point2f p = xy_f - focus.origin;
+		float pTime = (float)(currentTime - focus.time_start) / 1000.0f;
+		float pDistance = p.Length();
+		float pTotal = focus.celerity * pTime;
+
+		const cy::Point4f& reflection = _reflection_map[x + (y * width)];
+		focus.amplitude *= reflection.z;		//reflection.z is damping multiplier.
+		float fragAmplitude = GetAmplitude(focus.amplitude, focus.celerity, pDistance, pTime, pTotal);
+		focus.energy = GetEnergy(fragAmplitude, focus.wave_number);
+		if (reflection.x != 0 || reflection.y != 0) {
+			cy::Point2f N(reflection.x, reflection.y);
+			cy::Point2f I = p * (1.0f / pDistance);
+			float d = I.Dot(N);
+			if (d < 0) {
+				cy::Point2f R = I - ((2 * d)*N);
+				R = R * (1.0f / R.Length());
+				focus.origin = xy_f - (R * pDistance);
+				focus.traversal = pDistance;
+			}
+		}
+
+		//Figure out the wave characteristics to write the normal map.
+		float timeOffset = (float)currentTime / 1000.0f;
+		if (fragAmplitude > 0.0f) {
+			float theta = (-timeOffset + pDistance + focus.phase_offset);
+			float height = fragAmplitude * -std::cos(theta);
+			cy::Point3f n = GetNormal(p, fragAmplitude, theta);
+			pixelSum = cy::Point4f(pixelSum.x + n.x, pixelSum.y + n.y, pixelSum.z + n.z, pixelSum.w + height);
+		}
+		else {
+			pixelSum = cy::Point4f(pixelSum.x, pixelSum.y, pixelSum.z + 1.0f, pixelSum.w);	//Still water.
+		}
+	}
+
+};
+
+
+#endif
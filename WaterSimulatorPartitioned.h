@@ -0,0 +1,548 @@
+#ifndef _WATER_SIMULATOR_PARTITIONED_H	//Not all compilers allow "#pragma once"
+#define _WATER_SIMULATOR_PARTITIONED_H
+
+#if !defined(_WIN32)
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <stdexcept>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "WaterSimulatorCPU.h"
+#include "PerturbationLog.h"
+#include "SimulationStats.h"
+
+#define PARTITION_MAX_PERTURBATIONS	1024
+
+
+/*A barrier for processes which share the memory it is in.  The last process to arrive bumps the generation, and the others sleep on it
+with a futex (or, where there are none, yield until it changes).  Neither member may be moved once the processes are running.*/
+struct SharedBarrier {
+	std::atomic<int> arrived;
+	std::atomic<int> generation;
+	int count;
+
+	/*Blocks until count processes have called this.  Every 100ms while it waits, it calls alive(), and gives up if that returns false or
+	if another process has set the failed flag.  Returns whether every process arrived.*/
+	template <typename F>
+	bool Wait(std::atomic<int>& failed, F alive) {
+		int seen = generation.load(std::memory_order_acquire);
+		if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+			arrived.store(0, std::memory_order_relaxed);
+			generation.fetch_add(1, std::memory_order_release);
+			Wake(generation);
+			return failed.load() == 0;
+		}
+
+		//A step is short, so spin a little before going to sleep.
+		for (int spin = 0; spin < 2000 && generation.load(std::memory_order_acquire) == seen; spin++) std::this_thread::yield();
+		while (generation.load(std::memory_order_acquire) == seen) {
+			if (failed.load() != 0) return false;
+			Sleep(generation, seen, 100);
+			if (!alive()) {
+				failed.store(1);
+				return false;
+			}
+		}
+		return failed.load() == 0;
+	}
+
+	static_assert(sizeof(std::atomic<int>) == sizeof(int), "The futex calls need std::atomic<int> to be a plain int.");
+
+	/*Sleeps until the word is woken, if it still holds the given value, or until the given time has passed.*/
+	static void Sleep(std::atomic<int>& word, int value, int milliseconds) {
+#if defined(__linux__)
+		struct timespec timeout = { milliseconds / 1000, (milliseconds % 1000) * 1000000L };
+		syscall(SYS_futex, (int*)&word, FUTEX_WAIT, value, &timeout, nullptr, 0);
+#else
+		(void)word; (void)value; (void)milliseconds;
+		sched_yield();
+#endif
+	}
+
+	/*Wakes every process sleeping on the word.*/
+	static void Wake(std::atomic<int>& word) {
+#if defined(__linux__)
+		syscall(SYS_futex, (int*)&word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+		(void)word;
+#endif
+	}
+};
+
+
+/*Runs one simulation, too large for one process, as horizontal strips in several worker processes.  Each worker steps its own strip
+with a WaterSimulatorCPU (and its own thread pool), plus a halo row on either side which is a copy of the neighbor's edge row.  After each
+step, the workers swap their edge rows through POSIX shared memory, and meet at a futex barrier, so that every strip reads exactly the
+fragments a single simulator would and the result is the same to the bit.  The normal map is stitched in shared memory too, with each
+worker writing its own rows of it at the end of every call, so this process never holds more of the simulation than that map.
+
+This process only coordinates:  every call sends a command to the workers and waits for them all to finish it.  The workers are forked
+by the constructor, so it is best made before any other threads are started, and is only available on POSIX systems.  Only the edge rows
+cross between processes, so the same commands and halo swaps could later run over a socket between machines.  The window cannot scroll.
+If a worker dies, every later call returns false (or empty statistics).*/
+class WaterSimulatorPartitioned {
+
+public:
+
+	const int width;
+	const int height;
+	const int levels;
+	float gravity = 9.8f;
+	float surfaceTension = 1.0f;
+	float density = 1.0f;
+	float depth = 10.0f;
+	float amplitude_time_ebb = 0.5f;
+	float amplitude_distance_ebb = 0.3f;
+	float soliton_speed = 0.75f;
+	const float scale;
+
+	/*The time since the start of the simulation, in milliseconds.*/
+	int currentTime = 0;
+	int runCount = 0;
+
+	/*These are handed to every worker's simulator before each command; see WaterSimulatorCPU.*/
+	int row_grain = 4;
+	bool use_simd = true;
+	bool sparse_tiles = false;
+	int stream_band_rows = 64;
+	int stream_depth = 4;
+	int stream_lookahead = 2;
+	float stats_active_amplitude = 0.001f;
+
+	/*If set, every accepted perturbation is appended to this log, tagged with the step it precedes.*/
+	PerturbationLog* recorder = nullptr;
+
+	const FragmentEncoding encoding;
+	const FragmentStorage storage;
+
+
+	/*Splits a simulator of the given size into the given number of strips, as even as they can be, each run by a worker process with
+	the given number of threads.  A thread count of 0 or less shares the hardware threads out among the workers.  The workers' fragments
+	are kept in the given storage, with mapped storage putting its files in the given directory.  Throws std::bad_alloc if the shared
+	memory cannot be made, and std::runtime_error if the workers cannot be started.*/
+	WaterSimulatorPartitioned(int width, int height, int levels, int processes, float scale = 10.0f, int threadCount = 0,
+		FragmentEncoding encoding = FullFragments, FragmentStorage storage = DenseStorage, const std::string& mappedDirectory = "")
+		: width(width), height(height), levels(levels), scale(scale), encoding(encoding), storage(storage), _mapped_directory(mappedDirectory) {
+		processes = std::max(1, std::min(processes, height));
+		if (threadCount <= 0) threadCount = std::max(1, (int)std::thread::hardware_concurrency() / processes);
+		_threads_per_process = threadCount;
+		for (int i = 0; i < processes; i++) _strips.push_back({ (height * i) / processes, (height * (i + 1)) / processes });
+
+		//Lay out the shared memory:  the control block, then two edge rows of each worker for each of two steps, then each worker's
+		//statistics, then the normal map.
+		_row_bytes = (size_t)width * levels * ((encoding == PackedFragments) ? sizeof(PackedWaveFragment) : sizeof(WaveFragment));
+		_halo_offset = Align(sizeof(PartitionControl));
+		_stats_offset = Align(_halo_offset + (_row_bytes * 4 * processes));
+		_normal_offset = _stats_offset + (GetReportBytes() * processes);
+		_shared_bytes = _normal_offset + (sizeof(cy::Point4f) * width * height);
+		MapShared();
+
+		_control->command_barrier.count = processes + 1;
+		_control->halo_barrier.count = processes;
+		cy::Point4f* normals = GetNormalMapPointer();
+		for (int i = 0; i < width * height; i++) normals[i] = cy::Point4f(0, 0, (float)levels, 0);
+
+		_coordinator = getpid();
+		for (int i = 0; i < processes; i++) {
+			pid_t pid = fork();
+			if (pid == 0) WorkerMain(i);
+			if (pid < 0) {
+				_control->failed.store(1);
+				Shutdown();
+				throw std::runtime_error("Could not start the simulation's worker processes.");
+			}
+			_workers.push_back(pid);
+		}
+	}
+
+	~WaterSimulatorPartitioned() {
+		Shutdown();
+	}
+
+	WaterSimulatorPartitioned(const WaterSimulatorPartitioned&) = delete;
+	WaterSimulatorPartitioned& operator=(const WaterSimulatorPartitioned&) = delete;
+
+
+	bool Perturb(cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
+		//The location is in cells:  every worker writes the fragment at it directly.
+		if (location.x < 0 || location.x >= width) return false;
+		if (location.y < 0 || location.y >= height) return false;
+		if (level < 0 || level >= levels) return false;
+		if (waveNumber <= 0.0f) return false;
+		if (amplitude <= 0.0f) return false;
+
+		if (recorder != nullptr) recorder->Record(runCount, location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+		PerturbationRecord r = { (unsigned int)runCount, timeStamp, location.x, location.y, level, origin.x, origin.y, waveNumber, amplitude, phase_offset };
+		_perturbations.push_back(r);
+		return true;
+	}
+
+	bool PerturbPoint(cy::Point2f location, int level, float waveNumber, float amplitude, unsigned int timeStamp, float phase_offset = 0.0f) {
+		cy::Point2f origin = scale * cy::Point2f(location.x, location.y);
+		return Perturb(location, level, origin, waveNumber, amplitude, timeStamp, phase_offset);
+	}
+
+	bool Execute(int elapsedTime) { return ExecuteSteps(1, elapsedTime); }
+
+	/*Runs the given number of steps of the given length, with the same result as that many calls to Execute(), but with the workers
+	only meeting this process once.  Each step still swaps the halos.*/
+	bool ExecuteSteps(int steps, int elapsedTime) {
+		if (steps <= 0) return true;
+		CPU_PROFILE_ZONE("WaterSimulatorPartitioned::ExecuteSteps");
+		if (!RunCommand(StepCommand, steps, elapsedTime)) return false;
+		currentTime += steps * elapsedTime;
+		runCount += steps;
+		return true;
+	}
+
+	void Clear() { RunCommand(ClearCommand); }
+
+	/*Has every worker copy its strip aside, replacing any earlier snapshot.  Pending perturbations are not part of the snapshot.*/
+	void Snapshot() {
+		if (!RunCommand(SnapshotCommand)) return;
+		_snapshot_time = currentTime;
+		_snapshot_run_count = runCount;
+		_has_snapshot = true;
+	}
+
+	/*Rolls the simulation back to the last snapshot, including its clock.  Returns false if no snapshot has been taken.*/
+	bool Restore() {
+		if (!_has_snapshot || !RunCommand(RestoreCommand)) return false;
+		currentTime = _snapshot_time;
+		runCount = _snapshot_run_count;
+		return true;
+	}
+
+	void SetObstacles(bool border, bool square, bool bar) { SetReflections(WaterSimulatorCPU::BuildObstacles(width, height, border, square, bar)); }
+
+	/*Sets the reflection map, which must hold width*height texels.  It is handed to the workers through the normal map's memory.*/
+	void SetReflections(const std::vector<cy::Point4f>& reflections) {
+		if ((int)reflections.size() != width * height) return;
+		std::copy(reflections.begin(), reflections.end(), GetNormalMapPointer());
+		RunCommand(ReflectionsCommand);
+	}
+
+	/*Returns the normal map, as RGBA floats in row-major order, stitched together from the workers' strips.  See WaterSimulatorCPU.*/
+	const float* GetNormalMapData() const { return &GetNormalMapPointer()->x; }
+	const cy::Point4f* GetNormalMap() const { return GetNormalMapPointer(); }
+
+	/*Samples the water's height and normal at each of the given points, as WaterSimulatorCPU::QueryBatch() does, from the stitched map.*/
+	void QueryBatch(const std::vector<cy::Point2f>& points, std::vector<WaterSample>& samples) {
+		samples.resize(points.size());
+		for (size_t i = 0; i < points.size(); i++) samples[i] = WaterSimulatorCPU::SampleNormalMap(GetNormalMapPointer(), width, height, points[i]);
+	}
+
+	/*Has each worker reduce its own rows to their statistics, and adds them up.*/
+	SimulationStats ComputeStats() {
+		SimulationStats stats;
+		if (!RunCommand(StatsCommand)) return stats;
+		stats.run_count = runCount;
+		stats.time = GetReport(0).time;
+		stats.levels.assign(levels, LevelStats());
+		for (int z = 0; z < levels; z++) {
+			LevelStats& level = stats.levels[z];
+			level.min_x = width;
+			level.min_y = height;
+			for (int i = 0; i < GetProcessCount(); i++) {
+				const LevelStats& strip = GetLevelStats(i)[z];
+				level.total_energy += strip.total_energy;
+				level.max_amplitude = std::max(level.max_amplitude, strip.max_amplitude);
+				if (strip.active_cells == 0) continue;
+				level.active_cells += strip.active_cells;
+				level.min_x = std::min(level.min_x, strip.min_x);
+				level.min_y = std::min(level.min_y, strip.min_y);
+				level.max_x = std::max(level.max_x, strip.max_x);
+				level.max_y = std::max(level.max_y, strip.max_y);
+			}
+			if (level.active_cells == 0) { level.min_x = 0; level.min_y = 0; }
+		}
+		return stats;
+	}
+
+	int GetProcessCount() const { return (int)_strips.size(); }
+
+	/*Returns the number of threads used to step the simulation, across every worker.*/
+	int GetThreadCount() const { return _threads_per_process * GetProcessCount(); }
+
+	/*Returns the first row of the given worker's strip, and the row after its last.*/
+	int GetStripStart(int process) const { return _strips[process].y0; }
+	int GetStripEnd(int process) const { return _strips[process].y1; }
+
+	/*The window never scrolls.*/
+	int GetWindowX() const { return 0; }
+	int GetWindowY() const { return 0; }
+
+	/*Returns the pages lent, the pages the pools have room for, and the bytes of files mapped, across every worker, as of the last
+	command.  See WaterSimulatorCPU.*/
+	int GetPageCount() const { int total = 0; for (int i = 0; i < GetProcessCount(); i++) total += GetReport(i).pages; return total; }
+	int GetPageCapacity() const { int total = 0; for (int i = 0; i < GetProcessCount(); i++) total += GetReport(i).page_capacity; return total; }
+	size_t GetMappedBytes() const { size_t total = 0; for (int i = 0; i < GetProcessCount(); i++) total += GetReport(i).mapped_bytes; return total; }
+
+	/*Returns false once a worker has died, after which nothing more can be run.*/
+	bool IsHealthy() const { return _control != nullptr && _control->failed.load() == 0; }
+
+
+private:
+
+	enum Command { StepCommand, ClearCommand, SnapshotCommand, RestoreCommand, ReflectionsCommand, StatsCommand, StopCommand };
+
+	/*The parameters handed to the workers' simulators with each command.*/
+	struct PartitionParameters {
+		float gravity, surfaceTension, density, depth, amplitude_time_ebb, amplitude_distance_ebb, soliton_speed, stats_active_amplitude;
+		int row_grain, stream_band_rows, stream_depth, stream_lookahead;
+		bool use_simd, sparse_tiles;
+	};
+
+	/*The start of the shared memory.  The command and its arguments are only written by this process, between commands.*/
+	struct PartitionControl {
+		SharedBarrier command_barrier;		//This process and every worker:  once to start a command, and once to finish it.
+		SharedBarrier halo_barrier;			//Every worker:  once per step, between writing their edge rows and reading their neighbors'.
+		std::atomic<int> failed;
+		int command;
+		int steps;
+		int elapsed_time;
+		PartitionParameters parameters;
+		int perturbation_count;
+		PerturbationRecord perturbations[PARTITION_MAX_PERTURBATIONS];
+	};
+
+	/*What each worker reports back after every command, followed in the shared memory by its statistics for each level.*/
+	struct WorkerReport {
+		int time;
+		int pages;
+		int page_capacity;
+		size_t mapped_bytes;
+	};
+
+	/*The rows [y0, y1) of a worker's strip.*/
+	struct Strip {
+		int y0, y1;
+	};
+
+	std::vector<Strip> _strips;
+	std::vector<pid_t> _workers;
+	pid_t _coordinator = 0;
+	int _threads_per_process = 1;
+	std::string _mapped_directory;
+
+	std::vector<PerturbationRecord> _perturbations;
+	bool _has_snapshot = false;
+	int _snapshot_time = 0;
+	int _snapshot_run_count = 0;
+
+	unsigned char* _shared = nullptr;
+	PartitionControl* _control = nullptr;
+	size_t _shared_bytes = 0;
+	size_t _row_bytes = 0;
+	size_t _halo_offset = 0;
+	size_t _stats_offset = 0;
+	size_t _normal_offset = 0;
+
+
+	static size_t Align(size_t offset) { return (offset + 63) / 64 * 64; }
+
+	/*Makes the shared memory, which the workers inherit when they are forked.  Its name is unlinked at once, so that nothing is left
+	behind however the processes end.*/
+	void MapShared() {
+		static std::atomic<int> counter(0);
+		std::string name = "/water_partition_" + std::to_string((long)getpid()) + "_" + std::to_string(counter++);
+		int file = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (file < 0) throw std::bad_alloc();
+		shm_unlink(name.c_str());
+		void* address = MAP_FAILED;
+		if (ftruncate(file, (off_t)_shared_bytes) == 0) address = mmap(nullptr, _shared_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		close(file);
+		if (address == MAP_FAILED) throw std::bad_alloc();
+		_shared = (unsigned char*)address;
+		_control = new(_shared) PartitionControl();
+	}
+
+	unsigned char* GetEdgeRow(int process, bool bottom, int parity) const { return _shared + _halo_offset + (_row_bytes * ((process * 4) + (bottom ? 2 : 0) + parity)); }
+	size_t GetReportBytes() const { return Align(sizeof(WorkerReport) + (sizeof(LevelStats) * levels)); }
+	WorkerReport& GetReport(int process) const { return *(WorkerReport*)(_shared + _stats_offset + (GetReportBytes() * process)); }
+	LevelStats* GetLevelStats(int process) const { return (LevelStats*)((unsigned char*)&GetReport(process) + sizeof(WorkerReport)); }
+	cy::Point4f* GetNormalMapPointer() const { return (cy::Point4f*)(_shared + _normal_offset); }
+
+	/*Returns whether every worker is still running.  A worker which has ended is reaped here.*/
+	bool WorkersAlive() {
+		for (pid_t& pid : _workers) {
+			if (pid <= 0) continue;
+			int status;
+			if (waitpid(pid, &status, WNOHANG) == pid) {
+				pid = -1;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*Sends the given command to the workers, with the parameters (and, with a step, the pending perturbations), and waits for them all to
+	finish it.  Perturbations beyond what one command can carry go ahead in steps of their own, which run no steps.*/
+	bool RunCommand(int command, int steps = 0, int elapsedTime = 0) {
+		size_t sent = 0;
+		if (command == StepCommand) {
+			for (; _perturbations.size() - sent > PARTITION_MAX_PERTURBATIONS; sent += PARTITION_MAX_PERTURBATIONS)
+				if (!SendCommand(StepCommand, 0, 0, sent, PARTITION_MAX_PERTURBATIONS)) return false;
+		}
+		int count = (command == StepCommand) ? (int)(_perturbations.size() - sent) : 0;
+		if (!SendCommand(command, steps, elapsedTime, sent, count)) return false;
+		if (command == StepCommand) _perturbations.clear();
+		return true;
+	}
+
+	bool SendCommand(int command, int steps, int elapsedTime, size_t firstPerturbation, int perturbationCount) {
+		if (!IsHealthy()) return false;
+		_control->command = command;
+		_control->steps = steps;
+		_control->elapsed_time = elapsedTime;
+		_control->parameters = { gravity, surfaceTension, density, depth, amplitude_time_ebb, amplitude_distance_ebb, soliton_speed, stats_active_amplitude,
+			row_grain, stream_band_rows, stream_depth, stream_lookahead, use_simd, sparse_tiles };
+		std::copy(_perturbations.begin() + firstPerturbation, _perturbations.begin() + firstPerturbation + perturbationCount, _control->perturbations);
+		_control->perturbation_count = perturbationCount;
+
+		auto alive = [this] { return WorkersAlive(); };
+		return _control->command_barrier.Wait(_control->failed, alive) && _control->command_barrier.Wait(_control->failed, alive);
+	}
+
+	/*Stops the workers, or kills them if they can no longer be stopped, and unmaps the shared memory.*/
+	void Shutdown() {
+		if (_control == nullptr) return;
+		if (IsHealthy()) {
+			_control->command = StopCommand;
+			_control->command_barrier.Wait(_control->failed, [this] { return WorkersAlive(); });
+		}
+		if (!IsHealthy()) for (pid_t pid : _workers) if (pid > 0) kill(pid, SIGKILL);
+		for (pid_t pid : _workers) if (pid > 0) waitpid(pid, nullptr, 0);
+		_workers.clear();
+		_control->~PartitionControl();
+		munmap(_shared, _shared_bytes);
+		_shared = nullptr;
+		_control = nullptr;
+	}
+
+	/*The whole life of a worker process.  It never returns.*/
+	void WorkerMain(int process) {
+		int status = 0;
+		try {
+			RunWorker(process);
+		}
+		catch (...) {
+			_control->failed.store(1);
+			status = 1;
+		}
+		_exit(status);
+	}
+
+	void RunWorker(int process) {
+		const Strip& strip = _strips[process];
+		bool above = process > 0, below = process < GetProcessCount() - 1;
+
+		//The strip, with a halo row on either side where it has a neighbor.  Its rows are measured from the top of the whole grid.
+		int first = strip.y0 - (above ? 1 : 0), last = strip.y1 + (below ? 1 : 0);
+		WaterSimulatorCPU simulator(width, last - first, levels, scale, _threads_per_process, encoding, storage, _mapped_directory);
+		simulator.row_offset = first;
+		simulator.Clear();
+
+		auto alive = [this] { return getppid() == _coordinator; };
+		while (_control->command_barrier.Wait(_control->failed, alive)) {
+			int command = _control->command;
+			if (command == StopCommand) return;
+			const PartitionParameters& p = _control->parameters;
+			simulator.gravity = p.gravity;
+			simulator.surfaceTension = p.surfaceTension;
+			simulator.density = p.density;
+			simulator.depth = p.depth;
+			simulator.amplitude_time_ebb = p.amplitude_time_ebb;
+			simulator.amplitude_distance_ebb = p.amplitude_distance_ebb;
+			simulator.soliton_speed = p.soliton_speed;
+			simulator.stats_active_amplitude = p.stats_active_amplitude;
+			simulator.row_grain = p.row_grain;
+			simulator.stream_band_rows = p.stream_band_rows;
+			simulator.stream_depth = p.stream_depth;
+			simulator.stream_lookahead = p.stream_lookahead;
+			simulator.use_simd = p.use_simd;
+			simulator.sparse_tiles = p.sparse_tiles;
+
+			//Every strip holding the perturbed cell takes the perturbation, halos included, so that the copies stay the same.
+			for (int i = 0; i < _control->perturbation_count; i++) {
+				const PerturbationRecord& r = _control->perturbations[i];
+				int y = (int)r.location_y;
+				if (y < first || y >= last) continue;
+				simulator.Perturb(cy::Point2f(r.location_x, r.location_y - (float)first), r.level, cy::Point2f(r.origin_x, r.origin_y), r.wave_number, r.amplitude, r.time_stamp, r.phase_offset);
+			}
+
+			bool ok = true;
+			switch (command) {
+			case StepCommand:
+				for (int step = 0; step < _control->steps && ok; step++) {
+					simulator.Execute(_control->elapsed_time);
+
+					//Swap the edge rows.  They alternate between two slots from step to step, so that a neighbor still reading the last
+					//step's rows is never written over.
+					int parity = simulator.runCount % 2;
+					if (above) simulator.ReadRow(strip.y0 - first, GetEdgeRow(process, false, parity));
+					if (below) simulator.ReadRow(strip.y1 - 1 - first, GetEdgeRow(process, true, parity));
+					ok = _control->halo_barrier.Wait(_control->failed, alive);
+					if (ok && above) simulator.WriteRow(0, GetEdgeRow(process - 1, true, parity));
+					if (ok && below) simulator.WriteRow(last - 1 - first, GetEdgeRow(process + 1, false, parity));
+				}
+				break;
+			case ClearCommand:
+				simulator.Clear();
+				break;
+			case SnapshotCommand:
+				simulator.Snapshot();
+				break;
+			case RestoreCommand:
+				simulator.Restore();
+				break;
+			case ReflectionsCommand: {
+				const cy::Point4f* reflections = GetNormalMapPointer();
+				simulator.SetReflections(std::vector<cy::Point4f>(reflections + (first * width), reflections + (last * width)));
+				//Every worker must have its rows before any of them puts its normal map back over them.
+				ok = _control->halo_barrier.Wait(_control->failed, alive);
+				break;
+			}
+			case StatsCommand: {
+				SimulationStats stats = simulator.ComputeStats(strip.y0 - first, strip.y1 - first);
+				std::copy(stats.levels.begin(), stats.levels.end(), GetLevelStats(process));
+				GetReport(process).time = stats.time;
+				break;
+			}
+			}
+			if (!ok) return;
+
+			//Stitch this strip's rows into the normal map, and report back.
+			std::copy(simulator.GetNormalMap().begin() + ((strip.y0 - first) * width), simulator.GetNormalMap().begin() + ((strip.y1 - first) * width),
+				GetNormalMapPointer() + (strip.y0 * width));
+			WorkerReport& report = GetReport(process);
+			report.pages = simulator.GetPageCount();
+			report.page_capacity = simulator.GetPageCapacity();
+			report.mapped_bytes = simulator.GetMappedBytes();
+
+			if (!_control->command_barrier.Wait(_control->failed, alive)) return;
+		}
+	}
+
+};
+
+
+#endif
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _WAVE_FRAGMENT_H	//Not all compilers allow "#pragma once"
+#define _WAVE_FRAGMENT_H
+
+#include <cstring>
+#include "cyPoint.h"
+
+/*The state of a single cell at a single frequency level.  The layout mirrors the WaveFragment struct the simulation compute shaders share
+(Shaders/waterSimPhysics.inclShdr.txt), so both the GPU buffers and the CPU engine can share it.*/
+struct WaveFragment {
+	cy::Point2f origin = cy::Point2f(0.0f, 0.0f);
+	float wave_number = 0.0f;
+	float amplitude = 0.0f;
+	int time_start = 0;
+	float phase_offset = 0.0f;
+	float energy = 0.0f;
+	float celerity = 0.0f;
+	cy::Point2f reflection = cy::Point2f(0.0f, 0.0f);
+	float traversal = 0.0f;
+	float unused;
+
+	WaveFragment(float originX, float originY, float waveNumber, float amplitude, int timeStart, float phase, float energy, float celerity, float traversal)
+		: origin(cy::Point2f(originX, originY)), wave_number(waveNumber), amplitude(amplitude), time_start(timeStart), phase_offset(phase), energy(energy), celerity(celerity), traversal(traversal) {}
+	WaveFragment() {}
+};
+
+/*A new wave fragment to be written into the simulation at the given cell and level.*/
+struct Perturbation {
+	cy::Point2f location;
+	int level;
+	/*The simulation of a WaterSimulatorBatch this perturbation is for.  Always 0 for a single simulator.*/
+	int instance = 0;
+	WaveFragment wave_fragment;
+	Perturbation(cy::Point2f location, int level, cy::Point2f origin, float waveNumber, float amplitude, int time_start, float phase, float energy, float celerity)
+		: location(location), level(level), wave_fragment(WaveFragment(origin.x, origin.y, waveNumber, amplitude, time_start, phase, energy, celerity, 0.0f)) {}
+	//Perturbation() : location(cy::Point2f(0, 0)), level(0), wave_fragment(WaveFragment()) {}
+};
+
+/*The water's height and surface normal at one point, as returned by the height queries.  Laid out as the vec4 the query shader writes 
+for each point:  the unit normal in x, y and z, and the height in w.*/
+struct WaterSample {
+	cy::Point3f normal = cy::Point3f(0.0f, 0.0f, 1.0f);
+	float height = 0.0f;
+};
+
+
+/*Members describe how wave fragments are stored.*/
+enum FragmentEncoding {
+	/*Each fragment is a full 48-byte WaveFragment.*/
+	FullFragments,
+	/*Each fragment is a 16-byte PackedWaveFragment, so three times as many fit in the same memory.*/
+	PackedFragments
+};
+
+/*A WaveFragment squeezed into 16 bytes, laid out as a uvec4 in the compute shaders:
+	x:  the origin's offset from the fragment's own cell, as two half floats.
+	y:  the amplitude and celerity, as two half floats.
+	z:  the wave number and phase offset, as two half floats.
+	w:  the traversal as a half float in the low 16 bits, and the age in milliseconds relative to a time base, as a signed 16-bit integer 
+		in the high 16 bits.
+The energy is not stored, but recomputed from the amplitude when the fragment is unpacked, and the reflection (which nothing writes) is 
+dropped.  Half floats carry about three significant digits, so origins more than a few hundred cells away lose sub-cell precision.  Ages 
+saturate at 32.767 seconds:  an older fragment unpacks as that old on every step, so its amplitude stops ebbing and its phase stops 
+advancing.  Whether anything is left of the wave by then depends on the time ebb, the celerity and the scale; at a scale of 1 with the 
+default ebb, a few percent of the amplitude remains, frozen.  Use FullFragments where waves must keep moving for longer.*/
+struct PackedWaveFragment {
+	unsigned int origin_offset;
+	unsigned int amplitude_celerity;
+	unsigned int wave_number_phase;
+	unsigned int traversal_age;
+};
+
+/*Converts a float to a half float, rounding to the nearest even value as packHalf2x16() does.*/
+inline unsigned short FloatToHalf(float value) {
+	unsigned int f;
+	std::memcpy(&f, &value, sizeof(f));
+	unsigned int sign = (f >> 16) & 0x8000;
+	unsigned int mantissa = f & 0x7FFFFF;
+	int exponent = (int)((f >> 23) & 0xFF) - 127 + 15;
+
+	if (((f >> 23) & 0xFF) == 0xFF) return (unsigned short)(sign | 0x7C00 | (mantissa ? 0x200 : 0));		//Infinity or NaN.
+	if (exponent >= 31) return (unsigned short)(sign | 0x7C00);											//Too big, so infinity.
+	if (exponent <= 0) {
+		//Too small for a normal half, so make a subnormal one (or zero).
+		if (exponent < -10) return (unsigned short)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		unsigned int remainder = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half & 1))) half++;
+		return (unsigned short)(sign | half);
+	}
+	unsigned int half = sign | ((unsigned int)exponent << 10) | (mantissa >> 13);
+	unsigned int remainder = mantissa & 0x1FFF;
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) half++;		//A carry into the exponent is the correct result.
+	return (unsigned short)half;
+}
+
+/*Converts a half float to a float.*/
+inline float HalfToFloat(unsigned short half) {
+	unsigned int sign = ((unsigned int)half & 0x8000) << 16;
+	unsigned int exponent = (half >> 10) & 0x1F;
+	unsigned int mantissa = half & 0x3FF;
+	unsigned int f;
+	if (exponent == 0) {
+		if (mantissa == 0) f = sign;
+		else {
+			//A subnormal half is a normal float, so normalize it.
+			exponent = 127 - 15 + 1;
+			while ((mantissa & 0x400) == 0) { mantissa <<= 1; exponent--; }
+			f = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+		}
+	}
+	else if (exponent == 31) f = sign | 0x7F800000 | (mantissa << 13);
+	else f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	float result;
+	std::memcpy(&result, &f, sizeof(result));
+	return result;
+}
+
+inline unsigned int PackHalf2(float low, float high) { return (unsigned int)FloatToHalf(low) | ((unsigned int)FloatToHalf(high) << 16); }
+inline float UnpackHalfLow(unsigned int packed) { return HalfToFloat((unsigned short)(packed & 0xFFFF)); }
+inline float UnpackHalfHigh(unsigned int packed) { return HalfToFloat((unsigned short)(packed >> 16)); }
+
+/*Packs the given fragment, which sits at the given cell, with its age measured from the given time stamp.*/
+inline PackedWaveFragment PackFragment(const WaveFragment& f, int cellX, int cellY, int timeStamp) {
+	int age = timeStamp - f.time_start;
+	if (age < -32768) age = -32768;
+	if (age > 32767) age = 32767;
+	PackedWaveFragment p;
+	p.origin_offset = PackHalf2(f.origin.x - (float)cellX, f.origin.y - (float)cellY);
+	p.amplitude_celerity = PackHalf2(f.amplitude, f.celerity);
+	p.wave_number_phase = PackHalf2(f.wave_number, f.phase_offset);
+	p.traversal_age = (unsigned int)FloatToHalf(f.traversal) | ((unsigned int)(age & 0xFFFF) << 16);
+	return p;
+}
+
+/*Unpacks the given fragment, which sits at the given cell, and whose age was measured from the given time base.  The energy is left at 
+zero, because recomputing it needs the simulation's parameters.*/
+inline WaveFragment UnpackFragment(const PackedWaveFragment& p, int cellX, int cellY, int timeBase) {
+	int age = (int)(short)(unsigned short)(p.traversal_age >> 16);
+	WaveFragment f((float)cellX + UnpackHalfLow(p.origin_offset), (float)cellY + UnpackHalfHigh(p.origin_offset),
+		UnpackHalfLow(p.wave_number_phase), UnpackHalfLow(p.amplitude_celerity), timeBase - age, UnpackHalfHigh(p.wave_number_phase),
+		0.0f, UnpackHalfHigh(p.amplitude_celerity), UnpackHalfLow(p.traversal_age));
+	return f;
+}
+
+
+#endif
@@ -14,12 +14,15 @@
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 #include <stdio.h>
+#include <random>
 #include "cytrimesh.h"
 #include "cyMatrix.h"
 #include "GraphicsWindow.h"
 #include "Passes.h"
 #include "wo.h"
 #include "WaterSimulator.h"
+#include "SimulationScheduler.h"
+#include "PerturbationLog.h"
 
 
 GraphicsWindow* main_window;
@@ -40,9 +43,23 @@ cy::Point2<int> mouse_point;
 float yaw = 0;
 float pitch = (float)(-PI / 2);
 char keysPressed = 0;
-auto lastRun = std::chrono::steady_clock::now();
+SimulationScheduler scheduler(30, 4);
 int raining = 0;
 
+/*The rain is drawn from its own seeded generator, so that a run can be repeated exactly.*/
+unsigned int rain_seed = 1;
+std::mt19937 rain_generator(rain_seed);
+
+/*Every perturbation made while recording, and the replayer which feeds a loaded log back in.*/
+PerturbationLog perturbation_log;
+PerturbationReplayer perturbation_replayer(perturbation_log);
+bool is_replaying = false;
+
+/*If set, the simulation pauses itself once the pond has settled:  once its total energy has fallen to settled_energy, having been above it.*/
+bool auto_pause = false;
+float settled_energy = 0.001f;
+bool pond_active = false;
+
 /*
 =====================================
 =			main.cpp				=
@@ -52,6 +69,16 @@ int raining = 0;
 
 
 
+/*Clears the simulation and rewinds its clocks and the rain, so that a recording or replay starts from the same state every time.*/
+void RestartRun() {
+	simulator->currentTime = 0;
+	simulator->runCount = 0;
+	simulator->Clear();
+	rain_generator.seed(rain_seed);
+	scheduler.Reset();
+}
+
+
 void AdjustView() {
 
 	cy::Point3f newLookDir = waterSurface->GetPosition() - main_window->camera.GetPosition();
@@ -90,9 +117,10 @@ void OnKeyDown(unsigned char key, int x, int y) {
 	else if (key == ' ') {
 
 		static auto sim_started = std::chrono::steady_clock::now();
+		static int runs_started = 0;
 
 		if (is_paused) {
-			simulator->runCount = 0;
+			runs_started = simulator->runCount;
 			sim_started = std::chrono::steady_clock::now();
 			std::cout << "Simulation started." << std::endl;
 		}
@@ -100,14 +128,69 @@ void OnKeyDown(unsigned char key, int x, int y) {
 			auto sim_ended = std::chrono::steady_clock::now();
 			int milliSeconds = std::chrono::duration_cast<std::chrono::milliseconds>(sim_ended - sim_started).count();
 			float seconds = milliSeconds / 1000.0f;
-			std::cout << simulator->runCount << " runs in " << milliSeconds << " milliseconds = " << (float)milliSeconds / (float)simulator->runCount << " ms/frame, or " << (float)simulator->runCount / seconds << " FPS." << std::endl;
+			int runs = simulator->runCount - runs_started;
+			std::cout << runs << " runs in " << milliSeconds << " milliseconds = " << (float)milliSeconds / (float)runs << " ms/frame, or " << (float)runs / seconds << " FPS." << std::endl;
+			std::cout << scheduler.GetSimulatedTime() << " ms simulated in " << scheduler.GetWallTime() << " ms, drift " << scheduler.GetDrift() << " ms (" << scheduler.GetDroppedTime() << " ms dropped by the catch-up cap)." << std::endl;
 		}
 		is_paused = !is_paused;
-		if (is_paused) lastRun = std::chrono::steady_clock::now();
+		if (!is_paused) scheduler.Reset();
 	}
 	else if (key == 'R') { if (raining < 10) raining++;		std::cout << "Rain set to " << raining << std::endl; }
 	else if (key == 'r') { if (raining > 0) raining--;		std::cout << "Rain set to " << raining << std::endl; }
 	else if (key == 'c') { simulator->Clear(); }
+	else if (key == 'z') {
+		auto_pause = !auto_pause;
+		simulator->compute_stats = auto_pause;
+		pond_active = false;
+		std::cout << "Auto-pause " << (auto_pause ? "on." : "off.") << std::endl;
+	}
+	else if (key == 'g') {
+		//Start or stop recording.  A recording starts from a cleared simulation, so it can be replayed from one.
+		if (simulator->recorder == nullptr) {
+			is_replaying = false;
+			perturbation_log.Clear();
+			RestartRun();
+			simulator->recorder = &perturbation_log;
+			std::cout << "Recording perturbations." << std::endl;
+		}
+		else {
+			simulator->recorder = nullptr;
+			if (perturbation_log.Save("perturbations.plog")) std::cout << "Saved " << perturbation_log.Size() << " perturbations to perturbations.plog." << std::endl;
+			else std::cout << "Could not save perturbations.plog." << std::endl;
+		}
+	}
+	else if (key == 'v') {
+		//Toggle GPU profiling of the passes and the simulation.
+		static GpuProfiler profiler;
+		if (gpu_profiler == nullptr) { profiler.Reset(); gpu_profiler = &profiler; std::cout << "GPU profiling on." << std::endl; }
+		else { gpu_profiler = nullptr; std::cout << "GPU profiling off." << std::endl; }
+	}
+	else if (key == 'V') {
+		if (gpu_profiler == nullptr) std::cout << "GPU profiling is off." << std::endl;
+		else if (gpu_profiler->WriteCSV("gpu_profile.csv") && gpu_profiler->WriteJSON("gpu_profile.json")) std::cout << "Wrote gpu_profile.csv and gpu_profile.json." << std::endl;
+		else std::cout << "Could not write the GPU profile." << std::endl;
+	}
+	else if (key == 'b') {
+		//Toggle CPU profiling.  Turning it on starts a fresh trace.
+		if (!CpuProfiler::IsEnabled()) { CpuProfiler::Reset(); CpuProfiler::SetEnabled(true); std::cout << "CPU profiling on." << std::endl; }
+		else { CpuProfiler::SetEnabled(false); std::cout << "CPU profiling off." << std::endl; }
+	}
+	else if (key == 'B') {
+		if (CpuProfiler::WriteChromeTrace("cpu_trace.json")) std::cout << "Wrote cpu_trace.json." << std::endl;
+		else std::cout << "Could not write cpu_trace.json." << std::endl;
+	}
+	else if (key == 'x') { GLDiagnostics::WriteReport(std::cout); }
+	else if (key == 'h') {
+		//Replay the last saved recording from a cleared simulation.  The rain is left off, since the recording holds the drops.
+		simulator->recorder = nullptr;
+		if (perturbation_log.Load("perturbations.plog")) {
+			RestartRun();
+			perturbation_replayer.Rewind();
+			is_replaying = true;
+			std::cout << "Replaying " << perturbation_log.Size() << " perturbations." << std::endl;
+		}
+		else std::cout << "Could not load perturbations.plog." << std::endl;
+	}
 	else if (key == 'F') { simulator->depth *= 1.2f;		simulator->depth = fminf(simulator->depth, 100.0f);		waterMaterial->depth = simulator->depth / 10.0f;		std::cout << "Depth set to " << simulator->depth << std::endl; }
 	else if (key == 'f') { simulator->depth *= 0.8f;		simulator->depth = fmaxf(simulator->depth, 0.01f);		waterMaterial->depth = simulator->depth / 10.0f;		std::cout << "Depth set to " << simulator->depth << std::endl; }
 	else if (key == 'O') {
@@ -153,6 +236,18 @@ void OnKeyDown(unsigned char key, int x, int y) {
 	else if (key == 'y') {
 		if (simulator->amplitude_distance_ebb > 0.0f) { simulator->amplitude_distance_ebb -= 0.05f; std::cout << "Distance ebbing ratio set to " << simulator->amplitude_distance_ebb << std::endl; }
 	}
+	else if (key == 'k') {
+		simulator->wave_kernel = (simulator->wave_kernel == WaterSimulator::Tiled) ? WaterSimulator::Standard : WaterSimulator::Tiled;
+		std::cout << "Wave kernel set to " << ((simulator->wave_kernel == WaterSimulator::Tiled) ? "tiled" : "standard") << std::endl;
+	}
+	else if (key == 'l') {
+		simulator->fuse_levels = !simulator->fuse_levels;
+		std::cout << "Level dispatches " << (simulator->fuse_levels ? "fused" : "serial") << std::endl;
+	}
+	else if (key == 'j') {
+		simulator->sparse_tiles = !simulator->sparse_tiles;
+		std::cout << "Sparse tile scheduling " << (simulator->sparse_tiles ? "on" : "off") << std::endl;
+	}
 	else if (key == 'U') { if (simulator->soliton_speed < 1.0f) { simulator->soliton_speed += 0.05f; std::cout << "Soliton speed ratio set to " << simulator->soliton_speed << std::endl; } }
 	else if (key == 'u') { if (simulator->soliton_speed > 0.0f) { simulator->soliton_speed -= 0.05f; std::cout << "Soliton speed ratio set to " << simulator->soliton_speed << std::endl; } }
 
@@ -232,29 +327,14 @@ void OnMouseMoveInput(int x, int y) {
 }
 
 
-void OnIdle() {
-	const int  milliseconds_per_tick = 30;
-
-	static auto runStart = std::chrono::steady_clock::now();
-
-	//Do nothing if not enough time has passed.
-	if (is_paused) return;
-
-	
-
-	auto currentTime = std::chrono::steady_clock::now();
-	int elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - lastRun).count();
-	if (elapsed_time < milliseconds_per_tick) return;
-	elapsed_time = milliseconds_per_tick;
-	int total_time = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - runStart).count();
-
-	//Add a raindrop?
+/*Adds a raindrop, perhaps, depending on how hard it is raining.*/
+void MakeRain() {
 	if (raining > 0) {
-		int rain_yes = rand() % 20;
+		int rain_yes = rain_generator() % 20;
 		if (rain_yes < raining) {
-			int r_x = rand() % simulator->width;
-			int r_y = rand() % simulator->height;
-			float phase_offset = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX / PI));
+			int r_x = rain_generator() % simulator->width;
+			int r_y = rain_generator() % simulator->height;
+			float phase_offset = std::uniform_real_distribution<float>(0.0f, (float)PI)(rain_generator);
 			//int r_level_mask = rand();
 			for (int i = 0; i < simulator->levels; i++) {
 				int mask = 1 << i;
@@ -264,11 +344,38 @@ void OnIdle() {
 			}
 		}
 	}
+}
 
-	simulator->Execute(elapsed_time);
-	glutPostRedisplay();
 
-	lastRun = std::chrono::steady_clock::now();
+void OnIdle() {
+	//While paused, sleep a step at a time, and don't bank the time.
+	if (is_paused) {
+		scheduler.Hold();
+		std::this_thread::sleep_for(std::chrono::milliseconds(scheduler.step_milliseconds));
+		return;
+	}
+
+	//Run as many fixed steps as are due, then sleep until the next is due rather than spinning.
+	int steps = scheduler.Advance([](int stepTime) {
+		if (is_replaying) {
+			perturbation_replayer.Feed(*simulator);
+			if (perturbation_replayer.IsFinished()) { is_replaying = false; std::cout << "Replay finished." << std::endl; }
+		}
+		else MakeRain();
+		simulator->Execute(stepTime);
+	});
+	if (steps > 0) glutPostRedisplay();
+	else scheduler.WaitForNextStep();
+
+	SimulationStats stats;
+	if (auto_pause && steps > 0 && simulator->GetStats(stats)) {
+		if (!stats.IsSettled(settled_energy)) pond_active = true;
+		else if (pond_active && !is_replaying && raining == 0) {
+			pond_active = false;
+			is_paused = true;
+			std::cout << "The pond settled after run " << stats.run_count << ", at " << stats.time << " ms.  Paused." << std::endl;
+		}
+	}
 }
 GLuint frameBufferName = 0;
 GLuint renderTextureName = 0;
@@ -284,8 +391,9 @@ GLuint depthBufferName = 0;
 int main(int argc, char **argv) {
 
 	//STEP #1, file operations to get the object at the filename given at the command line.
-	if (argc != 2) throw std::exception("Program must be executed with exactly one command line parameter specifying the object file to load.");
+	if (argc != 2 && argc != 3) throw std::exception("Program must be executed with the object file to load, and optionally the file to cache the wave work group size in.");
 	char* filename = argv[1];
+	const char* workGroupCacheFilename = (argc == 3) ? argv[2] : WORK_GROUP_CACHE_FILENAME;
 	
 
 	//Step #2, build and fire up the window and INPUT CALLBACKS
@@ -340,6 +448,11 @@ int main(int argc, char **argv) {
 	//Step #5a - create the WATER SIMULATOR
 	simulator = new WaterSimulator(256, 256, 4, 1.0f);
 	simulator->depth = 10.0f;
+	if (simulator->AutotuneWorkGroups(workGroupCacheFilename)) {
+		int groupX, groupY;
+		simulator->GetWaveWorkGroupSize(groupX, groupY);
+		std::cout << "Wave work groups are " << groupX << "x" << groupY << std::endl;
+	}
 	simulator->Execute(0);
 
 	//Step #5b, frequency DEV textures
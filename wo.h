@@ -7,8 +7,11 @@
 #include <exception>
 #include "Helpers.h"
 #include "lodepng.h"
+#include "CpuProfiler.h"
 #include <unordered_set>
 #include <unordered_map>
+#include <string>
+#include <vector>
 
 # define INVALID_ID	 0xFFFFFFFF
 
@@ -47,6 +50,14 @@ namespace wo {
 		GLuint _shader_id = INVALID_ID;
 		GLenum _shader_type;
 
+		/*Reads the whole of the given file into the given string.  Returns false if it cannot be opened.*/
+		static bool ReadFile(const char *filename, std::string& contents) {
+			std::ifstream stream(filename, std::ios::in);
+			if (!stream.is_open()) return false;
+			contents.assign((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+			return true;
+		}
+
 	protected:
 
 		/*Creates, but does not compile, the shader.  Use the compile methods to compile and complete the shader.*/
@@ -57,6 +68,14 @@ namespace wo {
 		/*Creates and compiles with the given file loaded as the shader.*/
 		Shader(GLenum shaderType, char* filename) : Shader(shaderType) { CompileFile(filename); }
 
+		/*Creates and compiles a variant of the given file, with the given #defines injected (see CompileFile()).*/
+		Shader(GLenum shaderType, const char* filename, const std::vector<std::string>& defines) : Shader(shaderType) { CompileFile(filename, defines); }
+
+		/*Creates and compiles a variant of the given file, with the given #defines and the given files' code injected (see CompileFile()).*/
+		Shader(GLenum shaderType, const char* filename, const std::vector<std::string>& defines, const std::vector<std::string>& includes) : Shader(shaderType) { 
+			CompileFile(filename, defines, includes); 
+		}
+
 		/*Returns a reference to an uncompiled shader.*/
 		static Shader* Uncompiled(GLenum shadertype) { return new Shader(shadertype); }
 
@@ -86,15 +105,49 @@ namespace wo {
 		/*Compiles the given file name, for the GLSL shader type specified.  Note that this shader must now be bound to a program to be functional.*/
 		bool CompileFile(const char *filename, std::ostream *outStream = &std::cout)
 		{
+			return CompileFile(filename, std::vector<std::string>(), outStream);
+		}
 
-			std::ifstream shaderStream(filename, std::ios::in);
-			if (!shaderStream.is_open()) {
+		/*Compiles a variant of the given file.  Each of the given strings, such as "LOCAL_SIZE_X 32", is made a #define and injected just 
+		after the #version line (which GLSL requires to come first), so that the shader can specialize itself with #ifdef.  Line numbers in 
+		the compiler's messages still match the file.*/
+		bool CompileFile(const char *filename, const std::vector<std::string>& defines, std::ostream *outStream = &std::cout)
+		{
+			return CompileFile(filename, defines, std::vector<std::string>(), outStream);
+		}
+
+		/*As above, but also injects the code of each of the given files after the #defines, so that declarations shared by several shaders 
+		can be kept in one file.  The compiler reports lines in the i-th of these files as lines of source string i + 1.*/
+		bool CompileFile(const char *filename, const std::vector<std::string>& defines, const std::vector<std::string>& includes, std::ostream *outStream = &std::cout)
+		{
+			std::string shaderSourceCode;
+			if (!ReadFile(filename, shaderSourceCode)) {
 				if (outStream) *outStream << "ERROR: Cannot open file." << std::endl;
 				return false;
 			}
 
-			std::string shaderSourceCode((std::istreambuf_iterator<char>(shaderStream)), std::istreambuf_iterator<char>());
-			shaderStream.close();
+			if (!defines.empty() || !includes.empty()) {
+				size_t insertAt = 0;
+				int nextLine = 1;
+				if (shaderSourceCode.compare(0, 8, "#version") == 0) {
+					insertAt = shaderSourceCode.find('\n');
+					insertAt = (insertAt == std::string::npos) ? shaderSourceCode.size() : insertAt + 1;
+					nextLine = 2;
+				}
+				std::string injected;
+				if (insertAt == shaderSourceCode.size() && insertAt > 0) injected += "\n";
+				for (const std::string& define : defines) injected += "#define " + define + "\n";
+				for (size_t i = 0; i < includes.size(); i++) {
+					std::string code;
+					if (!ReadFile(includes[i].c_str(), code)) {
+						if (outStream) *outStream << "ERROR: Cannot open included file " << includes[i] << "." << std::endl;
+						return false;
+					}
+					injected += "#line 1 " + std::to_string(i + 1) + "\n" + code + "\n";
+				}
+				injected += "#line " + std::to_string(nextLine) + (includes.empty() ? "" : " 0") + "\n";
+				shaderSourceCode.insert(insertAt, injected);
+			}
 
 			return CompileCode(shaderSourceCode.data(), outStream);
 		}
@@ -188,6 +241,7 @@ namespace wo {
 			if (bound_program != nullptr) bound_program->Unbind();
 			glUseProgram(_program_id);
 			bound_program = this;
+			return true;
 		}
 		/*Releases the program so it cannot be executed.*/
 		void Unbind() {
@@ -197,7 +251,12 @@ namespace wo {
 
 	protected:
 		/*Returns whether this program is valid, whether this program is bound, and whether the given uniform index is valid.  Note that none of these checks actually query OpenGL, they all track locally maintained fields.*/
-		bool IsValidUniform(GLint uniform_index) { if (bound_program != this || _program_id == INVALID_ID || uniform_index < 0) return false; }
+		bool IsValidUniform(GLint uniform_index) { if (bound_program != this || _program_id == INVALID_ID || uniform_index < 0) return false; return true; }
+
+	public:
+		/*Returns the location of the given uniform name, or -1 if the uniform does not exist for this program.  Setting a uniform by a 
+		location resolved ahead of time skips the name lookup, which is worthwhile for uniforms set on every dispatch.*/
+		GLint GetUniformLocation(const char* name) { auto iter = _uniforms.find(name);	return (iter == _uniforms.end()) ? -1 : iter->second; }
 
 		bool SetUniform(GLint index, float value) { if (!IsValidUniform(index)) { return false; } glUniform1f(index, value); return true; }
 		bool SetUniform(GLint index, float x, float y) { if (!IsValidUniform(index)) { return false; } glUniform2f(index, x, y); return true; }
@@ -211,6 +270,8 @@ namespace wo {
 		bool SetUniforms(GLint index, int count, const int *data) { if (!IsValidUniform(index)) { return false; } glUniform1iv(index, count, data); return true; }
 		bool SetUniforms(GLint index, int count, const float *data) { if (!IsValidUniform(index)) { return false; } glUniform1fv(index, count, data); return true; }
 
+	protected:
+
 		bool SetUniformMatrix2(GLint index, const float *m, int count = 1, bool transpose = false) { glUniformMatrix2fv(index, count, transpose, m); }
 		bool SetUniformMatrix3(GLint index, const float *m, int count = 1, bool transpose = false) { glUniformMatrix3fv(index, count, transpose, m); }
 		bool SetUniformMatrix4(GLint index, const float *m, int count = 1, bool transpose = false) { glUniformMatrix4fv(index, count, transpose, m); }
@@ -310,7 +371,11 @@ namespace wo {
 			glAttachShader(tempProgramID, shaderID);
 			glLinkProgram(tempProgramID);
 
-			//Check for linking errors.
+			//Check for linking errors.  A compute shader which compiles may still fail to link, for instance if its work group is larger 
+			//than the device allows.
+			GLint linkStatus;
+			glGetProgramiv(tempProgramID, GL_LINK_STATUS, &linkStatus);
+			if (linkStatus != GL_TRUE) { glDeleteProgram(tempProgramID); throw std::exception("Problem linking the program."); }
 			if (CHECK_GL_ERROR("ComputerShaderProgram::ctor end") != NULL) throw std::exception("Problem linking the program.");
 
 			_program_id = tempProgramID;
@@ -318,6 +383,9 @@ namespace wo {
 			RegisterUniforms(&std::cout);
 		}
 
+		/*Gets the work group size the shader was compiled with, as x, y and z.*/
+		void GetWorkGroupSize(GLint size[3]) { glGetProgramiv(_program_id, GL_COMPUTE_WORK_GROUP_SIZE, size); }
+
 
 		
 
@@ -606,6 +674,7 @@ namespace wo {
 
 		/*Returns a texture map generated from the images at the given file names.*/
 		static TextureCubeMap* FromFiles(char* posX_filename, char* posY_filename, char* posZ_filename, char* negX_filename, char* negY_filename, char* negZ_filename) {
+			CPU_PROFILE_ZONE("TextureCubeMap::FromFiles");
 
 			char* filenames[6];			
 			filenames[0] = posX_filename;